@@ -0,0 +1,1598 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * exr-chunk.h — Chunk-level OpenEXR decoding for the EXR loader.
+ *
+ * All functions are static inline so this header can be included directly
+ * without creating a separate compilation unit.
+ *
+ * TinyEXR only decodes whole files.  This decodes one scanline chunk at a
+ * time, so the loader can start on the pixels while the rest of the file
+ * is still arriving.  Once the whole file is in memory, the chunks of a
+ * scanline file, or the tiles of any one level of a tiled file, are
+ * decoded in parallel.  It handles the common layouts (no subsampling,
+ * compressed with NONE, RLE, ZIPS, ZIP or PIZ); io-exr.c falls back to
+ * TinyEXR for anything else.
+ */
+
+#ifndef EXR_CHUNK_H
+#define EXR_CHUNK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <glib.h>
+#include <zlib.h>
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#include "tonemap.h"
+#include "parallel.h"
+
+/* Compression and pixel type codes as stored in the file. */
+#define EXR_COMPRESSION_NONE  0
+#define EXR_COMPRESSION_RLE   1
+#define EXR_COMPRESSION_ZIPS  2
+#define EXR_COMPRESSION_ZIP   3
+#define EXR_COMPRESSION_PIZ   4
+
+#define EXR_PIXEL_UINT  0
+#define EXR_PIXEL_HALF  1
+#define EXR_PIXEL_FLOAT 2
+
+/* Level modes and rounding modes of tiled files. */
+#define EXR_LEVEL_ONE     0
+#define EXR_LEVEL_MIPMAP  1
+#define EXR_LEVEL_RIPMAP  2
+
+#define EXR_ROUND_DOWN    0
+#define EXR_ROUND_UP      1
+
+/* ------------------------------------------------------------------ */
+/*  File structure                                                     */
+/* ------------------------------------------------------------------ */
+
+static inline uint32_t
+exr_read_u32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t
+exr_read_u64(const uint8_t *p)
+{
+    return (uint64_t)exr_read_u32(p) | ((uint64_t)exr_read_u32(p + 4) << 32);
+}
+
+/*
+ * exr_header_length — Find the end of a single-part header: the magic
+ * number and version field, the attribute list, and its terminating NUL.
+ *
+ * Returns 1 and sets *length_out if the whole header is in data[0, length),
+ * 0 if more bytes are needed, or -1 if the data can't be a valid header.
+ */
+static inline int
+exr_header_length(const uint8_t *data, size_t length, size_t *length_out)
+{
+    size_t pos = 8;  /* magic number and version field */
+
+    if (length >= 4 && memcmp(data, "\x76\x2f\x31\x01", 4) != 0)
+        return -1;
+
+    while (pos < length) {
+        const uint8_t *name_end, *type_end;
+        uint32_t       size;
+
+        if (data[pos] == 0) {
+            *length_out = pos + 1;  /* end of header */
+            return 1;
+        }
+
+        /* name\0 type\0 size value[size] */
+        name_end = memchr(data + pos, 0, length - pos);
+        if (!name_end)
+            return 0;
+        pos = (size_t)(name_end - data) + 1;
+
+        type_end = (pos < length) ? memchr(data + pos, 0, length - pos) : NULL;
+        if (!type_end)
+            return 0;
+        pos = (size_t)(type_end - data) + 1;
+
+        if (length - pos < 4)
+            return 0;
+        size = exr_read_u32(data + pos);
+        pos += 4;
+
+        if (size > G_MAXINT32)
+            return -1;
+        if (length - pos < size)
+            return 0;
+        pos += size;
+    }
+
+    return 0;
+}
+
+/*
+ * exr_header_attribute — Find attribute @name of type @type in a header
+ * that exr_header_length() has measured as @header_len bytes.
+ *
+ * Returns TRUE and points *value at its *size bytes if present.
+ */
+static inline gboolean
+exr_header_attribute(const uint8_t *data, size_t header_len,
+                     const char *name, const char *type,
+                     const uint8_t **value, size_t *size)
+{
+    size_t pos = 8;
+
+    while (pos < header_len && data[pos] != 0) {
+        const char *attr_name = (const char *)data + pos;
+        const char *attr_type;
+        uint32_t    attr_size;
+
+        pos += strlen(attr_name) + 1;
+        attr_type = (const char *)data + pos;
+        pos += strlen(attr_type) + 1;
+        attr_size = exr_read_u32(data + pos);
+        pos += 4;
+
+        if (strcmp(attr_name, name) == 0 && strcmp(attr_type, type) == 0) {
+            *value = data + pos;
+            *size  = attr_size;
+            return TRUE;
+        }
+        pos += attr_size;
+    }
+
+    return FALSE;
+}
+
+/*
+ * exr_chunk_lines — Scanlines per chunk for a compression method, or 0 if
+ *                   this decoder doesn't handle it.
+ */
+static inline int
+exr_chunk_lines(int compression)
+{
+    switch (compression) {
+    case EXR_COMPRESSION_NONE:
+    case EXR_COMPRESSION_RLE:
+    case EXR_COMPRESSION_ZIPS:
+        return 1;
+    case EXR_COMPRESSION_ZIP:
+        return 16;
+    case EXR_COMPRESSION_PIZ:
+        return 32;
+    default:
+        return 0;
+    }
+}
+
+static inline size_t
+exr_pixel_size(int pixel_type)
+{
+    return pixel_type == EXR_PIXEL_HALF ? 2 : 4;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Sample conversion                                                  */
+/* ------------------------------------------------------------------ */
+
+/* exr_read_sample — One little-endian sample of the given type as float. */
+static inline float
+exr_read_sample(const uint8_t *p, int pixel_type)
+{
+    uint32_t bits;
+    float    f;
+
+    switch (pixel_type) {
+    case EXR_PIXEL_HALF:
+        return tonemap_half_to_float((uint16_t)(p[0] | (p[1] << 8)));
+    case EXR_PIXEL_FLOAT:
+        bits = exr_read_u32(p);
+        memcpy(&f, &bits, sizeof f);
+        return f;
+    default:
+        return (float)exr_read_u32(p);
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/*  Decompression                                                      */
+/* ------------------------------------------------------------------ */
+
+/*
+ * exr_rle_decompress — Undo OpenEXR's byte RLE.  A signed count byte n
+ * is followed by -n literal bytes if negative, else one byte repeated n + 1
+ * times.  Returns FALSE unless the output is exactly out_len bytes.
+ */
+static inline gboolean
+exr_rle_decompress(const uint8_t *in, size_t in_len,
+                   uint8_t *out, size_t out_len)
+{
+    size_t in_pos = 0, out_pos = 0;
+
+    while (in_pos < in_len) {
+        int8_t n = (int8_t)in[in_pos++];
+
+        if (n < 0) {
+            size_t count = (size_t)(-(int)n);
+            if (in_len - in_pos < count || out_len - out_pos < count)
+                return FALSE;
+            memcpy(out + out_pos, in + in_pos, count);
+            in_pos  += count;
+            out_pos += count;
+        } else {
+            size_t count = (size_t)n + 1;
+            if (in_pos >= in_len || out_len - out_pos < count)
+                return FALSE;
+            memset(out + out_pos, in[in_pos++], count);
+            out_pos += count;
+        }
+    }
+
+    return out_pos == out_len;
+}
+
+/*
+ * exr_unpredict — Reverse the byte predictor and the even/odd byte split
+ * that RLE and ZIP compression apply before compressing.
+ */
+static inline void
+exr_unpredict(uint8_t *tmp, size_t len, uint8_t *out)
+{
+    for (size_t i = 1; i < len; i++)
+        tmp[i] = (uint8_t)(tmp[i - 1] + tmp[i] - 128);
+
+    const uint8_t *t1 = tmp;
+    const uint8_t *t2 = tmp + (len + 1) / 2;
+
+    for (size_t i = 0; i < len; i++)
+        out[i] = (i & 1) ? t2[i / 2] : t1[i / 2];
+}
+
+/* ------------------------------------------------------------------ */
+/*  PIZ: Huffman-coded Haar wavelet                                    */
+/* ------------------------------------------------------------------ */
+
+/*
+ * PIZ treats a block as 16-bit words, one plane per channel (FLOAT and
+ * UINT samples are two words each).  The words are squeezed through a
+ * lookup table onto 0..max, wavelet transformed plane by plane, and the
+ * lot Huffman coded.  Decoding undoes those steps in reverse; the layout
+ * follows OpenEXR's ImfPizCompressor and ImfHuf.
+ */
+
+#define EXR_PIZ_BITMAP_SIZE  (65536 / 8)
+
+#define EXR_HUF_ENCSIZE      (65536 + 1)   /* symbols, plus the run code */
+#define EXR_HUF_DECBITS      14            /* bits per primary lookup */
+#define EXR_HUF_DECSIZE      (1 << EXR_HUF_DECBITS)
+
+#define EXR_HUF_SHORT_ZEROCODE_RUN  59
+#define EXR_HUF_LONG_ZEROCODE_RUN   63
+#define EXR_HUF_SHORTEST_LONG_RUN   \
+    (2 + EXR_HUF_LONG_ZEROCODE_RUN - EXR_HUF_SHORT_ZEROCODE_RUN)
+
+/*
+ * ExrHufDec — One primary lookup entry: a code of up to EXR_HUF_DECBITS
+ * bits (len != 0, symbol lit), or the n_long longer codes that start with
+ * these bits, listed at ExrPizTables.long_syms[first].
+ */
+typedef struct {
+    uint32_t len;
+    uint32_t lit;
+    uint32_t n_long;
+    uint32_t first;
+} ExrHufDec;
+
+/* ExrPizTables — Scratch for exr_piz_decompress(), about 1 MiB. */
+typedef struct {
+    uint64_t  hcode[EXR_HUF_ENCSIZE];     /* length | code << 6 */
+    ExrHufDec hdec[EXR_HUF_DECSIZE];
+    uint32_t  long_syms[EXR_HUF_ENCSIZE];
+    uint16_t  lut[65536];
+    uint8_t   bitmap[EXR_PIZ_BITMAP_SIZE];
+} ExrPizTables;
+
+/* MSB-first bit reader over the Huffman data, and the output words. */
+typedef struct {
+    uint64_t       c;
+    int            lc;       /* valid bits at the bottom of c */
+    const uint8_t *in;
+    const uint8_t *in_end;
+    uint16_t      *out;
+    uint16_t      *out_begin;
+    uint16_t      *out_end;
+} ExrHufReader;
+
+static inline gboolean
+exr_huf_get_byte(ExrHufReader *r)
+{
+    if (r->in >= r->in_end)
+        return FALSE;
+    r->c = (r->c << 8) | *r->in++;
+    r->lc += 8;
+    return TRUE;
+}
+
+static inline int
+exr_huf_get_bits(ExrHufReader *r, int n_bits, gboolean *ok)
+{
+    while (r->lc < n_bits) {
+        if (!exr_huf_get_byte(r)) {
+            *ok = FALSE;
+            return 0;
+        }
+    }
+    r->lc -= n_bits;
+    return (int)((r->c >> r->lc) & (((uint64_t)1 << n_bits) - 1));
+}
+
+/*
+ * exr_huf_unpack_table — Read the code lengths of symbols im..iM, with
+ * runs of zero lengths run-length coded, and assign canonical codes.
+ */
+static inline gboolean
+exr_huf_unpack_table(ExrPizTables *t, ExrHufReader *r, int im, int iM)
+{
+    uint64_t *hcode = t->hcode;
+    uint64_t  n[59];
+    uint64_t  code = 0;
+    gboolean  ok = TRUE;
+
+    memset(hcode, 0, sizeof t->hcode);
+
+    for (; im <= iM; im++) {
+        int l = exr_huf_get_bits(r, 6, &ok);
+        int zerun;
+
+        if (!ok)
+            return FALSE;
+
+        if (l == EXR_HUF_LONG_ZEROCODE_RUN) {
+            zerun = exr_huf_get_bits(r, 8, &ok) + EXR_HUF_SHORTEST_LONG_RUN;
+            if (!ok)
+                return FALSE;
+        } else if (l >= EXR_HUF_SHORT_ZEROCODE_RUN) {
+            zerun = l - EXR_HUF_SHORT_ZEROCODE_RUN + 2;
+        } else {
+            hcode[im] = (uint64_t)l;
+            continue;
+        }
+
+        if (im + zerun > iM + 1)
+            return FALSE;
+        im += zerun - 1;   /* lengths are already zero */
+    }
+
+    /* Canonical codes: shorter codes sort first, as the encoder assumes. */
+    memset(n, 0, sizeof n);
+    for (int i = 0; i < EXR_HUF_ENCSIZE; i++)
+        n[hcode[i]]++;
+
+    for (int i = 58; i > 0; i--) {
+        uint64_t next = (code + n[i]) >> 1;
+        n[i] = code;
+        code = next;
+    }
+
+    for (int i = 0; i < EXR_HUF_ENCSIZE; i++) {
+        uint64_t l = hcode[i];
+        if (l > 0)
+            hcode[i] = l | (n[l]++ << 6);
+    }
+
+    return TRUE;
+}
+
+/*
+ * exr_huf_build_decoder — Fill the primary lookup from the code table.
+ * Codes longer than EXR_HUF_DECBITS are listed under their first bits.
+ */
+static inline gboolean
+exr_huf_build_decoder(ExrPizTables *t, int im, int iM)
+{
+    uint32_t n_long = 0;
+
+    memset(t->hdec, 0, sizeof t->hdec);
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = im; i <= iM; i++) {
+            uint64_t code = t->hcode[i] >> 6;
+            int      l    = (int)(t->hcode[i] & 63);
+
+            if (l == 0)
+                continue;
+            if (code >> l)
+                return FALSE;   /* code doesn't fit its length */
+
+            if (l > EXR_HUF_DECBITS) {
+                ExrHufDec *pl = &t->hdec[code >> (l - EXR_HUF_DECBITS)];
+
+                if (pl->len)
+                    return FALSE;
+                if (pass == 0)
+                    pl->n_long++;
+                else
+                    t->long_syms[pl->first + pl->lit++] = (uint32_t)i;
+            } else if (pass == 0) {
+                ExrHufDec *pl = &t->hdec[code << (EXR_HUF_DECBITS - l)];
+
+                for (int j = 1 << (EXR_HUF_DECBITS - l); j > 0; j--, pl++) {
+                    if (pl->len || pl->n_long)
+                        return FALSE;
+                    pl->len = (uint32_t)l;
+                    pl->lit = (uint32_t)i;
+                }
+            }
+        }
+
+        /* Between passes: give each list of long codes its place. */
+        if (pass == 0) {
+            for (int j = 0; j < EXR_HUF_DECSIZE; j++) {
+                if (t->hdec[j].n_long) {
+                    t->hdec[j].first = n_long;
+                    t->hdec[j].lit   = 0;
+                    n_long += t->hdec[j].n_long;
+                }
+            }
+        }
+    }
+
+    return TRUE;
+}
+
+/*
+ * exr_huf_emit — Output symbol @sym, or for the run code @rlc, repeat the
+ * last word as many times again as the next 8 bits say.
+ */
+static inline gboolean
+exr_huf_emit(ExrHufReader *r, uint32_t sym, uint32_t rlc)
+{
+    if (sym == rlc) {
+        gboolean ok = TRUE;
+        int      run = exr_huf_get_bits(r, 8, &ok);
+
+        if (!ok || r->out == r->out_begin || r->out_end - r->out < run)
+            return FALSE;
+
+        uint16_t s = r->out[-1];
+        while (run-- > 0)
+            *r->out++ = s;
+    } else {
+        if (r->out >= r->out_end)
+            return FALSE;
+        *r->out++ = (uint16_t)sym;
+    }
+
+    return TRUE;
+}
+
+/* exr_huf_decode — Decode n_bits of Huffman data into exactly r->out_end. */
+static inline gboolean
+exr_huf_decode(const ExrPizTables *t, ExrHufReader *r, size_t n_bits,
+               uint32_t rlc)
+{
+    const uint64_t *hcode = t->hcode;
+
+    while (r->in < r->in_end) {
+        exr_huf_get_byte(r);
+
+        while (r->lc >= EXR_HUF_DECBITS) {
+            const ExrHufDec *pl = &t->hdec[(r->c >> (r->lc - EXR_HUF_DECBITS)) &
+                                           (EXR_HUF_DECSIZE - 1)];
+
+            if (pl->len) {
+                r->lc -= (int)pl->len;
+                if (!exr_huf_emit(r, pl->lit, rlc))
+                    return FALSE;
+                continue;
+            }
+
+            /* A long code: try each one with these first bits. */
+            uint32_t j;
+
+            for (j = 0; j < pl->n_long; j++) {
+                uint32_t sym = t->long_syms[pl->first + j];
+                int      l   = (int)(hcode[sym] & 63);
+
+                while (r->lc < l && exr_huf_get_byte(r))
+                    ;
+                if (r->lc >= l &&
+                    (hcode[sym] >> 6) ==
+                    ((r->c >> (r->lc - l)) & (((uint64_t)1 << l) - 1))) {
+                    r->lc -= l;
+                    if (!exr_huf_emit(r, sym, rlc))
+                        return FALSE;
+                    break;
+                }
+            }
+
+            if (j == pl->n_long)
+                return FALSE;
+        }
+    }
+
+    /* The last few codes are shorter than a primary lookup.  Drop the
+     * padding bits of the last byte first. */
+    int pad = (int)((8 - n_bits) & 7);
+
+    r->c >>= pad;
+    r->lc -= pad;
+
+    while (r->lc > 0) {
+        const ExrHufDec *pl = &t->hdec[(r->c << (EXR_HUF_DECBITS - r->lc)) &
+                                       (EXR_HUF_DECSIZE - 1)];
+
+        if (!pl->len || (int)pl->len > r->lc)
+            return FALSE;
+        r->lc -= (int)pl->len;
+        if (!exr_huf_emit(r, pl->lit, rlc))
+            return FALSE;
+    }
+
+    return r->out == r->out_end;
+}
+
+/*
+ * exr_huf_uncompress — Decode @size bytes of Huffman-coded words into
+ * exactly @n_raw words at @raw.
+ */
+static inline gboolean
+exr_huf_uncompress(ExrPizTables *t, const uint8_t *data, size_t size,
+                   uint16_t *raw, size_t n_raw)
+{
+    ExrHufReader r;
+    uint32_t     im, iM, n_bits;
+
+    if (size == 0)
+        return n_raw == 0;
+    if (size < 20)
+        return FALSE;
+
+    /* im, iM, table length, bit count, then a reserved word. */
+    im     = exr_read_u32(data);
+    iM     = exr_read_u32(data + 4);
+    n_bits = exr_read_u32(data + 12);
+
+    if (im >= EXR_HUF_ENCSIZE || iM >= EXR_HUF_ENCSIZE || im > iM)
+        return FALSE;
+
+    memset(&r, 0, sizeof r);
+    r.in     = data + 20;
+    r.in_end = data + size;
+
+    if (!exr_huf_unpack_table(t, &r, (int)im, (int)iM) ||
+        !exr_huf_build_decoder(t, (int)im, (int)iM))
+        return FALSE;
+
+    /* The code data starts on the byte after the table. */
+    if ((size_t)(r.in_end - r.in) < ((size_t)n_bits + 7) / 8)
+        return FALSE;
+
+    r.c         = 0;
+    r.lc        = 0;
+    r.in_end    = r.in + ((size_t)n_bits + 7) / 8;
+    r.out       = raw;
+    r.out_begin = raw;
+    r.out_end   = raw + n_raw;
+
+    return exr_huf_decode(t, &r, n_bits, iM);
+}
+
+/*
+ * exr_wdec14, exr_wdec16 — Undo one Haar step on a pair of words.  The
+ * 14-bit form is used when every value fits 14 bits, the 16-bit form
+ * works modulo 2^16.
+ */
+static inline void
+exr_wdec14(uint16_t l, uint16_t h, uint16_t *a, uint16_t *b)
+{
+    int hi = (int16_t)h;
+    int ai = (int16_t)l + (hi & 1) + (hi >> 1);
+
+    *a = (uint16_t)ai;
+    *b = (uint16_t)(ai - hi);
+}
+
+static inline void
+exr_wdec16(uint16_t l, uint16_t h, uint16_t *a, uint16_t *b)
+{
+    int m  = l;
+    int d  = h;
+    int bb = (m - (d >> 1)) & 0xffff;
+    int aa = (d + bb - 0x8000) & 0xffff;
+
+    *a = (uint16_t)aa;
+    *b = (uint16_t)bb;
+}
+
+static inline void
+exr_wdec(gboolean w14, uint16_t l, uint16_t h, uint16_t *a, uint16_t *b)
+{
+    if (w14)
+        exr_wdec14(l, h, a, b);
+    else
+        exr_wdec16(l, h, a, b);
+}
+
+/*
+ * exr_wav2_decode — Inverse 2D Haar wavelet of an nx x ny plane whose
+ * words are @ox apart along x and @oy along y, coarsest level first.
+ */
+static inline void
+exr_wav2_decode(uint16_t *in, int nx, int ox, int ny, int oy, uint16_t mx)
+{
+    const gboolean w14 = mx < (1 << 14);
+    int n = MIN(nx, ny);
+    int p = 1, p2;
+
+    while (p <= n)
+        p <<= 1;
+    p >>= 1;
+    p2 = p;
+    p >>= 1;
+
+    while (p >= 1) {
+        const size_t oy1 = (size_t)oy * (size_t)p;
+        const size_t oy2 = (size_t)oy * (size_t)p2;
+        const size_t ox1 = (size_t)ox * (size_t)p;
+        const size_t ox2 = (size_t)ox * (size_t)p2;
+        const size_t ey  = (size_t)oy * (size_t)(ny - p2);
+        const size_t ex  = (size_t)ox * (size_t)(nx - p2);
+        uint16_t     i00, i01, i10, i11;
+        size_t       py, px;
+
+        for (py = 0; py <= ey; py += oy2) {
+            for (px = py; px <= py + ex; px += ox2) {
+                uint16_t *p00 = in + px;
+                uint16_t *p01 = p00 + ox1;
+                uint16_t *p10 = p00 + oy1;
+                uint16_t *p11 = p10 + ox1;
+
+                exr_wdec(w14, *p00, *p10, &i00, &i10);
+                exr_wdec(w14, *p01, *p11, &i01, &i11);
+                exr_wdec(w14, i00, i01, p00, p01);
+                exr_wdec(w14, i10, i11, p10, p11);
+            }
+
+            /* Odd column at the right. */
+            if (nx & p) {
+                uint16_t *p10 = in + px + oy1;
+
+                exr_wdec(w14, in[px], *p10, &i00, p10);
+                in[px] = i00;
+            }
+        }
+
+        /* Odd line at the bottom. */
+        if (ny & p) {
+            for (px = py; px <= py + ex; px += ox2) {
+                uint16_t *p01 = in + px + ox1;
+
+                exr_wdec(w14, in[px], *p01, &i00, p01);
+                in[px] = i00;
+            }
+        }
+
+        p2 = p;
+        p >>= 1;
+    }
+}
+
+/*
+ * exr_piz_decompress — Decompress a PIZ block of @rows lines of @width
+ * pixels into @raw, @raw_size bytes laid out as exr_convert_lines()
+ * expects.  @tmp holds the word planes on the way.
+ */
+static inline gboolean
+exr_piz_decompress(ExrPizTables *t, const uint8_t *data, size_t size,
+                   int width, int rows, int num_channels,
+                   const int *pixel_types, uint8_t *tmp,
+                   uint8_t *raw, size_t raw_size)
+{
+    uint16_t *words   = (uint16_t *)(void *)tmp;
+    size_t    n_words = raw_size / 2;
+    size_t    pos = 4;
+    uint32_t  min_nz, max_nz, length;
+    int       max_value = 0, k = 0;
+
+    /* --- Bitmap of the words that occur, then the lookup table --- */
+
+    if (size < 4)
+        return FALSE;
+    min_nz = (uint32_t)(data[0] | (data[1] << 8));
+    max_nz = (uint32_t)(data[2] | (data[3] << 8));
+
+    memset(t->bitmap, 0, sizeof t->bitmap);
+    if (min_nz <= max_nz) {
+        if (max_nz >= EXR_PIZ_BITMAP_SIZE || size - pos < max_nz - min_nz + 1)
+            return FALSE;
+        memcpy(t->bitmap + min_nz, data + pos, max_nz - min_nz + 1);
+        pos += max_nz - min_nz + 1;
+    }
+
+    for (int i = 0; i < 65536; i++)
+        if (i == 0 || (t->bitmap[i >> 3] & (1 << (i & 7))))
+            t->lut[k++] = (uint16_t)i;
+    max_value = k - 1;
+    while (k < 65536)
+        t->lut[k++] = 0;
+
+    /* --- Huffman data --- */
+
+    if (size - pos < 4)
+        return FALSE;
+    length = exr_read_u32(data + pos);
+    pos += 4;
+    if (size - pos < length ||
+        !exr_huf_uncompress(t, data + pos, length, words, n_words))
+        return FALSE;
+
+    /* --- Inverse wavelet per plane, then the lookup table --- */
+
+    uint16_t *plane = words;
+
+    for (int c = 0; c < num_channels; c++) {
+        int plane_words = (int)exr_pixel_size(pixel_types[c]) / 2;
+
+        for (int j = 0; j < plane_words; j++)
+            exr_wav2_decode(plane + j, width, plane_words, rows,
+                            width * plane_words, (uint16_t)max_value);
+        plane += (size_t)width * (size_t)rows * (size_t)plane_words;
+    }
+
+    for (size_t i = 0; i < n_words; i++)
+        words[i] = t->lut[words[i]];
+
+    /* --- Planes back to lines of little-endian samples --- */
+
+    uint8_t *out = raw;
+
+    plane = words;
+    for (int c = 0; c < num_channels; c++) {
+        size_t line_words = (size_t)width * exr_pixel_size(pixel_types[c]) / 2;
+
+        for (int y = 0; y < rows; y++) {
+            uint8_t        *dst = out + (size_t)y * (raw_size / (size_t)rows);
+            const uint16_t *src = plane + (size_t)y * line_words;
+
+            for (size_t i = 0; i < line_words; i++) {
+                dst[2 * i]     = (uint8_t)(src[i] & 0xff);
+                dst[2 * i + 1] = (uint8_t)(src[i] >> 8);
+            }
+        }
+        plane += line_words * (size_t)rows;
+        out   += line_words * 2;
+    }
+
+    return TRUE;
+}
+
+/*
+ * exr_decompress — Decompress @size bytes of RLE, ZIPS, ZIP or PIZ data
+ * that expand to exactly @raw_size bytes into @raw, using @tmp as
+ * scratch.  The block is @rows lines of @width pixels; PIZ also needs the
+ * channel types and allocates *piz on first use.
+ */
+static inline gboolean
+exr_decompress(int compression, const uint8_t *data, size_t size,
+               int width, int rows, int num_channels, const int *pixel_types,
+               ExrPizTables **piz, uint8_t *tmp, uint8_t *raw,
+               size_t raw_size)
+{
+    gboolean ok;
+
+    if (compression == EXR_COMPRESSION_PIZ) {
+        if (!*piz)
+            *piz = (ExrPizTables *)malloc(sizeof(ExrPizTables));
+        return *piz &&
+               exr_piz_decompress(*piz, data, size, width, rows,
+                                  num_channels, pixel_types, tmp,
+                                  raw, raw_size);
+    }
+
+    if (compression == EXR_COMPRESSION_RLE) {
+        ok = exr_rle_decompress(data, size, tmp, raw_size);
+    } else {
+        uLongf out_len = (uLongf)raw_size;
+        ok = uncompress(tmp, &out_len, data, (uLong)size) == Z_OK &&
+             out_len == raw_size;
+    }
+
+    if (ok)
+        exr_unpredict(tmp, raw_size, raw);
+    return ok;
+}
+
+/*
+ * ExrScratch — One thread's decompression buffers, allocated on first
+ * use: room for a block before and after unpredicting, and PIZ tables.
+ */
+typedef struct {
+    uint8_t      *buf;
+    ExrPizTables *piz;
+} ExrScratch;
+
+static inline void
+exr_scratch_clear(ExrScratch *sc)
+{
+    free(sc->buf);
+    free(sc->piz);
+    memset(sc, 0, sizeof *sc);
+}
+
+/*
+ * exr_block_decompress — Uncompressed pixels of a block (chunk or tile) of
+ * @rows lines of @width pixels, @raw_size bytes, from its @size bytes of
+ * data.  Blocks stored uncompressed are returned as is; others are
+ * expanded into @sc, sized for blocks of up to @max_bytes.  Returns NULL
+ * if the data is corrupt or memory runs out.
+ */
+static inline const uint8_t *
+exr_block_decompress(ExrScratch *sc, size_t max_bytes, int compression,
+                     const uint8_t *data, size_t size, int width, int rows,
+                     int num_channels, const int *pixel_types,
+                     size_t raw_size)
+{
+    if (size == raw_size)
+        return data;
+    if (size > raw_size || compression == EXR_COMPRESSION_NONE)
+        return NULL;
+
+    if (!sc->buf) {
+        sc->buf = (uint8_t *)malloc(max_bytes * 2);
+        if (!sc->buf)
+            return NULL;
+    }
+
+    if (!exr_decompress(compression, data, size, width, rows, num_channels,
+                        pixel_types, &sc->piz, sc->buf, sc->buf + max_bytes,
+                        raw_size))
+        return NULL;
+
+    return sc->buf + max_bytes;
+}
+
+/*
+ * exr_out_type — The sample type decoded pixels are kept in: HALF if R, G,
+ * B (and A) are all HALF, since the tonemapper widens half samples itself
+ * and they take half the memory; FLOAT otherwise.
+ */
+static inline int
+exr_out_type(const int *pixel_types, const int rgba[4])
+{
+    for (int c = 0; c < 4; c++)
+        if (rgba[c] >= 0 && pixel_types[rgba[c]] != EXR_PIXEL_HALF)
+            return EXR_PIXEL_FLOAT;
+    return EXR_PIXEL_HALF;
+}
+
+/*
+ * exr_convert_lines — Gather the R, G, B (and A) samples of @rows
+ * uncompressed lines of @width pixels into interleaved pixels of
+ * @out_type, as chosen by exr_out_type().
+ *
+ * Each line holds every channel's samples in turn, in file order.  Row r
+ * of the result starts dst_stride samples after row r - 1.
+ */
+static inline void
+exr_convert_lines(const uint8_t *raw, int rows, int width,
+                  int num_channels, const int *pixel_types,
+                  const int rgba[4], int out_channels, int out_type,
+                  void *dst, size_t dst_stride)
+{
+    const size_t out_ch = (size_t)out_channels;
+    size_t       offset[4];
+    size_t       line_bytes = 0;
+
+    for (int ch = 0; ch < num_channels; ch++) {
+        for (size_t c = 0; c < out_ch; c++)
+            if (rgba[c] == ch)
+                offset[c] = line_bytes;
+        line_bytes += (size_t)width * exr_pixel_size(pixel_types[ch]);
+    }
+
+    for (int r = 0; r < rows; r++) {
+        const uint8_t *line = raw + (size_t)r * line_bytes;
+
+        for (size_t c = 0; c < out_ch; c++) {
+            int            type = pixel_types[rgba[c]];
+            size_t         step = exr_pixel_size(type);
+            const uint8_t *src  = line + offset[c];
+
+            if (out_type == EXR_PIXEL_HALF) {
+                /* Half stays half: just interleave. */
+                uint16_t *row = (uint16_t *)dst + (size_t)r * dst_stride;
+
+                for (int x = 0; x < width; x++, src += 2)
+                    row[(size_t)x * out_ch + c] =
+                        (uint16_t)(src[0] | (src[1] << 8));
+            } else {
+                float *row = (float *)dst + (size_t)r * dst_stride;
+
+                for (int x = 0; x < width; x++, src += step)
+                    row[(size_t)x * out_ch + c] = exr_read_sample(src, type);
+            }
+        }
+    }
+}
+
+/*
+ * exr_stats_add — tonemap_stats_add() for n pixels of @out_type.
+ */
+static inline void
+exr_stats_add(TonemapStats *stats, const void *pixels, int out_type,
+              size_t n, int out_channels)
+{
+    if (out_type == EXR_PIXEL_HALF)
+        tonemap_stats_add_half(stats, (const uint16_t *)pixels, n,
+                               out_channels);
+    else
+        tonemap_stats_add(stats, (const float *)pixels, n, out_channels);
+}
+
+/*
+ * exr_tonemap — tonemap_reinhard_apply() at @quality for pixels of
+ * @out_type.  Without @stats they are gathered here, from a sample of
+ * about @sample_budget pixels when that is nonzero (see
+ * tonemap_stats_sample()), else from every pixel.
+ */
+static inline void
+exr_tonemap(const void *pixels, int out_type, uint8_t *srgb_out,
+            int rowstride, int width, int height, int out_channels,
+            const TonemapStats *stats, size_t sample_budget,
+            TonemapQuality quality)
+{
+    TonemapStats gathered;
+
+    if (!stats) {
+        tonemap_stats_sample(&gathered, pixels,
+                             out_type == EXR_PIXEL_HALF ?
+                                 tonemap_half_loader() : tonemap_load_float,
+                             width, height, out_channels, sample_budget);
+        stats = &gathered;
+    }
+
+    if (out_type == EXR_PIXEL_HALF)
+        tonemap_reinhard_half_apply((const uint16_t *)pixels, srgb_out,
+                                    rowstride, width, height, out_channels,
+                                    stats, quality);
+    else
+        tonemap_reinhard_apply((const float *)pixels, srgb_out, rowstride,
+                               width, height, out_channels, stats, quality);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Chunk decoder                                                      */
+/* ------------------------------------------------------------------ */
+
+/*
+ * ExrChunkLayout — What the decoder needs from the header.
+ *
+ * Channels are listed in file order, which is the order their samples
+ * appear within each scanline of a chunk.
+ */
+typedef struct {
+    int     width;          /* data window */
+    int     height;
+    int     min_y;
+    int     compression;
+    int     lines;          /* scanlines per chunk */
+    int     chunk_count;
+    int     num_channels;
+    int    *pixel_types;    /* per channel */
+    int     rgba[4];        /* channel index of R, G, B, A; A may be -1 */
+    size_t  line_bytes;     /* uncompressed bytes per scanline */
+} ExrChunkLayout;
+
+/*
+ * ExrChunkDecoder — Decodes chunks in any order into an interleaved half
+ * or float image, gathering exposure statistics as it goes.
+ *
+ * Each thread adds to its own exposure histogram; merging them gives the
+ * same statistics whatever order the chunks were decoded in, and however
+ * many threads did it.
+ */
+typedef struct {
+    ExrChunkLayout layout;
+    int            out_channels;   /* 3, or 4 with alpha */
+    int            out_type;       /* EXR_PIXEL_HALF or EXR_PIXEL_FLOAT */
+    void          *pixels;         /* width * height * out_channels */
+    ExrScratch     scratch[PARALLEL_MAX_THREADS];
+    guint8        *chunk_done;
+    int            chunks_done;
+    size_t         sample_budget;  /* nonzero: no statistics while decoding */
+    TonemapStats  *stats[PARALLEL_MAX_THREADS];   /* per worker, on demand */
+} ExrChunkDecoder;
+
+/*
+ * exr_chunk_decoder_init — Set up a decoder, taking ownership of
+ * layout->pixel_types.  The layout must already have been checked with
+ * exr_chunk_lines().
+ */
+static inline gboolean
+exr_chunk_decoder_init(ExrChunkDecoder *dec, const ExrChunkLayout *layout,
+                       GError **error)
+{
+    size_t line_bytes = 0;
+
+    memset(dec, 0, sizeof *dec);
+    dec->layout       = *layout;
+    dec->out_channels = (layout->rgba[3] >= 0) ? 4 : 3;
+    dec->out_type     = exr_out_type(layout->pixel_types, layout->rgba);
+
+    for (int c = 0; c < layout->num_channels; c++)
+        line_bytes += (size_t)layout->width *
+                      exr_pixel_size(layout->pixel_types[c]);
+    dec->layout.line_bytes = line_bytes;
+
+    dec->pixels = malloc((size_t)layout->width * (size_t)layout->height *
+                         (size_t)dec->out_channels *
+                         exr_pixel_size(dec->out_type));
+    dec->chunk_done = g_new0(guint8, (gsize)layout->chunk_count);
+
+    if (!dec->pixels) {
+        g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                            GDK_PIXBUF_ERROR_FAILED,
+                            "Out of memory allocating EXR buffers");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static inline void
+exr_chunk_decoder_clear(ExrChunkDecoder *dec)
+{
+    g_free(dec->layout.pixel_types);
+    g_free(dec->chunk_done);
+    free(dec->pixels);
+    for (unsigned i = 0; i < PARALLEL_MAX_THREADS; i++) {
+        exr_scratch_clear(&dec->scratch[i]);
+        g_free(dec->stats[i]);
+    }
+    memset(dec, 0, sizeof *dec);
+}
+
+static inline gboolean
+exr_chunk_decoder_done(const ExrChunkDecoder *dec)
+{
+    return dec->chunks_done == dec->layout.chunk_count;
+}
+
+/* exr_chunk_decoder_stats — Statistics of a fully decoded image. */
+static inline void
+exr_chunk_decoder_stats(const ExrChunkDecoder *dec, TonemapStats *stats)
+{
+    tonemap_stats_init(stats);
+    for (unsigned i = 0; i < PARALLEL_MAX_THREADS; i++)
+        if (dec->stats[i])
+            tonemap_stats_merge(stats, dec->stats[i]);
+}
+
+/*
+ * exr_chunk_max_size — Largest valid data size for a chunk: compressed
+ * data that wouldn't be smaller than the raw pixels is stored raw.
+ */
+static inline size_t
+exr_chunk_max_size(const ExrChunkDecoder *dec)
+{
+    return dec->layout.line_bytes * (size_t)dec->layout.lines;
+}
+
+/* exr_chunk_rows — Scanlines in chunk @index; the last may be short. */
+static inline int
+exr_chunk_rows(const ExrChunkDecoder *dec, int index)
+{
+    const ExrChunkLayout *l = &dec->layout;
+
+    return MIN(l->lines, l->height - index * l->lines);
+}
+
+/*
+ * exr_chunk_claim — Check the header of the chunk starting at scanline @y
+ * (as stored in the file) with @size bytes of data, and mark it as seen.
+ * Returns its index, or -1 with @error set.
+ */
+static inline int
+exr_chunk_claim(ExrChunkDecoder *dec, int32_t y, size_t size, GError **error)
+{
+    const ExrChunkLayout *l = &dec->layout;
+    int64_t first = (int64_t)y - l->min_y;
+    int     index;
+    size_t  raw_size;
+
+    if (first < 0 || first >= l->height || first % l->lines != 0) {
+        g_set_error(error, GDK_PIXBUF_ERROR,
+                    GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                    "EXR chunk has invalid scanline %d", (int)y);
+        return -1;
+    }
+
+    index = (int)(first / l->lines);
+
+    if (dec->chunk_done[index]) {
+        g_set_error(error, GDK_PIXBUF_ERROR,
+                    GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                    "EXR chunk for scanline %d appears twice", (int)y);
+        return -1;
+    }
+
+    raw_size = l->line_bytes * (size_t)exr_chunk_rows(dec, index);
+    if (size > raw_size ||
+        (size < raw_size && l->compression == EXR_COMPRESSION_NONE)) {
+        g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                            GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                            "EXR chunk has invalid size");
+        return -1;
+    }
+
+    dec->chunk_done[index] = 1;
+    return index;
+}
+
+/*
+ * exr_chunk_decode_at — Decode claimed chunk @index into its rows of the
+ * image, using @worker's scratch.  Different chunks may be decoded on
+ * different threads at once.  Returns FALSE if the data is corrupt.
+ */
+static inline gboolean
+exr_chunk_decode_at(ExrChunkDecoder *dec, int index, const uint8_t *data,
+                    size_t size, unsigned worker)
+{
+    const ExrChunkLayout *l = &dec->layout;
+    const int      rows  = exr_chunk_rows(dec, index);
+    const size_t   first = (size_t)index * (size_t)l->lines;
+    const uint8_t *raw;
+
+    raw = exr_block_decompress(&dec->scratch[worker], exr_chunk_max_size(dec),
+                               l->compression, data, size, l->width, rows,
+                               l->num_channels, l->pixel_types,
+                               l->line_bytes * (size_t)rows);
+    if (!raw)
+        return FALSE;
+
+    /* --- Interleave the R, G, B, A samples --- */
+
+    const size_t  stride = (size_t)l->width * (size_t)dec->out_channels;
+    const size_t  sample = exr_pixel_size(dec->out_type);
+    uint8_t      *dst    = (uint8_t *)dec->pixels + first * stride * sample;
+    TonemapStats *stats;
+
+    exr_convert_lines(raw, rows, l->width, l->num_channels, l->pixel_types,
+                      l->rgba, dec->out_channels, dec->out_type, dst, stride);
+
+    if (dec->sample_budget > 0)
+        return TRUE;  /* left to a sampled pass over the whole image */
+
+    if (!dec->stats[worker])
+        dec->stats[worker] = g_new0(TonemapStats, 1);
+    stats = dec->stats[worker];
+    for (int r = 0; r < rows; r++)
+        exr_stats_add(stats, dst + (size_t)r * stride * sample,
+                      dec->out_type, (size_t)l->width, dec->out_channels);
+
+    return TRUE;
+}
+
+/*
+ * exr_chunk_decode — Decode one scanline chunk.
+ *
+ * @y:     The chunk's first scanline, as stored in the file.
+ * @data:  The chunk's pixel data, @size bytes.
+ */
+static inline gboolean
+exr_chunk_decode(ExrChunkDecoder *dec, int32_t y,
+                 const uint8_t *data, size_t size, GError **error)
+{
+    int index = exr_chunk_claim(dec, y, size, error);
+
+    if (index < 0)
+        return FALSE;
+
+    if (!exr_chunk_decode_at(dec, index, data, size, 0)) {
+        g_set_error(error, GDK_PIXBUF_ERROR,
+                    GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                    "Failed to decompress EXR chunk at scanline %d", (int)y);
+        return FALSE;
+    }
+
+    dec->chunks_done++;
+    return TRUE;
+}
+
+typedef struct {
+    ExrChunkDecoder *dec;
+    const uint8_t  **data;      /* per chunk */
+    size_t          *size;      /* per chunk */
+    guint8          *failed;    /* per chunk */
+} ExrChunkJob;
+
+static inline void
+exr_chunk_task(size_t index, unsigned worker, void *user_data)
+{
+    ExrChunkJob *job = (ExrChunkJob *)user_data;
+
+    if (!exr_chunk_decode_at(job->dec, (int)index, job->data[index],
+                             job->size[index], worker))
+        job->failed[index] = 1;
+}
+
+/*
+ * exr_chunks_decode — Decode every chunk of a scanline file held whole in
+ * memory, its offset table at @table_start.
+ *
+ * The offset table and chunk headers are checked first, on the calling
+ * thread; the chunks themselves are then decompressed on up to
+ * @n_threads threads, each into its own rows.
+ */
+static inline gboolean
+exr_chunks_decode(ExrChunkDecoder *dec, const uint8_t *file, size_t length,
+                  size_t table_start, unsigned n_threads, GError **error)
+{
+    const int   chunk_count = dec->layout.chunk_count;
+    ExrChunkJob job;
+    size_t      table_end;
+    gboolean    result = FALSE;
+
+    if (table_start > length ||
+        (length - table_start) / 8 < (size_t)chunk_count) {
+        g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                            GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                            "EXR pixel data truncated");
+        return FALSE;
+    }
+    table_end = table_start + (size_t)chunk_count * 8;
+
+    job.dec    = dec;
+    job.data   = g_new(const uint8_t *, (gsize)chunk_count);
+    job.size   = g_new(size_t, (gsize)chunk_count);
+    job.failed = g_new0(guint8, (gsize)chunk_count);
+
+    /* --- Chunks: int32 y, int32 size, then the data --- */
+
+    for (int i = 0; i < chunk_count; i++) {
+        guint64  offset = exr_read_u64(file + table_start + (size_t)i * 8);
+        uint32_t size;
+        int      index;
+
+        if (offset < table_end) {
+            g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                                GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                                "EXR offset table is corrupt");
+            goto cleanup;
+        }
+        size = (offset <= length && length - offset >= 8)
+             ? exr_read_u32(file + offset + 4) : 0;
+        if (size > exr_chunk_max_size(dec)) {
+            g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                                GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                                "EXR chunk has invalid size");
+            goto cleanup;
+        }
+        if (offset > length || length - offset < 8 ||
+            length - offset - 8 < size) {
+            g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                                GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                                "EXR pixel data truncated");
+            goto cleanup;
+        }
+
+        index = exr_chunk_claim(dec, (int32_t)exr_read_u32(file + offset),
+                                size, error);
+        if (index < 0)
+            goto cleanup;
+
+        job.data[index] = file + offset + 8;
+        job.size[index] = size;
+    }
+
+    /* Every index was claimed exactly once, so all are filled in. */
+    parallel_for((size_t)chunk_count, n_threads, exr_chunk_task, &job);
+
+    for (int i = 0; i < chunk_count; i++) {
+        if (job.failed[i]) {
+            g_set_error(error, GDK_PIXBUF_ERROR,
+                        GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                        "Failed to decompress EXR chunk at scanline %d",
+                        dec->layout.min_y + i * dec->layout.lines);
+            goto cleanup;
+        }
+    }
+
+    dec->chunks_done = chunk_count;
+    result = TRUE;
+
+cleanup:
+    g_free(job.data);
+    g_free(job.size);
+    g_free(job.failed);
+
+    return result;
+}
+
+
+/* ------------------------------------------------------------------ */
+/*  Tiled images                                                       */
+/* ------------------------------------------------------------------ */
+
+/*
+ * ExrTileLayout — What the tile decoder needs from the header.  Tiles
+ * start at the data window origin of each level.
+ */
+typedef struct {
+    int     width;          /* data window, i.e. level (0, 0) */
+    int     height;
+    int     tile_width;
+    int     tile_height;
+    int     level_mode;
+    int     rounding;
+    int     compression;
+    int     num_channels;
+    const int *pixel_types;  /* per channel */
+    int     rgba[4];         /* channel index of R, G, B, A; A may be -1 */
+} ExrTileLayout;
+
+/* exr_level_size — Size of one side of the image at a level. */
+static inline int
+exr_level_size(int size, int level, int rounding)
+{
+    gint64 s = size;
+
+    if (rounding == EXR_ROUND_UP)
+        s += ((gint64)1 << level) - 1;
+    s >>= level;
+
+    return s > 0 ? (int)s : 1;
+}
+
+/* exr_level_count — Levels down to a side of 1. */
+static inline int
+exr_level_count(int size, int rounding)
+{
+    int n = 1;
+
+    while (exr_level_size(size, n - 1, rounding) > 1)
+        n++;
+    return n;
+}
+
+/*
+ * exr_tile_levels — Number of levels along x and y.  Mipmap levels shrink
+ * both sides together, so only (l, l) exists.
+ */
+static inline void
+exr_tile_levels(const ExrTileLayout *l, int *levels_x, int *levels_y)
+{
+    switch (l->level_mode) {
+    case EXR_LEVEL_MIPMAP:
+        *levels_x = *levels_y =
+            exr_level_count(MAX(l->width, l->height), l->rounding);
+        break;
+    case EXR_LEVEL_RIPMAP:
+        *levels_x = exr_level_count(l->width, l->rounding);
+        *levels_y = exr_level_count(l->height, l->rounding);
+        break;
+    default:
+        *levels_x = *levels_y = 1;
+        break;
+    }
+}
+
+/* exr_tile_grid — Tiles across and down at level (lx, ly). */
+static inline void
+exr_tile_grid(const ExrTileLayout *l, int lx, int ly,
+              int *tiles_x, int *tiles_y)
+{
+    int w = exr_level_size(l->width, lx, l->rounding);
+    int h = exr_level_size(l->height, ly, l->rounding);
+
+    *tiles_x = (int)(((gint64)w + l->tile_width - 1) / l->tile_width);
+    *tiles_y = (int)(((gint64)h + l->tile_height - 1) / l->tile_height);
+}
+
+/*
+ * exr_tile_first_chunk — Offset table index of the first tile of level
+ * (lx, ly).  The table lists levels in order, x varying fastest for
+ * ripmaps; with (lx, ly) past the last level it gives the table length.
+ */
+static inline gint64
+exr_tile_first_chunk(const ExrTileLayout *l, int lx, int ly)
+{
+    int    levels_x, levels_y, tx, ty;
+    gint64 index = 0;
+
+    exr_tile_levels(l, &levels_x, &levels_y);
+
+    for (int y = 0; y < levels_y; y++) {
+        for (int x = 0; x < levels_x; x++) {
+            if (l->level_mode == EXR_LEVEL_MIPMAP && x != y)
+                continue;
+            if (x == lx && y == ly)
+                return index;
+            exr_tile_grid(l, x, y, &tx, &ty);
+            index += (gint64)tx * ty;
+        }
+    }
+
+    return index;
+}
+
+/* exr_tile_chunk_count — Length of the offset table. */
+static inline gint64
+exr_tile_chunk_count(const ExrTileLayout *l)
+{
+    return exr_tile_first_chunk(l, -1, -1);
+}
+
+typedef struct {
+    const ExrTileLayout *layout;
+    const uint8_t       *file;
+    size_t               length;
+    size_t               table_start;
+    size_t               table_end;
+    int                  level_x;
+    int                  level_y;
+    int                  level_width;
+    int                  tiles_x;
+    gint64               first_chunk;
+    size_t               pixel_bytes;   /* all channels of one pixel */
+    size_t               tile_bytes;    /* largest tile, uncompressed */
+    int                  out_channels;
+    int                  out_type;
+    void                *pixels;
+    ExrScratch           scratch[PARALLEL_MAX_THREADS];
+    guint8              *failed;        /* per tile */
+} ExrTileJob;
+
+static inline gboolean
+exr_tile_decode(ExrTileJob *job, size_t tile, unsigned worker)
+{
+    const ExrTileLayout *l = job->layout;
+    const int  tx = (int)(tile % (size_t)job->tiles_x);
+    const int  ty = (int)(tile / (size_t)job->tiles_x);
+    const int  level_height = exr_level_size(l->height, job->level_y,
+                                             l->rounding);
+    size_t     entry = job->table_start +
+                       (size_t)(job->first_chunk + (gint64)tile) * 8;
+    guint64    offset;
+    size_t     size, raw_size;
+    const uint8_t *chunk, *raw;
+
+    /* --- Chunk: int32 tile x, y, level x, y, int32 size, then data --- */
+
+    offset = exr_read_u64(job->file + entry);
+    if (offset < job->table_end || offset > job->length ||
+        job->length - offset < 20)
+        return FALSE;
+
+    chunk = job->file + offset;
+    if ((int32_t)exr_read_u32(chunk) != tx ||
+        (int32_t)exr_read_u32(chunk + 4) != ty ||
+        (int32_t)exr_read_u32(chunk + 8) != job->level_x ||
+        (int32_t)exr_read_u32(chunk + 12) != job->level_y)
+        return FALSE;
+
+    size = exr_read_u32(chunk + 16);
+    if (job->length - offset - 20 < size)
+        return FALSE;
+
+    /* Edge tiles are cut short at the level's data window. */
+    int x0 = tx * l->tile_width;
+    int y0 = ty * l->tile_height;
+    int w  = MIN(l->tile_width, job->level_width - x0);
+    int h  = MIN(l->tile_height, level_height - y0);
+
+    raw_size = (size_t)w * (size_t)h * job->pixel_bytes;
+
+    /* --- Decompress into this worker's scratch --- */
+
+    raw = exr_block_decompress(&job->scratch[worker], job->tile_bytes,
+                               l->compression, chunk + 20, size, w, h,
+                               l->num_channels, l->pixel_types, raw_size);
+    if (!raw)
+        return FALSE;
+
+    /* --- Straight into place in the interleaved image --- */
+
+    size_t stride = (size_t)job->level_width * (size_t)job->out_channels;
+    size_t first  = (size_t)y0 * stride +
+                    (size_t)x0 * (size_t)job->out_channels;
+
+    exr_convert_lines(raw, h, w, l->num_channels, l->pixel_types, l->rgba,
+                      job->out_channels, job->out_type,
+                      (uint8_t *)job->pixels +
+                      first * exr_pixel_size(job->out_type),
+                      stride);
+    return TRUE;
+}
+
+static inline void
+exr_tile_task(size_t tile, unsigned worker, void *user_data)
+{
+    ExrTileJob *job = (ExrTileJob *)user_data;
+
+    if (!exr_tile_decode(job, tile, worker))
+        job->failed[tile] = 1;
+}
+
+/*
+ * exr_tiles_decode — Decode level (lx, ly) of a tiled file held whole in
+ * memory, its offset table at @table_start, into @pixels: level width x
+ * level height interleaved pixels of out_channels samples of the type
+ * exr_out_type() gives.
+ *
+ * Tiles are independent, so they are decompressed on up to @n_threads
+ * threads, each written straight to its place in @pixels.
+ */
+static inline gboolean
+exr_tiles_decode(const ExrTileLayout *l, const uint8_t *file, size_t length,
+                 size_t table_start, int lx, int ly,
+                 void *pixels, int out_channels, unsigned n_threads,
+                 GError **error)
+{
+    ExrTileJob job;
+    int        tiles_y;
+    size_t     n_tiles;
+    gboolean   result = TRUE;
+
+    memset(&job, 0, sizeof job);
+    job.layout       = l;
+    job.file         = file;
+    job.length       = length;
+    job.table_start  = table_start;
+    job.level_x      = lx;
+    job.level_y      = ly;
+    job.level_width  = exr_level_size(l->width, lx, l->rounding);
+    job.first_chunk  = exr_tile_first_chunk(l, lx, ly);
+    job.out_channels = out_channels;
+    job.out_type     = exr_out_type(l->pixel_types, l->rgba);
+    job.pixels       = pixels;
+
+    exr_tile_grid(l, lx, ly, &job.tiles_x, &tiles_y);
+    n_tiles = (size_t)job.tiles_x * (size_t)tiles_y;
+
+    if (table_start > length ||
+        (length - table_start) / 8 < (size_t)exr_tile_chunk_count(l)) {
+        g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                            GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                            "EXR offset table is truncated");
+        return FALSE;
+    }
+    job.table_end = table_start + (size_t)exr_tile_chunk_count(l) * 8;
+
+    for (int c = 0; c < l->num_channels; c++)
+        job.pixel_bytes += exr_pixel_size(l->pixel_types[c]);
+    job.tile_bytes = (size_t)MIN(l->tile_width, job.level_width) *
+                     (size_t)MIN(l->tile_height,
+                                 exr_level_size(l->height, ly, l->rounding)) *
+                     job.pixel_bytes;
+    job.failed = g_new0(guint8, n_tiles);
+
+    parallel_for(n_tiles, n_threads, exr_tile_task, &job);
+
+    for (size_t t = 0; t < n_tiles; t++) {
+        if (job.failed[t]) {
+            g_set_error(error, GDK_PIXBUF_ERROR,
+                        GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                        "Failed to decode EXR tile (%d, %d)",
+                        (int)(t % (size_t)job.tiles_x),
+                        (int)(t / (size_t)job.tiles_x));
+            result = FALSE;
+            break;
+        }
+    }
+
+    for (unsigned i = 0; i < PARALLEL_MAX_THREADS; i++)
+        exr_scratch_clear(&job.scratch[i]);
+    g_free(job.failed);
+
+    return result;
+}
+
+#endif /* EXR_CHUNK_H */
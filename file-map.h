@@ -0,0 +1,160 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * file-map.h — Whole-file input for the EXR and HDR atomic loaders.
+ *
+ * All functions are static inline so this header can be included directly
+ * without creating a separate compilation unit.
+ *
+ * file_map_load() maps a regular file read-only and hands the decoder the
+ * mapping itself, so the file is never copied into an anonymous buffer.
+ * Anything that cannot be mapped (pipes, empty files, platforms without
+ * mmap) is read into a g_malloc()ed buffer instead.
+ */
+
+#ifndef FILE_MAP_H
+#define FILE_MAP_H
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#ifdef G_OS_UNIX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+typedef struct {
+    const guint8 *data;
+    gsize         length;
+    void         *mapping;   /* munmap() on clear, or NULL */
+    guint8       *copy;      /* g_free() on clear, or NULL */
+} FileMap;
+
+static inline gboolean
+file_map_check_size(gint64 size, gsize max_size, const char *format,
+                    GError **error)
+{
+    if (size < 0) {
+        g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
+                    "Failed to determine %s file size", format);
+        return FALSE;
+    }
+
+    if ((guint64)size > max_size) {
+        g_set_error(error, GDK_PIXBUF_ERROR,
+                    GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                    "%s file too large (%" G_GINT64_FORMAT " bytes, "
+                    "limit %" G_GSIZE_FORMAT ")",
+                    format, size, max_size);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+#ifdef G_OS_UNIX
+/*
+ * file_map_try_mmap — Map @f if it is a non-empty regular file.  Returns
+ * 1 when mapped, 0 to fall back to reading, -1 with @error set when the
+ * file is too large.
+ *
+ * The mapping is MAP_PRIVATE and read-only.  Decoders walk the file front
+ * to back, so the kernel is told to read ahead aggressively and may drop
+ * pages behind the cursor.
+ */
+static inline int
+file_map_try_mmap(FileMap *map, FILE *f, gsize max_size,
+                  const char *format, GError **error)
+{
+    struct stat st;
+    void       *addr;
+    int         fd = fileno(f);
+
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+        st.st_size <= 0)
+        return 0;
+
+    if (!file_map_check_size((gint64)st.st_size, max_size, format, error))
+        return -1;
+
+    addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED)
+        return 0;
+
+    posix_madvise(addr, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+    posix_madvise(addr, (size_t)st.st_size, POSIX_MADV_WILLNEED);
+
+    map->mapping = addr;
+    map->data    = (const guint8 *)addr;
+    map->length  = (gsize)st.st_size;
+    return 1;
+}
+#endif
+
+/*
+ * file_map_load — Make the whole of @f available as map->data.  @format
+ * names the file type in error messages.  On failure @error is set and
+ * @map is left empty; either way, release it with file_map_clear().
+ */
+static inline gboolean
+file_map_load(FileMap *map, FILE *f, gsize max_size, const char *format,
+              GError **error)
+{
+    long size;
+
+    memset(map, 0, sizeof(*map));
+
+#ifdef G_OS_UNIX
+    switch (file_map_try_mmap(map, f, max_size, format, error)) {
+    case 1:
+        return TRUE;
+    case -1:
+        return FALSE;
+    default:
+        break;
+    }
+#endif
+
+    if (fseek(f, 0, SEEK_END) != 0) {
+        g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
+                    "Failed to seek in %s file", format);
+        return FALSE;
+    }
+
+    size = ftell(f);
+    if (!file_map_check_size((gint64)size, max_size, format, error))
+        return FALSE;
+
+    if (fseek(f, 0, SEEK_SET) != 0) {
+        g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
+                    "Failed to rewind %s file", format);
+        return FALSE;
+    }
+
+    map->copy = (guint8 *)g_malloc((gsize)size);
+    if (fread(map->copy, 1, (gsize)size, f) != (gsize)size) {
+        g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
+                    "Failed to read %s file", format);
+        g_clear_pointer(&map->copy, g_free);
+        return FALSE;
+    }
+
+    map->data   = map->copy;
+    map->length = (gsize)size;
+    return TRUE;
+}
+
+static inline void
+file_map_clear(FileMap *map)
+{
+#ifdef G_OS_UNIX
+    if (map->mapping != NULL)
+        munmap(map->mapping, map->length);
+#endif
+    g_free(map->copy);
+    memset(map, 0, sizeof(*map));
+}
+
+#endif /* FILE_MAP_H */
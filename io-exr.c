@@ -17,12 +17,26 @@
 #include <tinyexr.h>
 
 #include "tonemap.h"
+#include "file-map.h"
+#include "exr-chunk.h"
 
 /* Sanity limits to reject pathological files early. */
 #define EXR_MAX_DIMENSION  8192
 #define EXR_MAX_PIXELS     (64 * 1024 * 1024)   /* 64 Mpixels */
 #define EXR_MAX_FILE_SIZE  (256 * 1024 * 1024)   /* 256 MB */
 
+/* Environment variable naming the layer to show, e.g. "beauty". */
+#define EXR_LAYER_ENV      "GDK_PIXBUF_HDR_EXR_LAYER"
+
+/* Chunk-by-chunk decode of a file whose layout exr-chunk.h handles. */
+typedef struct {
+    ExrChunkDecoder dec;
+    gsize           table_start;   /* file offset of the offset table */
+    guint64        *offsets;       /* chunk offsets, sorted; NULL until read */
+    int             next;          /* next entry of offsets[] to decode */
+    TonemapQuality  quality;       /* of the load, for the tonemap pass */
+} ExrStream;
+
 /* Context for incremental (progressive) loading. */
 typedef struct {
     GByteArray                 *buffer;
@@ -30,25 +44,111 @@ typedef struct {
     GdkPixbufModulePreparedFunc prepared_func;
     GdkPixbufModuleUpdatedFunc  updated_func;
     gpointer                    user_data;
+    gsize                       bytes_seen;
+
+    /* Filled in once the header has arrived. */
+    gboolean                    header_parsed;
+    gboolean                    cancelled;     /* size_func asked for 0x0 */
+    gboolean                    preview;       /* pixbuf is the preview */
+    size_t                      sample_budget; /* pass 1, when scaled down */
+    TonemapQuality              quality;       /* read once, at the header */
+    gsize                       header_len;
+    EXRHeader                   header;
+    int                         channels[4];   /* R, G, B, A; A may be -1 */
+    int                         width;
+    int                         height;
+    int                         level_x;       /* tiled: level to decode */
+    int                         level_y;
+    GdkPixbuf                  *pixbuf;
+
+    /* When streaming, buffer only holds bytes not yet decoded, and
+     * buffer->data[0] is at file offset base. */
+    gboolean                    streaming;
+    ExrStream                   stream;
+    gsize                       base;
 } ExrContext;
 
 /* ------------------------------------------------------------------ */
-/*  Core decoder: EXR bytes in memory -> GdkPixbuf                    */
+/*  Header parsing                                                    */
 /* ------------------------------------------------------------------ */
 
-static GdkPixbuf *
-decode_exr_from_memory(const guint8 *data, gsize length, GError **error)
+/*
+ * exr_find_layer — Find the R, G, B and A channels of one layer: those
+ * named @layer followed by ".R" and so on, or plain "R" for layer "".
+ * Returns TRUE if R, G and B are all present.
+ */
+static gboolean
+exr_find_layer(const EXRHeader *header, const char *layer, size_t layer_len,
+               int channels[4])
+{
+    static const char names[4] = { 'R', 'G', 'B', 'A' };
+
+    channels[0] = channels[1] = channels[2] = channels[3] = -1;
+
+    for (int i = 0; i < header->num_channels; i++) {
+        const char *name = header->channels[i].name;
+
+        if (layer_len > 0) {
+            if (strncmp(name, layer, layer_len) != 0 || name[layer_len] != '.')
+                continue;
+            name += layer_len + 1;
+        }
+
+        for (int c = 0; c < 4; c++)
+            if (name[0] == names[c] && name[1] == '\0')
+                channels[c] = i;
+    }
+
+    return channels[0] >= 0 && channels[1] >= 0 && channels[2] >= 0;
+}
+
+/*
+ * exr_find_channels — Pick the channels to show: the layer named by
+ * GDK_PIXBUF_HDR_EXR_LAYER if the file has it, else plain R, G, B, else
+ * the first layer (in channel order) that has all three.
+ */
+static gboolean
+exr_find_channels(const EXRHeader *header, int channels[4])
+{
+    const char *layer = g_getenv(EXR_LAYER_ENV);
+
+    if (layer && *layer &&
+        exr_find_layer(header, layer, strlen(layer), channels))
+        return TRUE;
+
+    if (exr_find_layer(header, "", 0, channels))
+        return TRUE;
+
+    for (int i = 0; i < header->num_channels; i++) {
+        const char *dot = strrchr(header->channels[i].name, '.');
+
+        if (dot && strcmp(dot, ".R") == 0 &&
+            exr_find_layer(header, header->channels[i].name,
+                           (size_t)(dot - header->channels[i].name),
+                           channels))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * exr_parse_header — Parse and validate the header: single part, data
+ * window within limits, and R, G, B channels present.
+ *
+ * Initialises @header in every case; the caller must FreeEXRHeader() it.
+ * On success *width and *height are the data window size and channels[]
+ * holds the R, G, B and A channel indices (A is -1 if absent).
+ */
+static gboolean
+exr_parse_header(const guint8 *data, gsize length, EXRHeader *header,
+                 int *width, int *height, int channels[4], GError **error)
 {
     EXRVersion  version;
-    EXRHeader   header;
-    EXRImage    image;
-    const char *exr_err  = NULL;
-    float      *flat_rgb = NULL;
-    uint8_t    *srgb_buf = NULL;
-    GdkPixbuf  *pixbuf   = NULL;
+    const char *exr_err = NULL;
     int         ret;
-    int         header_initialized = 0;
-    int         image_loaded       = 0;
+
+    InitEXRHeader(header);
 
     /* --- Stage 1: Parse and validate EXR version --- */
 
@@ -57,22 +157,19 @@ decode_exr_from_memory(const guint8 *data, gsize length, GError **error)
         g_set_error_literal(error, GDK_PIXBUF_ERROR,
                             GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
                             "Not a valid EXR file");
-        return NULL;
+        return FALSE;
     }
 
     if (version.multipart) {
         g_set_error_literal(error, GDK_PIXBUF_ERROR,
                             GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
                             "Multipart EXR not supported");
-        return NULL;
+        return FALSE;
     }
 
     /* --- Stage 2: Parse header --- */
 
-    InitEXRHeader(&header);
-    header_initialized = 1;
-
-    ret = ParseEXRHeaderFromMemory(&header, &version, data, length, &exr_err);
+    ret = ParseEXRHeaderFromMemory(header, &version, data, length, &exr_err);
     if (ret != TINYEXR_SUCCESS) {
         g_set_error(error, GDK_PIXBUF_ERROR,
                     GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
@@ -80,18 +177,121 @@ decode_exr_from_memory(const guint8 *data, gsize length, GError **error)
                     exr_err ? exr_err : "unknown error");
         if (exr_err)
             FreeEXRErrorMessage(exr_err);
-        goto cleanup;
+        return FALSE;
     }
 
-    /* Request float output for every channel. */
-    for (int i = 0; i < header.num_channels; i++)
-        header.requested_pixel_types[i] = TINYEXR_PIXELTYPE_FLOAT;
+    /* --- Validate dimensions, before any pixel data is touched --- */
+
+    gint64 w = (gint64)header->data_window.max_x -
+               header->data_window.min_x + 1;
+    gint64 h = (gint64)header->data_window.max_y -
+               header->data_window.min_y + 1;
+
+    if (w <= 0 || h <= 0 ||
+        w > EXR_MAX_DIMENSION || h > EXR_MAX_DIMENSION ||
+        w * h > EXR_MAX_PIXELS) {
+        g_set_error(error, GDK_PIXBUF_ERROR,
+                    GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                    "EXR image dimensions out of range: %" G_GINT64_FORMAT
+                    " x %" G_GINT64_FORMAT, w, h);
+        return FALSE;
+    }
+
+    *width  = (int)w;
+    *height = (int)h;
+
+    /* --- Identify R, G, B, A channel indices --- */
+
+    if (!exr_find_channels(header, channels)) {
+        g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                            GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                            "EXR file missing required R, G, or B channel");
+        return FALSE;
+    }
+
+    /* TinyEXR decodes every channel, each in its own type unless asked
+     * otherwise.  The shown channels are widened to float only when they
+     * aren't all half, which the tonemapper reads directly. */
+    for (int i = 0; i < header->num_channels; i++)
+        header->requested_pixel_types[i] = header->pixel_types[i];
+    if (exr_out_type(header->pixel_types, channels) == EXR_PIXEL_FLOAT)
+        for (int c = 0; c < 4; c++)
+            if (channels[c] >= 0)
+                header->requested_pixel_types[channels[c]] =
+                    TINYEXR_PIXELTYPE_FLOAT;
+
+    return TRUE;
+}
+
+/*
+ * exr_find_preview — Locate the 8-bit preview image some writers embed in
+ * the header.  Returns TRUE and sets *width, *height and *pixels (RGBA,
+ * top row first, already display-referred) if it is well-formed.
+ */
+static gboolean
+exr_find_preview(const guint8 *data, gsize header_len,
+                 int *width, int *height, const guint8 **pixels)
+{
+    const guint8 *value;
+    gsize         size;
+    guint32       w, h;
+
+    if (!exr_header_attribute(data, header_len, "preview", "preview",
+                              &value, &size) || size < 8)
+        return FALSE;
+
+    w = exr_read_u32(value);
+    h = exr_read_u32(value + 4);
+    if (w == 0 || h == 0 || w > EXR_MAX_DIMENSION || h > EXR_MAX_DIMENSION ||
+        size - 8 != (gsize)w * h * 4)
+        return FALSE;
+
+    *width  = (int)w;
+    *height = (int)h;
+    *pixels = value + 8;
+    return TRUE;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Core decoder: EXR bytes in memory -> GdkPixbuf                    */
+/* ------------------------------------------------------------------ */
+
+static GdkPixbuf *
+exr_pixbuf_new(int width, int height, GError **error)
+{
+    /* Always RGBA, 8-bit. */
+    GdkPixbuf *pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8,
+                                       width, height);
+    if (!pixbuf)
+        g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                            GDK_PIXBUF_ERROR_FAILED,
+                            "Failed to allocate GdkPixbuf");
+    return pixbuf;
+}
+
+/*
+ * decode_exr_pixels — Load the pixel data described by a header from
+ *                     exr_parse_header() and tonemap it into @pixbuf at
+ *                     @quality, with exposure from about @sample_budget
+ *                     pixels (0: all).
+ */
+static gboolean
+decode_exr_pixels(const guint8 *data, gsize length, const EXRHeader *header,
+                  const int channels[4], size_t sample_budget,
+                  TonemapQuality quality, GdkPixbuf *pixbuf, GError **error)
+{
+    EXRImage    image;
+    const char *exr_err  = NULL;
+    void       *flat     = NULL;
+    gboolean    result   = FALSE;
+    int         ret;
+    int         image_loaded = 0;
 
     /* --- Stage 3: Load pixel data --- */
 
     InitEXRImage(&image);
 
-    ret = LoadEXRImageFromMemory(&image, &header, data, length, &exr_err);
+    ret = LoadEXRImageFromMemory(&image, header, data, length, &exr_err);
     if (ret != TINYEXR_SUCCESS) {
         g_set_error(error, GDK_PIXBUF_ERROR,
                     GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
@@ -103,170 +303,514 @@ decode_exr_from_memory(const guint8 *data, gsize length, GError **error)
     }
     image_loaded = 1;
 
-    /* --- Validate dimensions --- */
+    int width  = gdk_pixbuf_get_width(pixbuf);
+    int height = gdk_pixbuf_get_height(pixbuf);
 
-    int width  = image.width;
-    int height = image.height;
-
-    if (width <= 0 || height <= 0 ||
-        width > EXR_MAX_DIMENSION || height > EXR_MAX_DIMENSION ||
-        (uint64_t)width * (uint64_t)height > EXR_MAX_PIXELS) {
-        g_set_error(error, GDK_PIXBUF_ERROR,
-                    GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
-                    "EXR image dimensions out of range: %d x %d",
-                    width, height);
+    if (image.width != width || image.height != height) {
+        g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                            GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                            "EXR image size does not match its header");
         goto cleanup;
     }
 
-    /* --- Identify R, G, B, A channel indices --- */
+    /* Output always has 4 channels (RGBA).  Without an alpha plane the
+     * tonemapper fills alpha = 255. */
+    int out_channels = (channels[3] >= 0) ? 4 : 3;
 
-    int ch_r = -1, ch_g = -1, ch_b = -1, ch_a = -1;
+    /* Samples stay in the type exr_parse_header() asked TinyEXR for. */
+    int    out_type = header->requested_pixel_types[channels[0]] ==
+                      TINYEXR_PIXELTYPE_HALF ? EXR_PIXEL_HALF : EXR_PIXEL_FLOAT;
+    size_t sample   = exr_pixel_size(out_type);
 
-    for (int i = 0; i < header.num_channels; i++) {
-        if (strcmp(header.channels[i].name, "R") == 0)      ch_r = i;
-        else if (strcmp(header.channels[i].name, "G") == 0)  ch_g = i;
-        else if (strcmp(header.channels[i].name, "B") == 0)  ch_b = i;
-        else if (strcmp(header.channels[i].name, "A") == 0)  ch_a = i;
-    }
+    /* --- Point the tonemapper at the R, G, B, A planes --- */
 
-    if (ch_r < 0 || ch_g < 0 || ch_b < 0) {
-        g_set_error_literal(error, GDK_PIXBUF_ERROR,
-                            GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
-                            "EXR file missing required R, G, or B channel");
-        goto cleanup;
+    size_t        pixel_count = (size_t)width * (size_t)height;
+    TonemapPlanes planes;
+
+    memset(&planes, 0, sizeof planes);
+
+    if (image.tiles) {
+        /* Tiled: level 0 tiles hold tile_size_x-wide planes, cut short at
+         * the right and bottom edges.  Gather them into whole planes. */
+        flat = calloc(pixel_count, (size_t)out_channels * sample);
+        if (!flat) {
+            g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                                GDK_PIXBUF_ERROR_FAILED,
+                                "Out of memory allocating pixel buffer");
+            goto cleanup;
+        }
+
+        for (int c = 0; c < out_channels; c++)
+            planes.channel[c] = (guint8 *)flat +
+                                (size_t)c * pixel_count * sample;
+
+        for (int t = 0; t < image.num_tiles; t++) {
+            const EXRTile *tile = &image.tiles[t];
+            gint64 x0 = (gint64)tile->offset_x * header->tile_size_x;
+            gint64 y0 = (gint64)tile->offset_y * header->tile_size_y;
+
+            if (tile->level_x != 0 || tile->level_y != 0 ||
+                x0 < 0 || y0 < 0 || x0 >= width || y0 >= height)
+                continue;
+
+            int tw = (int)MIN(tile->width, width - x0);
+            int th = (int)MIN(tile->height, height - y0);
+
+            for (int c = 0; c < out_channels; c++) {
+                guint8 *plane = (guint8 *)planes.channel[c];
+
+                for (int j = 0; j < th; j++)
+                    memcpy(plane + ((size_t)(y0 + j) * (size_t)width +
+                                    (size_t)x0) * sample,
+                           tile->images[channels[c]] +
+                           (size_t)j * (size_t)header->tile_size_x * sample,
+                           (size_t)tw * sample);
+            }
+        }
+    } else {
+        for (int c = 0; c < out_channels; c++)
+            planes.channel[c] = image.images[channels[c]];
     }
 
-    /* Output always has 4 channels (RGBA) for the tonemapper.  If the
-     * source has no alpha, we pass 3-channel input and the tonemapper
-     * fills alpha = 255.  If the source has alpha, we pass 4-channel. */
-    int out_channels = (ch_a >= 0) ? 4 : 3;
+    /* --- Tonemap HDR -> 8-bit sRGB, straight into the pixbuf --- */
 
-    /* --- Interleave planar channel data into a flat float buffer --- */
+    tonemap_reinhard_planes(&planes,
+                            out_type == EXR_PIXEL_HALF ?
+                                tonemap_planar_half_loader() :
+                                tonemap_load_planar,
+                            gdk_pixbuf_get_pixels(pixbuf),
+                            gdk_pixbuf_get_rowstride(pixbuf),
+                            width, height, sample_budget, quality);
+    result = TRUE;
 
-    size_t pixel_count = (size_t)width * (size_t)height;
+cleanup:
+    free(flat);
+    if (image_loaded)
+        FreeEXRImage(&image);
 
-    flat_rgb = (float *)calloc(pixel_count, (size_t)out_channels * sizeof(float));
-    if (!flat_rgb) {
-        g_set_error_literal(error, GDK_PIXBUF_ERROR,
-                            GDK_PIXBUF_ERROR_FAILED,
-                            "Out of memory allocating float buffer");
-        goto cleanup;
+    return result;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Streaming decoder: one chunk at a time, in file order             */
+/* ------------------------------------------------------------------ */
+
+/*
+ * exr_channels_supported — Whether every channel has a sample type
+ *                          exr-chunk.h converts, with no subsampling.
+ */
+static gboolean
+exr_channels_supported(const EXRHeader *header)
+{
+    for (int i = 0; i < header->num_channels; i++) {
+        if (header->channels[i].x_sampling != 1 ||
+            header->channels[i].y_sampling != 1)
+            return FALSE;
+        if (header->pixel_types[i] != EXR_PIXEL_UINT &&
+            header->pixel_types[i] != EXR_PIXEL_HALF &&
+            header->pixel_types[i] != EXR_PIXEL_FLOAT)
+            return FALSE;
     }
 
-    {
-        const float *src_r = (const float *)image.images[ch_r];
-        const float *src_g = (const float *)image.images[ch_g];
-        const float *src_b = (const float *)image.images[ch_b];
-        const float *src_a = (ch_a >= 0) ? (const float *)image.images[ch_a]
-                                          : NULL;
-
-        for (size_t i = 0; i < pixel_count; i++) {
-            float *dst = flat_rgb + i * (unsigned)out_channels;
-            dst[0] = src_r[i];
-            dst[1] = src_g[i];
-            dst[2] = src_b[i];
-            if (src_a)
-                dst[3] = src_a[i];
+    return TRUE;
+}
+
+/*
+ * exr_sample_budget — Pixels pass 1 should look at: a sample when the
+ * image will be @scaled down or @quality is PREVIEW, or 0 for all of them.
+ */
+static size_t
+exr_sample_budget(gboolean scaled, TonemapQuality quality)
+{
+    if (scaled || quality == TONEMAP_QUALITY_PREVIEW)
+        return TONEMAP_SAMPLE_BUDGET;
+    return 0;
+}
+
+/*
+ * exr_stream_supported — Whether exr-chunk.h can decode this scanline
+ *                        file, rather than leaving it to TinyEXR.
+ */
+static gboolean
+exr_stream_supported(const EXRHeader *header)
+{
+    return !header->tiled && exr_chunk_lines(header->compression_type) != 0 &&
+           exr_channels_supported(header);
+}
+
+/*
+ * exr_stream_init — Set up @st for a file whose layout exr-chunk.h handles.
+ * A nonzero @sample_budget leaves exposure to a sampled pass at the end,
+ * and the result is tonemapped at @quality.
+ */
+static gboolean
+exr_stream_init(ExrStream *st, const EXRHeader *header, gsize header_len,
+                const int channels[4], int width, int height,
+                size_t sample_budget, TonemapQuality quality, GError **error)
+{
+    ExrChunkLayout layout;
+
+    layout.width        = width;
+    layout.height       = height;
+    layout.min_y        = header->data_window.min_y;
+    layout.compression  = header->compression_type;
+    layout.lines        = exr_chunk_lines(header->compression_type);
+    layout.chunk_count  = (height + layout.lines - 1) / layout.lines;
+    layout.num_channels = header->num_channels;
+    layout.pixel_types  = g_new(int, (gsize)header->num_channels);
+    memcpy(layout.pixel_types, header->pixel_types,
+           (size_t)header->num_channels * sizeof(int));
+    memcpy(layout.rgba, channels, sizeof layout.rgba);
+    layout.line_bytes   = 0;  /* filled in by the decoder */
+
+    st->table_start = header_len;
+    st->offsets     = NULL;
+    st->next        = 0;
+    st->quality     = quality;
+
+    if (!exr_chunk_decoder_init(&st->dec, &layout, error))
+        return FALSE;
+    st->dec.sample_budget = sample_budget;
+    return TRUE;
+}
+
+static void
+exr_stream_clear(ExrStream *st)
+{
+    exr_chunk_decoder_clear(&st->dec);
+    g_free(st->offsets);
+    st->offsets = NULL;
+}
+
+static gboolean
+exr_stream_done(const ExrStream *st)
+{
+    return exr_chunk_decoder_done(&st->dec);
+}
+
+static int
+exr_offset_compare(const void *a, const void *b)
+{
+    guint64 x = *(const guint64 *)a, y = *(const guint64 *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * exr_stream_feed — Decode whatever chunks data[0, length) completes.
+ *
+ * data[0] is at file offset @base.  On return *drop is how many bytes at
+ * the front of data will never be needed again; the caller passes the rest
+ * back, followed by more of the file, on the next call.
+ */
+static gboolean
+exr_stream_feed(ExrStream *st, const guint8 *data, gsize length, gsize base,
+                gsize *drop, GError **error)
+{
+    const int chunk_count = st->dec.layout.chunk_count;
+
+    *drop = 0;
+
+    /* --- Offset table --- */
+
+    if (!st->offsets) {
+        gsize table_end = st->table_start + (gsize)chunk_count * 8;
+
+        if (base + length < table_end)
+            return TRUE;
+
+        st->offsets = g_new(guint64, (gsize)chunk_count);
+        for (int i = 0; i < chunk_count; i++) {
+            guint64 offset = exr_read_u64(data + (st->table_start - base) +
+                                          (gsize)i * 8);
+            if (offset < table_end || offset > EXR_MAX_FILE_SIZE) {
+                g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                                    GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                                    "EXR offset table is corrupt");
+                return FALSE;
+            }
+            st->offsets[i] = offset;
         }
+
+        /* Chunks are decoded in the order they appear in the file. */
+        qsort(st->offsets, (size_t)chunk_count, sizeof(guint64),
+              exr_offset_compare);
     }
 
-    /* --- Tonemap HDR -> 8-bit sRGB --- */
+    /* --- Chunks: int32 y, int32 size, then the data --- */
 
-    srgb_buf = (uint8_t *)calloc(pixel_count, 4);
-    if (!srgb_buf) {
-        g_set_error_literal(error, GDK_PIXBUF_ERROR,
-                            GDK_PIXBUF_ERROR_FAILED,
-                            "Out of memory allocating sRGB buffer");
-        goto cleanup;
+    while (st->next < chunk_count) {
+        gsize rel = (gsize)(st->offsets[st->next] - base);
+
+        if (rel > length || length - rel < 8)
+            break;
+
+        int32_t  y    = (int32_t)exr_read_u32(data + rel);
+        uint32_t size = exr_read_u32(data + rel + 4);
+
+        if (size > exr_chunk_max_size(&st->dec)) {
+            g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                                GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                                "EXR chunk has invalid size");
+            return FALSE;
+        }
+        if (length - rel - 8 < size)
+            break;
+
+        if (!exr_chunk_decode(&st->dec, y, data + rel + 8, size, error))
+            return FALSE;
+        st->next++;
     }
 
-    tonemap_reinhard(flat_rgb, srgb_buf, width, height, out_channels);
+    if (st->next < chunk_count)
+        *drop = MIN(length, (gsize)(st->offsets[st->next] - base));
+    else
+        *drop = length;
+
+    return TRUE;
+}
+
+/* exr_stream_tonemap — Tonemap a fully decoded stream into @pixbuf. */
+static void
+exr_stream_tonemap(const ExrStream *st, GdkPixbuf *pixbuf)
+{
+    const ExrChunkLayout *l = &st->dec.layout;
+    TonemapStats          stats;
+
+    if (st->dec.sample_budget == 0)
+        exr_chunk_decoder_stats(&st->dec, &stats);
+    exr_tonemap(st->dec.pixels, st->dec.out_type,
+                gdk_pixbuf_get_pixels(pixbuf),
+                gdk_pixbuf_get_rowstride(pixbuf),
+                l->width, l->height, st->dec.out_channels,
+                st->dec.sample_budget == 0 ? &stats : NULL,
+                st->dec.sample_budget, st->quality);
+}
 
-    /* --- Create GdkPixbuf (always RGBA, 8-bit) --- */
+static gboolean
+decode_exr_stream(const guint8 *data, gsize length, const EXRHeader *header,
+                  const int channels[4], TonemapQuality quality,
+                  GdkPixbuf *pixbuf, GError **error)
+{
+    ExrStream st;
+    gsize     header_len = 0;
+    gboolean  result = FALSE;
 
-    pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, width, height);
-    if (!pixbuf) {
+    if (exr_header_length(data, length, &header_len) != 1) {
         g_set_error_literal(error, GDK_PIXBUF_ERROR,
-                            GDK_PIXBUF_ERROR_FAILED,
-                            "Failed to allocate GdkPixbuf");
-        goto cleanup;
+                            GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                            "EXR header is corrupt");
+        return FALSE;
     }
 
-    {
-        int    rowstride = gdk_pixbuf_get_rowstride(pixbuf);
-        guchar *pixels   = gdk_pixbuf_get_pixels(pixbuf);
+    if (!exr_stream_init(&st, header, header_len, channels,
+                         gdk_pixbuf_get_width(pixbuf),
+                         gdk_pixbuf_get_height(pixbuf),
+                         exr_sample_budget(FALSE, quality), quality, error))
+        goto cleanup;
 
-        for (int y = 0; y < height; y++)
-            memcpy(pixels + y * rowstride,
-                   srgb_buf + (size_t)y * (unsigned)width * 4,
-                   (size_t)width * 4);
-    }
+    /* The whole file is here: decompress its chunks in parallel. */
+    if (!exr_chunks_decode(&st.dec, data, length, header_len,
+                           parallel_get_max_threads(), error))
+        goto cleanup;
+
+    exr_stream_tonemap(&st, pixbuf);
+    result = TRUE;
 
 cleanup:
-    free(flat_rgb);
-    free(srgb_buf);
-    if (image_loaded)
-        FreeEXRImage(&image);
-    if (header_initialized)
-        FreeEXRHeader(&header);
+    exr_stream_clear(&st);
 
-    return pixbuf;
+    return result;
 }
 
 /* ------------------------------------------------------------------ */
-/*  Atomic (whole-file) loader                                        */
+/*  Tiled decoder: one level, tiles in parallel                       */
 /* ------------------------------------------------------------------ */
 
-static GdkPixbuf *
-exr_load(FILE *f, GError **error)
+/*
+ * exr_tiled_supported — Whether exr-chunk.h can decode this tiled file,
+ *                       rather than leaving it to TinyEXR.
+ */
+static gboolean
+exr_tiled_supported(const EXRHeader *header)
 {
-    GdkPixbuf *pixbuf = NULL;
-    guint8    *buf    = NULL;
-    long       size;
+    return header->tiled && exr_chunk_lines(header->compression_type) != 0 &&
+           header->tile_size_x > 0 && header->tile_size_y > 0 &&
+           header->tile_level_mode >= EXR_LEVEL_ONE &&
+           header->tile_level_mode <= EXR_LEVEL_RIPMAP &&
+           (header->tile_rounding_mode == EXR_ROUND_DOWN ||
+            header->tile_rounding_mode == EXR_ROUND_UP) &&
+           exr_channels_supported(header);
+}
 
-    if (fseek(f, 0, SEEK_END) != 0) {
-        g_set_error_literal(error, GDK_PIXBUF_ERROR,
-                            GDK_PIXBUF_ERROR_FAILED,
-                            "Failed to seek in EXR file");
-        return NULL;
+static void
+exr_tile_layout_init(ExrTileLayout *layout, const EXRHeader *header,
+                     const int channels[4], int width, int height)
+{
+    layout->width        = width;
+    layout->height       = height;
+    layout->tile_width   = header->tile_size_x;
+    layout->tile_height  = header->tile_size_y;
+    layout->level_mode   = header->tile_level_mode;
+    layout->rounding     = header->tile_rounding_mode;
+    layout->compression  = header->compression_type;
+    layout->num_channels = header->num_channels;
+    layout->pixel_types  = header->pixel_types;
+    memcpy(layout->rgba, channels, sizeof layout->rgba);
+}
+
+/*
+ * exr_pick_level — Choose the smallest level of a tiled file that is at
+ * least req_width x req_height, or the full image if none is.  Sets the
+ * level and its size.
+ */
+static void
+exr_pick_level(const EXRHeader *header, const int channels[4],
+               int width, int height, int req_width, int req_height,
+               int *level_x, int *level_y, int *level_width, int *level_height)
+{
+    ExrTileLayout l;
+    int           levels_x, levels_y, lx = 0, ly = 0;
+
+    exr_tile_layout_init(&l, header, channels, width, height);
+    exr_tile_levels(&l, &levels_x, &levels_y);
+
+    if (l.level_mode == EXR_LEVEL_MIPMAP) {
+        while (lx + 1 < levels_x &&
+               exr_level_size(width, lx + 1, l.rounding) >= req_width &&
+               exr_level_size(height, lx + 1, l.rounding) >= req_height)
+            lx++;
+        ly = lx;
+    } else {
+        while (lx + 1 < levels_x &&
+               exr_level_size(width, lx + 1, l.rounding) >= req_width)
+            lx++;
+        while (ly + 1 < levels_y &&
+               exr_level_size(height, ly + 1, l.rounding) >= req_height)
+            ly++;
     }
 
-    size = ftell(f);
-    if (size < 0) {
+    *level_x      = lx;
+    *level_y      = ly;
+    *level_width  = exr_level_size(width, lx, l.rounding);
+    *level_height = exr_level_size(height, ly, l.rounding);
+}
+
+/*
+ * decode_exr_tiled — Decode level (level_x, level_y) of a whole tiled file
+ *                    and tonemap it at @quality into @pixbuf, which has its
+ *                    size, with exposure from about @sample_budget pixels
+ *                    (0: all).
+ */
+static gboolean
+decode_exr_tiled(const guint8 *data, gsize length, const EXRHeader *header,
+                 const int channels[4], int level_x, int level_y,
+                 size_t sample_budget, TonemapQuality quality,
+                 GdkPixbuf *pixbuf, GError **error)
+{
+    ExrTileLayout layout;
+    gsize         header_len = 0;
+    void         *pixels;
+    int           width  = gdk_pixbuf_get_width(pixbuf);
+    int           height = gdk_pixbuf_get_height(pixbuf);
+    int           out_channels = (channels[3] >= 0) ? 4 : 3;
+    int           out_type = exr_out_type(header->pixel_types, channels);
+    gboolean      result = FALSE;
+
+    if (exr_header_length(data, length, &header_len) != 1) {
         g_set_error_literal(error, GDK_PIXBUF_ERROR,
-                            GDK_PIXBUF_ERROR_FAILED,
-                            "Failed to determine EXR file size");
-        return NULL;
+                            GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                            "EXR header is corrupt");
+        return FALSE;
     }
 
-    if (size > EXR_MAX_FILE_SIZE) {
-        g_set_error(error, GDK_PIXBUF_ERROR,
-                    GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
-                    "EXR file too large (%ld bytes, limit %d)",
-                    size, EXR_MAX_FILE_SIZE);
-        return NULL;
-    }
+    exr_tile_layout_init(&layout, header, channels,
+                         header->data_window.max_x -
+                         header->data_window.min_x + 1,
+                         header->data_window.max_y -
+                         header->data_window.min_y + 1);
 
-    if (fseek(f, 0, SEEK_SET) != 0) {
+    pixels = malloc((size_t)width * (size_t)height *
+                    (size_t)out_channels * exr_pixel_size(out_type));
+    if (!pixels) {
         g_set_error_literal(error, GDK_PIXBUF_ERROR,
                             GDK_PIXBUF_ERROR_FAILED,
-                            "Failed to rewind EXR file");
-        return NULL;
+                            "Out of memory allocating pixel buffer");
+        return FALSE;
     }
 
-    gsize file_size = (gsize)size;
-    buf = (guint8 *)g_malloc(file_size);
+    if (exr_tiles_decode(&layout, data, length, header_len, level_x, level_y,
+                         pixels, out_channels, parallel_get_max_threads(),
+                         error)) {
+        exr_tonemap(pixels, out_type, gdk_pixbuf_get_pixels(pixbuf),
+                    gdk_pixbuf_get_rowstride(pixbuf),
+                    width, height, out_channels, NULL, sample_budget,
+                    quality);
+        result = TRUE;
+    }
 
-    if (fread(buf, 1, file_size, f) != file_size) {
-        g_set_error_literal(error, GDK_PIXBUF_ERROR,
-                            GDK_PIXBUF_ERROR_FAILED,
-                            "Failed to read EXR file");
-        g_free(buf);
-        return NULL;
+    free(pixels);
+    return result;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Whole-file decode                                                 */
+/* ------------------------------------------------------------------ */
+
+static GdkPixbuf *
+decode_exr_from_memory(const guint8 *data, gsize length, GError **error)
+{
+    EXRHeader      header;
+    GdkPixbuf     *pixbuf = NULL;
+    int            width = 0, height = 0;
+    int            channels[4];
+    TonemapQuality quality = tonemap_default_quality();
+    gboolean       ok;
+
+    if (!exr_parse_header(data, length, &header, &width, &height,
+                          channels, error))
+        goto cleanup;
+
+    pixbuf = exr_pixbuf_new(width, height, error);
+    if (!pixbuf)
+        goto cleanup;
+
+    if (exr_stream_supported(&header))
+        ok = decode_exr_stream(data, length, &header, channels, quality,
+                               pixbuf, error);
+    else if (exr_tiled_supported(&header))
+        ok = decode_exr_tiled(data, length, &header, channels, 0, 0,
+                              exr_sample_budget(FALSE, quality), quality,
+                              pixbuf, error);
+    else
+        ok = decode_exr_pixels(data, length, &header, channels,
+                               exr_sample_budget(FALSE, quality), quality,
+                               pixbuf, error);
+
+    if (!ok) {
+        g_object_unref(pixbuf);
+        pixbuf = NULL;
     }
 
-    pixbuf = decode_exr_from_memory(buf, file_size, error);
-    g_free(buf);
+cleanup:
+    FreeEXRHeader(&header);
+
+    return pixbuf;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Atomic (whole-file) loader                                        */
+/* ------------------------------------------------------------------ */
+
+static GdkPixbuf *
+exr_load(FILE *f, GError **error)
+{
+    GdkPixbuf *pixbuf = NULL;
+    FileMap    map;
+
+    if (file_map_load(&map, f, EXR_MAX_FILE_SIZE, "EXR", error))
+        pixbuf = decode_exr_from_memory(map.data, map.length, error);
+
+    file_map_clear(&map);
     return pixbuf;
 }
 
@@ -295,6 +839,144 @@ exr_begin_load(GdkPixbufModuleSizeFunc     size_func,
     return ctx;
 }
 
+/*
+ * exr_context_pump — Decode the chunks now complete in the buffer and
+ *                    drop the bytes they came from.
+ */
+static gboolean
+exr_context_pump(ExrContext *ctx, GError **error)
+{
+    gsize drop;
+
+    if (!exr_stream_feed(&ctx->stream, ctx->buffer->data, ctx->buffer->len,
+                         ctx->base, &drop, error))
+        return FALSE;
+
+    g_byte_array_remove_range(ctx->buffer, 0, (guint)drop);
+    ctx->base += drop;
+    return TRUE;
+}
+
+/*
+ * exr_context_load_preview — Answer a request for less than the full image
+ * with the embedded preview, if it is at least as large as asked but
+ * smaller than the level_width x level_height image that would otherwise
+ * be decoded.  Returns TRUE if ctx->pixbuf now holds it.
+ */
+static gboolean
+exr_context_load_preview(ExrContext *ctx, int req_width, int req_height,
+                         int level_width, int level_height)
+{
+    const guint8 *src;
+    int           width, height;
+
+    if (req_width >= ctx->width && req_height >= ctx->height)
+        return FALSE;
+
+    if (!exr_find_preview(ctx->buffer->data, ctx->header_len,
+                          &width, &height, &src))
+        return FALSE;
+
+    /* Too small to scale down from, or no smaller than the alternative. */
+    if (width < req_width || height < req_height ||
+        (width >= level_width && height >= level_height))
+        return FALSE;
+
+    /* If this fails the full image is decoded instead. */
+    ctx->pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, width, height);
+    if (!ctx->pixbuf)
+        return FALSE;
+
+    guchar *pixels    = gdk_pixbuf_get_pixels(ctx->pixbuf);
+    int     rowstride = gdk_pixbuf_get_rowstride(ctx->pixbuf);
+
+    for (int y = 0; y < height; y++)
+        memcpy(pixels + (size_t)y * (size_t)rowstride,
+               src + (size_t)y * (size_t)width * 4, (size_t)width * 4);
+
+    ctx->preview = TRUE;
+    return TRUE;
+}
+
+/*
+ * exr_context_parse_header — Parse the buffered header, let the caller
+ * see the size, and hand out the (still blank) pixbuf.
+ *
+ * A caller that sets the size to 0x0 only wanted the dimensions:
+ * ctx->cancelled is set and no pixel data will be decoded.  A caller that
+ * wants a small image gets the smallest mip level of a tiled file that is
+ * at least that size, or the embedded preview if that is smaller still and
+ * big enough, complete straight away; if it still gets a larger image,
+ * exposure comes from a sample of it.  Otherwise, scanline files
+ * exr-chunk.h can handle switch to streaming: from then on each chunk is
+ * decoded as soon as its last byte arrives.
+ */
+static gboolean
+exr_context_parse_header(ExrContext *ctx, GError **error)
+{
+    int width, height;
+    int level_width, level_height;
+
+    ctx->header_parsed = TRUE;  /* ctx->header needs freeing from here on */
+
+    if (!exr_parse_header(ctx->buffer->data, ctx->buffer->len, &ctx->header,
+                          &ctx->width, &ctx->height, ctx->channels, error))
+        return FALSE;
+
+    width  = level_width  = ctx->width;
+    height = level_height = ctx->height;
+
+    if (ctx->size_func) {
+        ctx->size_func(&width, &height, ctx->user_data);
+        if (width <= 0 || height <= 0) {
+            ctx->cancelled = TRUE;
+            return TRUE;
+        }
+
+        if (exr_tiled_supported(&ctx->header))
+            exr_pick_level(&ctx->header, ctx->channels,
+                           ctx->width, ctx->height, width, height,
+                           &ctx->level_x, &ctx->level_y,
+                           &level_width, &level_height);
+
+        if (exr_context_load_preview(ctx, width, height,
+                                     level_width, level_height)) {
+            if (ctx->prepared_func)
+                ctx->prepared_func(ctx->pixbuf, NULL, ctx->user_data);
+            if (ctx->updated_func)
+                ctx->updated_func(ctx->pixbuf, 0, 0,
+                                  gdk_pixbuf_get_width(ctx->pixbuf),
+                                  gdk_pixbuf_get_height(ctx->pixbuf),
+                                  ctx->user_data);
+            return TRUE;
+        }
+    }
+
+    /* A pixbuf that will be scaled down makes do with sampled exposure. */
+    ctx->quality       = tonemap_default_quality();
+    ctx->sample_budget = exr_sample_budget(width < level_width ||
+                                           height < level_height,
+                                           ctx->quality);
+
+    ctx->pixbuf = exr_pixbuf_new(level_width, level_height, error);
+    if (!ctx->pixbuf)
+        return FALSE;
+
+    if (ctx->prepared_func)
+        ctx->prepared_func(ctx->pixbuf, NULL, ctx->user_data);
+
+    if (exr_stream_supported(&ctx->header)) {
+        ctx->streaming = TRUE;
+        if (!exr_stream_init(&ctx->stream, &ctx->header, ctx->header_len,
+                             ctx->channels, ctx->width, ctx->height,
+                             ctx->sample_budget, ctx->quality, error))
+            return FALSE;
+        return exr_context_pump(ctx, error);
+    }
+
+    return TRUE;
+}
+
 static gboolean
 exr_load_increment(gpointer      context,
                    const guchar *buf,
@@ -303,15 +985,34 @@ exr_load_increment(gpointer      context,
 {
     ExrContext *ctx = (ExrContext *)context;
 
-    g_byte_array_append(ctx->buffer, buf, size);
+    /* After a cancel, the preview, or the last chunk, the rest is skipped
+     * unread. */
+    if (ctx->cancelled || ctx->preview ||
+        (ctx->streaming && exr_stream_done(&ctx->stream)))
+        return TRUE;
 
-    if (ctx->buffer->len > EXR_MAX_FILE_SIZE) {
+    ctx->bytes_seen += size;
+    if (ctx->bytes_seen > EXR_MAX_FILE_SIZE) {
         g_set_error_literal(error, GDK_PIXBUF_ERROR,
                             GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
                             "EXR data exceeds maximum file size");
         return FALSE;
     }
 
+    g_byte_array_append(ctx->buffer, buf, size);
+
+    if (ctx->streaming)
+        return exr_context_pump(ctx, error);
+
+    if (!ctx->header_parsed &&
+        exr_header_length(ctx->buffer->data, ctx->buffer->len,
+                          &ctx->header_len) != 0) {
+        if (!exr_context_parse_header(ctx, error))
+            return FALSE;
+        if (ctx->cancelled || ctx->preview)
+            g_byte_array_set_size(ctx->buffer, 0);
+    }
+
     return TRUE;
 }
 
@@ -319,37 +1020,57 @@ static gboolean
 exr_stop_load(gpointer context, GError **error)
 {
     ExrContext *ctx    = (ExrContext *)context;
-    GdkPixbuf  *pixbuf = NULL;
     gboolean    result = TRUE;
 
-    pixbuf = decode_exr_from_memory(ctx->buffer->data,
-                                    ctx->buffer->len,
-                                    error);
-    if (!pixbuf) {
-        result = FALSE;
-        goto out;
+    /* A header that never completed gets its error reported here. */
+    if (!ctx->header_parsed) {
+        if (!exr_context_parse_header(ctx, error)) {
+            result = FALSE;
+            goto out;
+        }
     }
 
-    {
-        int width  = gdk_pixbuf_get_width(pixbuf);
-        int height = gdk_pixbuf_get_height(pixbuf);
+    if (ctx->cancelled || ctx->preview)
+        goto out;  /* load cancelled by caller, or already complete */
 
-        if (ctx->size_func) {
-            ctx->size_func(&width, &height, ctx->user_data);
-            if (width <= 0 || height <= 0)
-                goto out;  /* load cancelled by caller */
+    if (ctx->streaming) {
+        if (!exr_stream_done(&ctx->stream)) {
+            g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                                GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                                "EXR pixel data truncated");
+            result = FALSE;
+            goto out;
         }
-
-        if (ctx->prepared_func)
-            ctx->prepared_func(pixbuf, NULL, ctx->user_data);
-
-        if (ctx->updated_func)
-            ctx->updated_func(pixbuf, 0, 0, width, height, ctx->user_data);
+        exr_stream_tonemap(&ctx->stream, ctx->pixbuf);
+    } else if (exr_tiled_supported(&ctx->header)) {
+        if (!decode_exr_tiled(ctx->buffer->data, ctx->buffer->len,
+                              &ctx->header, ctx->channels,
+                              ctx->level_x, ctx->level_y, ctx->sample_budget,
+                              ctx->quality, ctx->pixbuf, error)) {
+            result = FALSE;
+            goto out;
+        }
+    } else if (!decode_exr_pixels(ctx->buffer->data, ctx->buffer->len,
+                                  &ctx->header, ctx->channels,
+                                  ctx->sample_budget, ctx->quality,
+                                  ctx->pixbuf, error)) {
+        result = FALSE;
+        goto out;
     }
 
+    if (ctx->updated_func)
+        ctx->updated_func(ctx->pixbuf, 0, 0,
+                          gdk_pixbuf_get_width(ctx->pixbuf),
+                          gdk_pixbuf_get_height(ctx->pixbuf),
+                          ctx->user_data);
+
 out:
-    if (pixbuf)
-        g_object_unref(pixbuf);
+    if (ctx->pixbuf)
+        g_object_unref(ctx->pixbuf);
+    if (ctx->streaming)
+        exr_stream_clear(&ctx->stream);
+    if (ctx->header_parsed)
+        FreeEXRHeader(&ctx->header);
     g_byte_array_free(ctx->buffer, TRUE);
     g_free(ctx);
     return result;
@@ -16,6 +16,8 @@
 #include <gdk-pixbuf/gdk-pixbuf.h>
 
 #include "tonemap.h"
+#include "parallel.h"
+#include "file-map.h"
 
 /* Sanity limits to reject pathological files early. */
 #define HDR_MAX_DIMENSION   8192
@@ -23,31 +25,53 @@
 #define HDR_MAX_FILE_SIZE   (256 * 1024 * 1024)   /* 256 MB */
 #define HDR_MAX_HEADER_SIZE (64 * 1024)            /* 64 KB */
 
+/* Pixels per updated_func() band when tonemapping a streamed image. */
+#define HDR_UPDATE_BAND_PIXELS (1024 * 1024)
+
+/* Scanlines per task when decoding a whole file in parallel. */
+#define HDR_DECODE_BAND_ROWS 16
+
+/*
+ * Scanline decoder state, shared by the atomic and incremental loaders.
+ *
+ * At full size, pixels are kept as RGBE until the tonemapper decodes them;
+ * the exposure histogram is the same whatever order scanlines are decoded
+ * in.  When the caller asked for a smaller image, each scanline is instead
+ * decoded into one row of scratch and box-filtered in linear light into
+ * @accum, so memory scales with the output size.
+ */
+typedef struct {
+    int            width;         /* source size */
+    int            height;
+    int            out_width;     /* decoded size: the source size or smaller */
+    int            out_height;
+    gboolean       flip_vertical;
+    int            rows_done;     /* scanlines decoded so far, in file order */
+    uint8_t       *rgbe;          /* full size: width * height RGBE pixels,
+                                     top row first; scaled: one scanline */
+    const uint8_t *image;         /* full size: @rgbe, or the file's own
+                                     pixels when they need no decoding */
+    uint8_t       *planes;        /* one RLE scanline, channel by channel */
+    float         *accum;         /* scaled only: out_width * out_height RGB */
+    TonemapStats   stats;         /* of the rows decoded so far */
+    TonemapQuality quality;       /* read once, when decoding starts */
+} HdrDecoder;
+
 /* Context for incremental (progressive) loading. */
 typedef struct {
-    GByteArray                 *buffer;
+    GByteArray                 *buffer;        /* header bytes, then carry */
     GdkPixbufModuleSizeFunc     size_func;
     GdkPixbufModulePreparedFunc prepared_func;
     GdkPixbufModuleUpdatedFunc  updated_func;
     gpointer                    user_data;
-} HdrContext;
-
-/* ------------------------------------------------------------------ */
-/*  RGBE helpers                                                       */
-/* ------------------------------------------------------------------ */
+    gsize                       bytes_seen;
 
-static inline void
-rgbe_to_float(const uint8_t rgbe[4], float *r, float *g, float *b)
-{
-    if (rgbe[3] == 0) {
-        *r = *g = *b = 0.0f;
-    } else {
-        float f = ldexpf(1.0f, (int)rgbe[3] - 128 - 8);
-        *r = (float)rgbe[0] * f;
-        *g = (float)rgbe[1] * f;
-        *b = (float)rgbe[2] * f;
-    }
-}
+    /* Filled in once the header has arrived. */
+    gboolean                    header_parsed;
+    gboolean                    cancelled;     /* size_func asked for 0x0 */
+    HdrDecoder                  decoder;
+    GdkPixbuf                  *pixbuf;
+} HdrContext;
 
 /* ------------------------------------------------------------------ */
 /*  Header parsing                                                     */
@@ -193,33 +217,177 @@ parse_hdr_header(const uint8_t *data, size_t length,
     return res_end + 1;
 }
 
+/*
+ * hdr_header_complete — Whether enough bytes have arrived for
+ * parse_hdr_header() to succeed or fail for good: the blank line and the
+ * resolution string are both present, or the data can't be a valid header.
+ */
+static gboolean
+hdr_header_complete(const uint8_t *data, size_t length)
+{
+    if (length >= 11 &&
+        memcmp(data, "#?RADIANCE", 10) != 0 &&
+        memcmp(data, "#?RGBE", 6) != 0)
+        return TRUE;
+
+    if (length >= HDR_MAX_HEADER_SIZE)
+        return TRUE;
+
+    /* Find the blank line, then the end of the resolution line. */
+    for (size_t pos = 0; pos + 1 < length; pos++) {
+        if (data[pos] != '\n')
+            continue;
+
+        size_t next = pos + 1;
+        if (data[next] == '\r')
+            next++;
+        if (next < length && data[next] == '\n')
+            return memchr(data + next + 1, '\n', length - next - 1) != NULL;
+    }
+
+    return FALSE;
+}
+
 /* ------------------------------------------------------------------ */
 /*  RLE scanline decoder                                               */
 /* ------------------------------------------------------------------ */
 
+/*
+ * measure_rle_scanline — Find the encoded size of one new-style RLE
+ *                        scanline (after its 4-byte marker) without
+ *                        decoding it.
+ *
+ * Returns 1 and sets *size if the whole scanline is in data[0, length),
+ * 0 if more bytes are needed, or -1 on corrupt data.
+ */
+static int
+measure_rle_scanline(const uint8_t *data, size_t length, int width,
+                     size_t *size, GError **error)
+{
+    size_t pos = 0;
+
+    for (int ch = 0; ch < 4; ch++) {
+        int x = 0;
+        while (x < width) {
+            if (pos >= length)
+                return 0;
+
+            uint8_t byte = data[pos++];
+            int     count;
+            size_t  payload;
+
+            if (byte > 128) {
+                count   = byte - 128;
+                payload = 1;
+            } else {
+                count   = byte;
+                payload = byte;
+                if (count == 0) {
+                    g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                                        GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                                        "HDR RLE zero-length literal");
+                    return -1;
+                }
+            }
+
+            if (x + count > width) {
+                g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                                    GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                                    byte > 128
+                                    ? "HDR RLE run exceeds scanline width"
+                                    : "HDR RLE literal exceeds scanline width");
+                return -1;
+            }
+            if (length - pos < payload)
+                return 0;
+
+            pos += payload;
+            x   += count;
+        }
+    }
+
+    *size = pos;
+    return 1;
+}
+
+#ifdef TONEMAP_HAVE_X86
+TONEMAP_TARGET_SSE2 static void
+interleave_rgbe_sse2(const uint8_t *planes, uint8_t *scanline, int width,
+                     int *x)
+{
+    const uint8_t *r = planes;
+    const uint8_t *g = planes + width;
+    const uint8_t *b = planes + 2 * (size_t)width;
+    const uint8_t *e = planes + 3 * (size_t)width;
+
+    for (; *x + 16 <= width; *x += 16) {
+        __m128i vr = _mm_loadu_si128((const __m128i *)(r + *x));
+        __m128i vg = _mm_loadu_si128((const __m128i *)(g + *x));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + *x));
+        __m128i ve = _mm_loadu_si128((const __m128i *)(e + *x));
+        __m128i rg_lo = _mm_unpacklo_epi8(vr, vg);
+        __m128i rg_hi = _mm_unpackhi_epi8(vr, vg);
+        __m128i be_lo = _mm_unpacklo_epi8(vb, ve);
+        __m128i be_hi = _mm_unpackhi_epi8(vb, ve);
+        __m128i *out  = (__m128i *)(scanline + (size_t)*x * 4);
+
+        _mm_storeu_si128(out + 0, _mm_unpacklo_epi16(rg_lo, be_lo));
+        _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(rg_lo, be_lo));
+        _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(rg_hi, be_hi));
+        _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(rg_hi, be_hi));
+    }
+}
+#endif
+
+/*
+ * interleave_rgbe — Interleave the R, G, B and E planes of one decoded
+ * scanline (each @width bytes, one after another) into RGBE pixels.
+ */
+static void
+interleave_rgbe(const uint8_t *planes, uint8_t *scanline, int width)
+{
+    int x = 0;
+
+#ifdef TONEMAP_HAVE_X86
+    if (tonemap_isa_supported(TONEMAP_ISA_SSE2))
+        interleave_rgbe_sse2(planes, scanline, width, &x);
+#endif
+
+    for (; x < width; x++) {
+        scanline[x * 4 + 0] = planes[x];
+        scanline[x * 4 + 1] = planes[width + x];
+        scanline[x * 4 + 2] = planes[2 * width + x];
+        scanline[x * 4 + 3] = planes[3 * width + x];
+    }
+}
+
 /*
  * decode_rle_scanline — Decode one new-style RLE scanline.
  *
+ * Each channel's runs and literals are expanded with memset()/memcpy()
+ * into its own row of @planes (4 * width bytes of scratch), then the rows
+ * are interleaved into @scanline.
+ *
  * Returns TRUE on success, FALSE on error.
  * *pos is updated to point past the consumed data.
  */
 static gboolean
 decode_rle_scanline(const uint8_t *data, size_t length, size_t *pos,
-                    uint8_t *scanline, int width, GError **error)
+                    uint8_t *planes, uint8_t *scanline, int width,
+                    GError **error)
 {
+    size_t p = *pos;
+
     /* Each channel is RLE-encoded separately: R, G, B, E */
     for (int ch = 0; ch < 4; ch++) {
-        int x = 0;
+        uint8_t *row = planes + (size_t)ch * (size_t)width;
+        int      x   = 0;
+
         while (x < width) {
-            if (*pos >= length) {
-                g_set_error_literal(error, GDK_PIXBUF_ERROR,
-                                    GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
-                                    "HDR RLE data truncated");
-                return FALSE;
-            }
+            if (p >= length)
+                goto truncated;
 
-            uint8_t byte = data[*pos];
-            (*pos)++;
+            uint8_t byte = data[p++];
 
             if (byte > 128) {
                 /* Run: repeat next byte (byte - 128) times */
@@ -230,16 +398,9 @@ decode_rle_scanline(const uint8_t *data, size_t length, size_t *pos,
                                         "HDR RLE run exceeds scanline width");
                     return FALSE;
                 }
-                if (*pos >= length) {
-                    g_set_error_literal(error, GDK_PIXBUF_ERROR,
-                                        GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
-                                        "HDR RLE data truncated");
-                    return FALSE;
-                }
-                uint8_t val = data[*pos];
-                (*pos)++;
-                for (int i = 0; i < count; i++)
-                    scanline[(x + i) * 4 + ch] = val;
+                if (p >= length)
+                    goto truncated;
+                memset(row + x, data[p++], (size_t)count);
                 x += count;
             } else {
                 /* Literal: copy next `byte` values */
@@ -256,77 +417,192 @@ decode_rle_scanline(const uint8_t *data, size_t length, size_t *pos,
                                         "HDR RLE literal exceeds scanline width");
                     return FALSE;
                 }
-                if (*pos + (size_t)count > length) {
-                    g_set_error_literal(error, GDK_PIXBUF_ERROR,
-                                        GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
-                                        "HDR RLE data truncated");
-                    return FALSE;
-                }
-                for (int i = 0; i < count; i++) {
-                    scanline[(x + i) * 4 + ch] = data[*pos];
-                    (*pos)++;
-                }
+                if (length - p < (size_t)count)
+                    goto truncated;
+                memcpy(row + x, data + p, (size_t)count);
+                p += (size_t)count;
                 x += count;
             }
         }
     }
 
+    interleave_rgbe(planes, scanline, width);
+    *pos = p;
     return TRUE;
+
+truncated:
+    g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                        GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                        "HDR RLE data truncated");
+    return FALSE;
 }
 
 /* ------------------------------------------------------------------ */
-/*  Core decoder: HDR bytes in memory -> GdkPixbuf                     */
+/*  Core decoder: HDR scanlines -> RGBE -> GdkPixbuf                  */
 /* ------------------------------------------------------------------ */
 
 static GdkPixbuf *
-decode_hdr_from_memory(const guint8 *data, gsize length, GError **error)
+hdr_pixbuf_new(int width, int height, GError **error)
 {
-    float      *float_buf = NULL;
-    uint8_t    *srgb_buf  = NULL;
-    uint8_t    *scanline  = NULL;
-    GdkPixbuf  *pixbuf    = NULL;
-    int         width = 0, height = 0;
-    gboolean    flip_vertical = FALSE;
+    /* Always RGBA, 8-bit. */
+    GdkPixbuf *pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8,
+                                       width, height);
+    if (!pixbuf)
+        g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                            GDK_PIXBUF_ERROR_FAILED,
+                            "Failed to allocate GdkPixbuf");
+    return pixbuf;
+}
 
-    /* --- Parse header --- */
+/*
+ * hdr_decoder_init — Set up decoding of a width x height image to
+ * out_width x out_height, which must not be larger.
+ */
+static gboolean
+hdr_decoder_init(HdrDecoder *dec, int width, int height,
+                 int out_width, int out_height,
+                 gboolean flip_vertical, GError **error)
+{
+    gboolean scaled = out_width != width || out_height != height;
+
+    dec->width         = width;
+    dec->height        = height;
+    dec->out_width     = out_width;
+    dec->out_height    = out_height;
+    dec->flip_vertical = flip_vertical;
+    dec->rows_done     = 0;
+    dec->image         = NULL;
+    dec->planes        = NULL;
+    dec->accum         = NULL;
+    dec->quality       = tonemap_default_quality();
+    tonemap_stats_init(&dec->stats);
+
+    /* Pixels stay in RGBE form (4 bytes each) until the tonemapper
+     * decodes them, a block at a time. */
+    dec->rgbe = (uint8_t *)malloc((size_t)width * 4 *
+                                  (scaled ? 1 : (size_t)height));
+    dec->planes = (uint8_t *)malloc((size_t)width * 4);
+    if (!scaled)
+        dec->image = dec->rgbe;
+    if (scaled)
+        dec->accum = (float *)calloc((size_t)out_width * (size_t)out_height * 3,
+                                     sizeof(float));
+
+    if (!dec->rgbe || !dec->planes || (scaled && !dec->accum)) {
+        g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                            GDK_PIXBUF_ERROR_FAILED,
+                            "Out of memory allocating RGBE buffer");
+        return FALSE;
+    }
 
-    size_t pixel_start = parse_hdr_header(data, length, &width, &height,
-                                          &flip_vertical, error);
-    if (pixel_start == 0)
-        return NULL;
+    return TRUE;
+}
 
-    /* --- Decode pixel data --- */
+static void
+hdr_decoder_clear(HdrDecoder *dec)
+{
+    free(dec->rgbe);
+    free(dec->planes);
+    free(dec->accum);
+    dec->rgbe   = NULL;
+    dec->image  = NULL;
+    dec->planes = NULL;
+    dec->accum  = NULL;
+}
 
-    size_t pixel_count = (size_t)width * (size_t)height;
+static gboolean
+hdr_decoder_done(const HdrDecoder *dec)
+{
+    return dec->rows_done == dec->height;
+}
 
-    float_buf = (float *)calloc(pixel_count, 3 * sizeof(float));
-    if (!float_buf) {
-        g_set_error_literal(error, GDK_PIXBUF_ERROR,
-                            GDK_PIXBUF_ERROR_FAILED,
-                            "Out of memory allocating float buffer");
-        goto cleanup;
-    }
+/*
+ * hdr_decoder_max_scanline — Upper bound on the encoded size of one
+ * scanline: an RLE scanline of one-pixel literals is 2 bytes per pixel
+ * per channel, plus its marker.
+ */
+static size_t
+hdr_decoder_max_scanline(const HdrDecoder *dec)
+{
+    return (size_t)dec->width * 8 + 4;
+}
 
-    scanline = (uint8_t *)malloc((size_t)width * 4);
-    if (!scanline) {
-        g_set_error_literal(error, GDK_PIXBUF_ERROR,
-                            GDK_PIXBUF_ERROR_FAILED,
-                            "Out of memory allocating scanline buffer");
-        goto cleanup;
+/*
+ * hdr_bin_start — First of the n source pixels that fall in output pixel
+ * @bin of out_n, when source pixel i maps to output i * out_n / n.
+ */
+static int
+hdr_bin_start(int bin, int n, int out_n)
+{
+    return (int)(((gint64)bin * n + out_n - 1) / out_n);
+}
+
+/*
+ * hdr_decoder_accumulate — Box-filter decoded scanline @y into its output
+ * row.  Each source pixel is weighted by the area of its output pixel, so
+ * the row holds an average once its last scanline is in; that is when its
+ * statistics are gathered.
+ */
+static void
+hdr_decoder_accumulate(HdrDecoder *dec, const uint8_t *scanline, int y)
+{
+    const float *exp_table = tonemap_rgbe_table();
+    int    oy  = (int)((gint64)y * dec->out_height / dec->height);
+    int    y0  = hdr_bin_start(oy, dec->height, dec->out_height);
+    int    y1  = hdr_bin_start(oy + 1, dec->height, dec->out_height);
+    float *row = dec->accum + (size_t)oy * (size_t)dec->out_width * 3;
+    int    x   = 0;
+
+    for (int ox = 0; ox < dec->out_width; ox++) {
+        int   x1 = hdr_bin_start(ox + 1, dec->width, dec->out_width);
+        float w  = 1.0f / (float)((x1 - x) * (y1 - y0));
+        float r = 0.0f, g = 0.0f, b = 0.0f;
+
+        for (; x < x1; x++) {
+            const uint8_t *px = scanline + (size_t)x * 4;
+            float f = exp_table[px[3]];
+
+            r += (float)px[0] * f;
+            g += (float)px[1] * f;
+            b += (float)px[2] * f;
+        }
+
+        row[ox * 3 + 0] += r * w;
+        row[ox * 3 + 1] += g * w;
+        row[ox * 3 + 2] += b * w;
     }
 
-    size_t pos = pixel_start;
+    /* Flipped images arrive bottom row first. */
+    if (y == (dec->flip_vertical ? y0 : y1 - 1))
+        tonemap_stats_add(&dec->stats, row, (size_t)dec->out_width, 3);
+}
 
-    for (int y = 0; y < height; y++) {
+/*
+ * hdr_decoder_feed — Decode every complete scanline at the start of
+ *                    data[0, length).
+ *
+ * Returns the number of bytes consumed, which stops short of a trailing
+ * partial scanline, or -1 on corrupt data.  Bytes after the last scanline
+ * are ignored.
+ */
+static gssize
+hdr_decoder_feed(HdrDecoder *dec, const uint8_t *data, size_t length,
+                 GError **error)
+{
+    const int width = dec->width;
+    size_t    pos   = 0;
+
+    while (!hdr_decoder_done(dec)) {
         /* Determine output row (may be flipped) */
-        int out_y = flip_vertical ? (height - 1 - y) : y;
+        int y     = dec->rows_done;
+        int out_y = dec->flip_vertical ? (dec->height - 1 - y) : y;
+        uint8_t *scanline = dec->rgbe;
 
-        if (pos + 4 > length) {
-            g_set_error_literal(error, GDK_PIXBUF_ERROR,
-                                GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
-                                "HDR pixel data truncated");
-            goto cleanup;
-        }
+        if (!dec->accum)
+            scanline += (size_t)out_y * (size_t)width * 4;
+
+        if (length - pos < 4)
+            break;
 
         /* Check for new-style RLE: starts with 0x02 0x02 + width as big-endian */
         if (data[pos] == 0x02 && data[pos + 1] == 0x02) {
@@ -336,77 +612,313 @@ decode_hdr_from_memory(const guint8 *data, gsize length, GError **error)
                             GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
                             "HDR RLE width mismatch: expected %d, got %d",
                             width, rle_width);
-                goto cleanup;
+                return -1;
             }
-            pos += 4; /* skip RLE header */
 
-            if (!decode_rle_scanline(data, length, &pos, scanline,
-                                     width, error))
-                goto cleanup;
+            size_t size;
+            int    ret = measure_rle_scanline(data + pos + 4, length - pos - 4,
+                                              width, &size, error);
+            if (ret < 0)
+                return -1;
+            if (ret == 0)
+                break;
+
+            size_t rle_pos = pos + 4; /* skip RLE header */
+            if (!decode_rle_scanline(data, rle_pos + size, &rle_pos,
+                                     dec->planes, scanline, width, error))
+                return -1;
+            pos = rle_pos;
         } else {
             /* Flat (uncompressed): 4 bytes per pixel */
             size_t needed = (size_t)width * 4;
-            if (pos + needed > length) {
-                g_set_error_literal(error, GDK_PIXBUF_ERROR,
-                                    GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
-                                    "HDR pixel data truncated");
-                goto cleanup;
-            }
+            if (length - pos < needed)
+                break;
             memcpy(scanline, data + pos, needed);
             pos += needed;
         }
 
-        /* Convert RGBE scanline to float RGB */
-        for (int x = 0; x < width; x++) {
-            float r, g, b;
-            rgbe_to_float(scanline + x * 4, &r, &g, &b);
+        /* Gather exposure statistics while the row is still in cache. */
+        if (dec->accum)
+            hdr_decoder_accumulate(dec, scanline, out_y);
+        else
+            tonemap_stats_add_rgbe(&dec->stats, scanline, (size_t)width);
+        dec->rows_done++;
+    }
+
+    return (gssize)pos;
+}
+
+/*
+ * hdr_scanline_index — Find where each scanline of a whole file starts,
+ *                      walking only the RLE run headers.
+ *
+ * Sets offsets[0, height] (the last being the end of the pixel data) and
+ * checks the data the way hdr_decoder_feed() would, so the scanlines can
+ * then be decoded in any order.  *all_flat is set if no scanline is RLE.
+ */
+static gboolean
+hdr_scanline_index(const HdrDecoder *dec, const uint8_t *data, size_t length,
+                   size_t *offsets, gboolean *all_flat, GError **error)
+{
+    const int width = dec->width;
+    size_t    pos   = 0;
+
+    *all_flat = TRUE;
+
+    for (int y = 0; y < dec->height; y++) {
+        offsets[y] = pos;
+
+        if (length - pos < 4)
+            goto truncated;
 
-            float *dst = float_buf + ((size_t)out_y * (size_t)width + (size_t)x) * 3;
-            dst[0] = r;
-            dst[1] = g;
-            dst[2] = b;
+        if (data[pos] == 0x02 && data[pos + 1] == 0x02) {
+            int    rle_width = ((int)data[pos + 2] << 8) | (int)data[pos + 3];
+            size_t size;
+            int    ret;
+
+            if (rle_width != width) {
+                g_set_error(error, GDK_PIXBUF_ERROR,
+                            GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                            "HDR RLE width mismatch: expected %d, got %d",
+                            width, rle_width);
+                return FALSE;
+            }
+
+            ret = measure_rle_scanline(data + pos + 4, length - pos - 4,
+                                       width, &size, error);
+            if (ret < 0)
+                return FALSE;
+            if (ret == 0)
+                goto truncated;
+            pos += 4 + size;
+            *all_flat = FALSE;
+        } else {
+            if (length - pos < (size_t)width * 4)
+                goto truncated;
+            pos += (size_t)width * 4;
         }
     }
 
-    free(scanline);
-    scanline = NULL;
+    offsets[dec->height] = pos;
+    return TRUE;
 
-    /* --- Tonemap HDR -> 8-bit sRGB --- */
+truncated:
+    g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                        GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                        "HDR pixel data truncated");
+    return FALSE;
+}
 
-    srgb_buf = (uint8_t *)calloc(pixel_count, 4);
-    if (!srgb_buf) {
-        g_set_error_literal(error, GDK_PIXBUF_ERROR,
-                            GDK_PIXBUF_ERROR_FAILED,
-                            "Out of memory allocating sRGB buffer");
-        goto cleanup;
+typedef struct {
+    HdrDecoder    *dec;
+    const uint8_t *data;
+    const size_t  *offsets;
+    gboolean       in_place;    /* flat and top row first: no copy needed */
+    gboolean       sampled;     /* statistics left to a sample at the end */
+    uint8_t       *planes[PARALLEL_MAX_THREADS];  /* per worker, on demand */
+    TonemapStats  *stats[PARALLEL_MAX_THREADS];   /* per worker, on demand */
+    gint           failed;
+} HdrDecodeJob;
+
+static void
+hdr_decode_band(size_t task, unsigned worker, void *user_data)
+{
+    HdrDecodeJob *job = (HdrDecodeJob *)user_data;
+    HdrDecoder   *dec = job->dec;
+    int           y0  = (int)task * HDR_DECODE_BAND_ROWS;
+    int           y1  = MIN(y0 + HDR_DECODE_BAND_ROWS, dec->height);
+    TonemapStats *stats = NULL;
+
+    if (!job->sampled) {
+        if (!job->stats[worker])
+            job->stats[worker] = (TonemapStats *)calloc(1, sizeof(TonemapStats));
+        stats = job->stats[worker];
+        if (!stats) {
+            g_atomic_int_set(&job->failed, 1);
+            return;
+        }
+    }
+
+    for (int y = y0; y < y1; y++) {
+        int      out_y    = dec->flip_vertical ? (dec->height - 1 - y) : y;
+        uint8_t *scanline = dec->rgbe + (size_t)out_y * (size_t)dec->width * 4;
+        size_t   pos      = job->offsets[y];
+        size_t   end      = job->offsets[y + 1];
+
+        if (job->in_place) {
+            if (stats)
+                tonemap_stats_add_rgbe(stats, job->data + pos,
+                                       (size_t)dec->width);
+            continue;
+        }
+
+        if (job->data[pos] == 0x02 && job->data[pos + 1] == 0x02) {
+            uint8_t **planes = &job->planes[worker];
+
+            if (!*planes)
+                *planes = (uint8_t *)malloc((size_t)dec->width * 4);
+
+            pos += 4;  /* skip RLE header */
+            if (!*planes ||
+                !decode_rle_scanline(job->data, end, &pos, *planes, scanline,
+                                     dec->width, NULL)) {
+                g_atomic_int_set(&job->failed, 1);
+                return;
+            }
+        } else {
+            memcpy(scanline, job->data + pos, end - pos);
+        }
+
+        if (stats)
+            tonemap_stats_add_rgbe(stats, scanline, (size_t)dec->width);
     }
+}
 
-    tonemap_reinhard(float_buf, srgb_buf, width, height, 3);
+/*
+ * hdr_decoder_decode_all — Decode every scanline of a whole, full-size
+ * file: index the scanlines, then decode bands of them, and gather their
+ * statistics, on up to @n_threads threads.  At PREVIEW quality the
+ * statistics come from a sample of the decoded image instead.
+ *
+ * A flat file stored top row first is already the RGBE image, so it is
+ * left where it is: only the statistics are gathered, and @data must then
+ * outlive the tonemapping.
+ */
+static gboolean
+hdr_decoder_decode_all(HdrDecoder *dec, const uint8_t *data, size_t length,
+                       unsigned n_threads, GError **error)
+{
+    HdrDecodeJob job;
+    size_t      *offsets;
+    gboolean     all_flat;
+    gboolean     result = FALSE;
 
-    /* --- Create GdkPixbuf (always RGBA, 8-bit) --- */
+    offsets = g_new(size_t, (gsize)dec->height + 1);
+    if (!hdr_scanline_index(dec, data, length, offsets, &all_flat, error))
+        goto cleanup;
 
-    pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, width, height);
-    if (!pixbuf) {
+    job.dec      = dec;
+    job.data     = data;
+    job.offsets  = offsets;
+    job.in_place = all_flat && !dec->flip_vertical;
+    job.sampled  = dec->quality == TONEMAP_QUALITY_PREVIEW;
+    job.failed   = 0;
+    memset(job.planes, 0, sizeof job.planes);
+    memset(job.stats, 0, sizeof job.stats);
+
+    parallel_for((size_t)(dec->height + HDR_DECODE_BAND_ROWS - 1) /
+                 HDR_DECODE_BAND_ROWS, n_threads, hdr_decode_band, &job);
+
+    for (unsigned i = 0; i < PARALLEL_MAX_THREADS; i++) {
+        if (job.stats[i])
+            tonemap_stats_merge(&dec->stats, job.stats[i]);
+        free(job.planes[i]);
+        free(job.stats[i]);
+    }
+
+    /* The index has already checked every run, so this means no memory. */
+    if (g_atomic_int_get(&job.failed)) {
         g_set_error_literal(error, GDK_PIXBUF_ERROR,
                             GDK_PIXBUF_ERROR_FAILED,
-                            "Failed to allocate GdkPixbuf");
+                            "Out of memory decoding HDR scanlines");
         goto cleanup;
     }
 
-    {
-        int    rowstride = gdk_pixbuf_get_rowstride(pixbuf);
-        guchar *pixels   = gdk_pixbuf_get_pixels(pixbuf);
+    /* Flat top-down pixels are tonemapped straight from the file. */
+    if (job.in_place) {
+        free(dec->rgbe);
+        dec->rgbe  = NULL;
+        dec->image = data;
+    }
+
+    if (job.sampled)
+        tonemap_stats_sample(&dec->stats, dec->image, tonemap_rgbe_loader(),
+                             dec->width, dec->height, 4,
+                             TONEMAP_SAMPLE_BUDGET);
 
-        for (int y = 0; y < height; y++)
-            memcpy(pixels + y * rowstride,
-                   srgb_buf + (size_t)y * (unsigned)width * 4,
-                   (size_t)width * 4);
+    dec->rows_done = dec->height;
+    result = TRUE;
+
+cleanup:
+    g_free(offsets);
+
+    return result;
+}
+
+/*
+ * hdr_decoder_tonemap — Tonemap the decoded image into @pixbuf, calling
+ * @updated_func (if set) after each band of rows.
+ */
+static void
+hdr_decoder_tonemap(const HdrDecoder *dec, GdkPixbuf *pixbuf,
+                    GdkPixbufModuleUpdatedFunc updated_func,
+                    gpointer user_data)
+{
+    int     rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+    guchar *pixels    = gdk_pixbuf_get_pixels(pixbuf);
+    int     width     = dec->out_width;
+    int     height    = dec->out_height;
+    int     band_rows = height;
+
+    if (updated_func) {
+        band_rows = HDR_UPDATE_BAND_PIXELS / width;
+        if (band_rows < 1)
+            band_rows = 1;
+    }
+
+    for (int y = 0; y < height; y += band_rows) {
+        int     rows = MIN(band_rows, height - y);
+        guchar *out  = pixels + (size_t)y * (size_t)rowstride;
+
+        if (dec->accum)
+            tonemap_reinhard_apply(dec->accum + (size_t)y * (size_t)width * 3,
+                                   out, rowstride, width, rows, 3,
+                                   &dec->stats, dec->quality);
+        else
+            tonemap_reinhard_rgbe_apply(dec->image +
+                                            (size_t)y * (size_t)width * 4,
+                                        out, rowstride, width, rows,
+                                        &dec->stats, dec->quality);
+
+        if (updated_func)
+            updated_func(pixbuf, 0, y, width, rows, user_data);
     }
+}
+
+static GdkPixbuf *
+decode_hdr_from_memory(const guint8 *data, gsize length, GError **error)
+{
+    GdkPixbuf  *pixbuf = NULL;
+    HdrDecoder  dec;
+    int         width = 0, height = 0;
+    gboolean    flip_vertical = FALSE;
+
+    /* --- Parse header --- */
+
+    size_t pixel_start = parse_hdr_header(data, length, &width, &height,
+                                          &flip_vertical, error);
+    if (pixel_start == 0)
+        return NULL;
+
+    /* --- Decode pixel data --- */
+
+    if (!hdr_decoder_init(&dec, width, height, width, height, flip_vertical,
+                          error))
+        goto cleanup;
+
+    if (!hdr_decoder_decode_all(&dec, data + pixel_start,
+                                length - pixel_start,
+                                parallel_get_max_threads(), error))
+        goto cleanup;
+
+    /* --- Tonemap HDR -> 8-bit sRGB, straight into the pixbuf --- */
+
+    pixbuf = hdr_pixbuf_new(width, height, error);
+    if (pixbuf)
+        hdr_decoder_tonemap(&dec, pixbuf, NULL, NULL);
 
 cleanup:
-    free(float_buf);
-    free(srgb_buf);
-    free(scanline);
+    hdr_decoder_clear(&dec);
 
     return pixbuf;
 }
@@ -419,52 +931,12 @@ static GdkPixbuf *
 hdr_load(FILE *f, GError **error)
 {
     GdkPixbuf *pixbuf = NULL;
-    guint8    *buf    = NULL;
-    long       size;
-
-    if (fseek(f, 0, SEEK_END) != 0) {
-        g_set_error_literal(error, GDK_PIXBUF_ERROR,
-                            GDK_PIXBUF_ERROR_FAILED,
-                            "Failed to seek in HDR file");
-        return NULL;
-    }
+    FileMap    map;
 
-    size = ftell(f);
-    if (size < 0) {
-        g_set_error_literal(error, GDK_PIXBUF_ERROR,
-                            GDK_PIXBUF_ERROR_FAILED,
-                            "Failed to determine HDR file size");
-        return NULL;
-    }
+    if (file_map_load(&map, f, HDR_MAX_FILE_SIZE, "HDR", error))
+        pixbuf = decode_hdr_from_memory(map.data, map.length, error);
 
-    if (size > HDR_MAX_FILE_SIZE) {
-        g_set_error(error, GDK_PIXBUF_ERROR,
-                    GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
-                    "HDR file too large (%ld bytes, limit %d)",
-                    size, HDR_MAX_FILE_SIZE);
-        return NULL;
-    }
-
-    if (fseek(f, 0, SEEK_SET) != 0) {
-        g_set_error_literal(error, GDK_PIXBUF_ERROR,
-                            GDK_PIXBUF_ERROR_FAILED,
-                            "Failed to rewind HDR file");
-        return NULL;
-    }
-
-    gsize file_size = (gsize)size;
-    buf = (guint8 *)g_malloc(file_size);
-
-    if (fread(buf, 1, file_size, f) != file_size) {
-        g_set_error_literal(error, GDK_PIXBUF_ERROR,
-                            GDK_PIXBUF_ERROR_FAILED,
-                            "Failed to read HDR file");
-        g_free(buf);
-        return NULL;
-    }
-
-    pixbuf = decode_hdr_from_memory(buf, file_size, error);
-    g_free(buf);
+    file_map_clear(&map);
     return pixbuf;
 }
 
@@ -472,6 +944,15 @@ hdr_load(FILE *f, GError **error)
 /*  Incremental (progressive) loader                                   */
 /* ------------------------------------------------------------------ */
 
+/*
+ * The incremental loader is a small state machine.  Until the header is
+ * complete, bytes collect in ctx->buffer.  After that, scanlines are
+ * decoded straight out of each chunk as it arrives, and ctx->buffer only
+ * carries the partial scanline left over at the end of a chunk, so it never
+ * grows beyond one encoded scanline.  Once every scanline is in, later bytes
+ * are ignored and stop_load() tonemaps the image in bands.
+ */
+
 static gpointer
 hdr_begin_load(GdkPixbufModuleSizeFunc     size_func,
                GdkPixbufModulePreparedFunc  prepared_func,
@@ -493,6 +974,130 @@ hdr_begin_load(GdkPixbufModuleSizeFunc     size_func,
     return ctx;
 }
 
+/*
+ * hdr_context_feed — Decode scanlines from a chunk of pixel data, going
+ *                    through the carry buffer only for scanlines that
+ *                    straddle two chunks.
+ */
+static gboolean
+hdr_context_feed(HdrContext *ctx, const guint8 *data, gsize length,
+                 GError **error)
+{
+    HdrDecoder *dec   = &ctx->decoder;
+    GByteArray *carry = ctx->buffer;
+    gssize      consumed;
+
+    while (length > 0 && !hdr_decoder_done(dec)) {
+        if (carry->len == 0) {
+            consumed = hdr_decoder_feed(dec, data, length, error);
+            if (consumed < 0)
+                return FALSE;
+
+            /* Keep the partial scanline at the end for next time. */
+            if (!hdr_decoder_done(dec))
+                g_byte_array_append(carry, data + consumed,
+                                    (guint)(length - (gsize)consumed));
+            return TRUE;
+        }
+
+        /* Top the carry up to one maximal scanline and retry it. */
+        gsize old_len = carry->len;
+        gsize take    = hdr_decoder_max_scanline(dec) - old_len;
+        if (take > length)
+            take = length;
+
+        g_byte_array_append(carry, data, (guint)take);
+
+        consumed = hdr_decoder_feed(dec, carry->data, carry->len, error);
+        if (consumed < 0)
+            return FALSE;
+
+        if (consumed == 0) {
+            /* Still incomplete: everything taken stays in the carry. */
+            if (carry->len >= hdr_decoder_max_scanline(dec)) {
+                g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                                    GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                                    "HDR scanline exceeds maximum size");
+                return FALSE;
+            }
+            data   += take;
+            length -= take;
+            continue;
+        }
+
+        /* The carried scanline is done; the rest goes back to the chunk. */
+        gsize used = (gsize)consumed - old_len;
+        g_byte_array_set_size(carry, 0);
+        data   += used;
+        length -= used;
+    }
+
+    return TRUE;
+}
+
+/*
+ * hdr_context_parse_header — Parse the buffered header, let the caller
+ * see the size, and hand out the (still blank) pixbuf.
+ *
+ * A caller that sets the size to 0x0 only wanted the dimensions:
+ * ctx->cancelled is set and no pixel data will be decoded.  A smaller
+ * size is honoured by decoding straight to it.
+ */
+static gboolean
+hdr_context_parse_header(HdrContext *ctx, GError **error)
+{
+    int      width, height;
+    int      out_width, out_height;
+    gboolean flip_vertical;
+    size_t   pixel_start;
+
+    pixel_start = parse_hdr_header(ctx->buffer->data, ctx->buffer->len,
+                                   &width, &height, &flip_vertical, error);
+    if (pixel_start == 0)
+        return FALSE;
+
+    ctx->header_parsed = TRUE;
+    out_width  = width;
+    out_height = height;
+
+    if (ctx->size_func) {
+        int req_width = width, req_height = height;
+
+        ctx->size_func(&req_width, &req_height, ctx->user_data);
+        if (req_width <= 0 || req_height <= 0) {
+            ctx->cancelled = TRUE;
+            g_byte_array_set_size(ctx->buffer, 0);
+            return TRUE;
+        }
+
+        /* Shrink while decoding; gdk-pixbuf scales up itself. */
+        out_width  = MIN(req_width, width);
+        out_height = MIN(req_height, height);
+    }
+
+    if (!hdr_decoder_init(&ctx->decoder, width, height, out_width, out_height,
+                          flip_vertical, error))
+        return FALSE;
+
+    ctx->pixbuf = hdr_pixbuf_new(out_width, out_height, error);
+    if (!ctx->pixbuf)
+        return FALSE;
+
+    if (ctx->prepared_func)
+        ctx->prepared_func(ctx->pixbuf, NULL, ctx->user_data);
+
+    /* Whatever followed the header is the first pixel data. */
+    GByteArray *header = ctx->buffer;
+    gboolean    ok;
+
+    ctx->buffer = g_byte_array_new();
+    ok = hdr_context_feed(ctx, header->data + pixel_start,
+                          header->len - pixel_start, error);
+    g_byte_array_free(header, TRUE);
+
+    return ok;
+}
+
 static gboolean
 hdr_load_increment(gpointer      context,
                    const guchar *buf,
@@ -501,15 +1106,26 @@ hdr_load_increment(gpointer      context,
 {
     HdrContext *ctx = (HdrContext *)context;
 
-    g_byte_array_append(ctx->buffer, buf, size);
+    /* After a cancel the rest of the stream is skipped unread. */
+    if (ctx->cancelled)
+        return TRUE;
 
-    if (ctx->buffer->len > HDR_MAX_FILE_SIZE) {
+    ctx->bytes_seen += size;
+    if (ctx->bytes_seen > HDR_MAX_FILE_SIZE) {
         g_set_error_literal(error, GDK_PIXBUF_ERROR,
                             GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
                             "HDR data exceeds maximum file size");
         return FALSE;
     }
 
+    if (ctx->header_parsed)
+        return hdr_context_feed(ctx, buf, size, error);
+
+    g_byte_array_append(ctx->buffer, buf, size);
+
+    if (hdr_header_complete(ctx->buffer->data, ctx->buffer->len))
+        return hdr_context_parse_header(ctx, error);
+
     return TRUE;
 }
 
@@ -517,37 +1133,35 @@ static gboolean
 hdr_stop_load(gpointer context, GError **error)
 {
     HdrContext *ctx    = (HdrContext *)context;
-    GdkPixbuf  *pixbuf = NULL;
     gboolean    result = TRUE;
 
-    pixbuf = decode_hdr_from_memory(ctx->buffer->data,
-                                    ctx->buffer->len,
-                                    error);
-    if (!pixbuf) {
-        result = FALSE;
-        goto out;
-    }
-
-    {
-        int width  = gdk_pixbuf_get_width(pixbuf);
-        int height = gdk_pixbuf_get_height(pixbuf);
-
-        if (ctx->size_func) {
-            ctx->size_func(&width, &height, ctx->user_data);
-            if (width <= 0 || height <= 0)
-                goto out;  /* load cancelled by caller */
+    /* A header that never completed gets its error reported here. */
+    if (!ctx->header_parsed && !ctx->cancelled) {
+        if (!hdr_context_parse_header(ctx, error)) {
+            result = FALSE;
+            goto out;
         }
+    }
 
-        if (ctx->prepared_func)
-            ctx->prepared_func(pixbuf, NULL, ctx->user_data);
+    if (ctx->cancelled)
+        goto out;  /* load cancelled by caller */
 
-        if (ctx->updated_func)
-            ctx->updated_func(pixbuf, 0, 0, width, height, ctx->user_data);
+    if (!hdr_decoder_done(&ctx->decoder)) {
+        g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                            GDK_PIXBUF_ERROR_CORRUPT_IMAGE,
+                            "HDR pixel data truncated");
+        result = FALSE;
+        goto out;
     }
 
+    hdr_decoder_tonemap(&ctx->decoder, ctx->pixbuf,
+                        ctx->updated_func, ctx->user_data);
+
 out:
-    if (pixbuf)
-        g_object_unref(pixbuf);
+    if (ctx->pixbuf)
+        g_object_unref(ctx->pixbuf);
+    if (ctx->header_parsed)
+        hdr_decoder_clear(&ctx->decoder);
     g_byte_array_free(ctx->buffer, TRUE);
     g_free(ctx);
     return result;
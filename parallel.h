@@ -0,0 +1,188 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * parallel.h — Fork/join helper for the EXR and HDR loaders.
+ *
+ * All functions are static inline so this header can be included directly
+ * without creating a separate compilation unit.
+ *
+ * parallel_for() runs a fixed list of tasks on a GLib thread pool, with
+ * the calling thread taking part.  Each loader module gets its own pool,
+ * but the pools are non-exclusive, so GLib hands the same idle threads to
+ * both.  How tasks are split never depends on the thread count: callers
+ * that keep one result per task and reduce them in task order get
+ * bit-identical output however many threads ran.
+ */
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <glib.h>
+
+/* Environment variable capping the number of threads (1 disables). */
+#define PARALLEL_THREADS_ENV "GDK_PIXBUF_HDR_THREADS"
+
+/* Hard cap on threads per job, whatever the CPU count or environment. */
+#define PARALLEL_MAX_THREADS 64
+
+/*
+ * ParallelFunc — Run one task.  @worker is in [0, number of threads) and
+ * unique among the threads of a job, for per-thread scratch space.
+ */
+typedef void (*ParallelFunc)(size_t task, unsigned worker, void *user_data);
+
+typedef struct {
+    ParallelFunc func;
+    void        *user_data;
+    gint         n_tasks;
+    gint         next_task;
+    gint         next_worker;
+    gint         ref_count;
+    gint         tasks_done;   /* protected by lock */
+    GMutex       lock;
+    GCond        cond;
+} ParallelJob;
+
+static inline void
+parallel_job_unref(ParallelJob *job)
+{
+    if (g_atomic_int_dec_and_test(&job->ref_count)) {
+        g_mutex_clear(&job->lock);
+        g_cond_clear(&job->cond);
+        g_free(job);
+    }
+}
+
+static inline void
+parallel_job_run(ParallelJob *job)
+{
+    unsigned worker = (unsigned)g_atomic_int_add(&job->next_worker, 1);
+    gint     done   = 0;
+
+    for (;;) {
+        gint task = g_atomic_int_add(&job->next_task, 1);
+        if (task >= job->n_tasks)
+            break;
+        job->func((size_t)task, worker, job->user_data);
+        done++;
+    }
+
+    if (done > 0) {
+        g_mutex_lock(&job->lock);
+        job->tasks_done += done;
+        if (job->tasks_done == job->n_tasks)
+            g_cond_broadcast(&job->cond);
+        g_mutex_unlock(&job->lock);
+    }
+}
+
+static inline void
+parallel_pool_func(gpointer data, gpointer pool_data)
+{
+    ParallelJob *job = (ParallelJob *)data;
+
+    (void)pool_data;
+
+    /* A helper that starts after the caller finished every task finds
+     * nothing left and only drops its reference. */
+    parallel_job_run(job);
+    parallel_job_unref(job);
+}
+
+/*
+ * parallel_get_max_threads — Threads a job may use: the CPU count, or
+ * GDK_PIXBUF_HDR_THREADS if set to a positive number.  Read once.
+ */
+static inline unsigned
+parallel_get_max_threads(void)
+{
+    static gsize max_threads = 0;
+
+    if (g_once_init_enter(&max_threads)) {
+        const char *env = g_getenv(PARALLEL_THREADS_ENV);
+        guint64     n   = 0;
+
+        if (env != NULL)
+            n = g_ascii_strtoull(env, NULL, 10);
+        if (n == 0)
+            n = g_get_num_processors();
+        if (n > PARALLEL_MAX_THREADS)
+            n = PARALLEL_MAX_THREADS;
+
+        g_once_init_leave(&max_threads, (gsize)n);
+    }
+
+    return (unsigned)max_threads;
+}
+
+static inline GThreadPool *
+parallel_get_pool(void)
+{
+    static GThreadPool *pool = NULL;
+    static gsize        initialized = 0;
+
+    if (g_once_init_enter(&initialized)) {
+        unsigned helpers = parallel_get_max_threads() - 1;
+
+        pool = g_thread_pool_new(parallel_pool_func, NULL,
+                                 helpers > 0 ? (gint)helpers : 1,
+                                 FALSE, NULL);
+        g_once_init_leave(&initialized, 1);
+    }
+
+    return pool;
+}
+
+/*
+ * parallel_for — Call func(task, worker, user_data) for every task in
+ *                [0, n_tasks) on up to n_threads threads, and wait.
+ *
+ * Tasks may run in any order and on any thread.  Must not be nested:
+ * a task must not call parallel_for() itself.
+ */
+static inline void
+parallel_for(size_t n_tasks, unsigned n_threads,
+             ParallelFunc func, void *user_data)
+{
+    GThreadPool *pool = NULL;
+
+    if (n_threads > n_tasks)
+        n_threads = (unsigned)n_tasks;
+    if (n_threads > PARALLEL_MAX_THREADS)
+        n_threads = PARALLEL_MAX_THREADS;
+    if (n_threads > 1 && n_tasks <= G_MAXINT)
+        pool = parallel_get_pool();
+
+    if (pool == NULL) {
+        for (size_t t = 0; t < n_tasks; t++)
+            func(t, 0, user_data);
+        return;
+    }
+
+    ParallelJob *job = g_new0(ParallelJob, 1);
+    job->func      = func;
+    job->user_data = user_data;
+    job->n_tasks   = (gint)n_tasks;
+    job->ref_count = 1;
+    g_mutex_init(&job->lock);
+    g_cond_init(&job->cond);
+
+    for (unsigned i = 1; i < n_threads; i++) {
+        g_atomic_int_inc(&job->ref_count);
+        if (!g_thread_pool_push(pool, job, NULL))
+            parallel_job_unref(job);
+    }
+
+    parallel_job_run(job);
+
+    g_mutex_lock(&job->lock);
+    while (job->tasks_done < job->n_tasks)
+        g_cond_wait(&job->cond, &job->lock);
+    g_mutex_unlock(&job->lock);
+
+    parallel_job_unref(job);
+}
+
+#endif /* PARALLEL_H */
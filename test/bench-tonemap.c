@@ -0,0 +1,132 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * bench-tonemap.c — Time each TonemapQuality on a large synthetic image.
+ *
+ * Run with `meson test -C builddir --benchmark -v`.  Prints the best of
+ * several runs per quality, for float RGB and for Radiance RGBE input,
+ * and the speedup over EXACT.
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "tonemap.h"
+
+#define BENCH_WIDTH  4096
+#define BENCH_HEIGHT 2048
+#define BENCH_RUNS   5
+
+static const char *const quality_names[] = { "exact", "fast", "preview" };
+
+/* Small deterministic PRNG, as in test-tonemap.c. */
+static guint32 rng_state = 0x12345678u;
+
+static float
+rand_unit(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return (float)(rng_state >> 8) / 16777216.0f;
+}
+
+/* A smooth sky-like gradient with noise and a few bright highlights. */
+static void
+make_image(float *rgb, uint8_t *rgbe)
+{
+    for (int y = 0; y < BENCH_HEIGHT; y++) {
+        for (int x = 0; x < BENCH_WIDTH; x++) {
+            size_t i = (size_t)y * BENCH_WIDTH + (size_t)x;
+            float  v = expf(-6.0f * (float)y / BENCH_HEIGHT + rand_unit());
+
+            if ((x / 64 + y / 64) % 17 == 0)
+                v *= 500.0f;
+
+            rgb[i * 3 + 0] = v;
+            rgb[i * 3 + 1] = v * 0.8f;
+            rgb[i * 3 + 2] = v * (0.5f + rand_unit());
+
+            int   e;
+            float f;
+
+            frexpf(fmaxf(v, rgb[i * 3 + 2]), &e);
+            f = ldexpf(256.0f, -e);
+            rgbe[i * 4 + 0] = (uint8_t)(rgb[i * 3 + 0] * f);
+            rgbe[i * 4 + 1] = (uint8_t)(rgb[i * 3 + 1] * f);
+            rgbe[i * 4 + 2] = (uint8_t)(rgb[i * 3 + 2] * f);
+            rgbe[i * 4 + 3] = (uint8_t)(e + 128);
+        }
+    }
+}
+
+static double
+time_float(const float *rgb, uint8_t *out, TonemapQuality quality)
+{
+    gint64 best = G_MAXINT64;
+
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        gint64 t0 = g_get_monotonic_time();
+
+        tonemap_reinhard_quality(rgb, out, BENCH_WIDTH * 4,
+                                 BENCH_WIDTH, BENCH_HEIGHT, 3,
+                                 tonemap_best_isa(), quality,
+                                 parallel_get_max_threads());
+        best = MIN(best, g_get_monotonic_time() - t0);
+    }
+
+    return (double)best / 1000.0;
+}
+
+static double
+time_rgbe(const uint8_t *rgbe, uint8_t *out, TonemapQuality quality)
+{
+    gint64 best = G_MAXINT64;
+
+    g_setenv(TONEMAP_QUALITY_ENV, quality_names[quality], TRUE);
+
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        gint64 t0 = g_get_monotonic_time();
+
+        tonemap_reinhard_rgbe(rgbe, out, BENCH_WIDTH * 4,
+                              BENCH_WIDTH, BENCH_HEIGHT);
+        best = MIN(best, g_get_monotonic_time() - t0);
+    }
+
+    g_unsetenv(TONEMAP_QUALITY_ENV);
+    return (double)best / 1000.0;
+}
+
+int
+main(void)
+{
+    size_t   pixels = (size_t)BENCH_WIDTH * BENCH_HEIGHT;
+    float   *rgb    = g_new(float, pixels * 3);
+    uint8_t *rgbe   = g_new(uint8_t, pixels * 4);
+    uint8_t *out    = g_new(uint8_t, pixels * 4);
+    double   base_float = 0.0, base_rgbe = 0.0;
+
+    make_image(rgb, rgbe);
+
+    printf("%dx%d, %u thread(s)\n", BENCH_WIDTH, BENCH_HEIGHT,
+           parallel_get_max_threads());
+
+    for (int q = TONEMAP_QUALITY_EXACT; q <= TONEMAP_QUALITY_PREVIEW; q++) {
+        double ms_float = time_float(rgb, out, (TonemapQuality)q);
+        double ms_rgbe  = time_rgbe(rgbe, out, (TonemapQuality)q);
+
+        if (q == TONEMAP_QUALITY_EXACT) {
+            base_float = ms_float;
+            base_rgbe  = ms_rgbe;
+        }
+
+        printf("%-8s float %8.1f ms (%.2fx)   rgbe %8.1f ms (%.2fx)\n",
+               quality_names[q], ms_float, base_float / ms_float,
+               ms_rgbe, base_rgbe / ms_rgbe);
+    }
+
+    g_free(rgb);
+    g_free(rgbe);
+    g_free(out);
+    return 0;
+}
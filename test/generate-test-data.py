@@ -11,9 +11,243 @@ DATA_DIR = os.path.join(os.path.dirname(__file__), "data")
 
 # ---- EXR helpers ----
 
-def write_exr(path, width, height, pixel_data_rgb):
+EXR_COMPRESSION_NONE = 0
+EXR_COMPRESSION_PIZ = 4
+
+EXR_PIXEL_HALF = 1
+EXR_PIXEL_FLOAT = 2
+
+# struct format and size in bytes of one sample of each pixel type
+EXR_SAMPLE = {EXR_PIXEL_HALF: ('<e', 2), EXR_PIXEL_FLOAT: ('<f', 4)}
+
+
+def exr_channel_names(pixels):
+    """(name, index into each pixel) in alphabetical order, with A for RGBA."""
+    names = [('B', 2), ('G', 1), ('R', 0)]
+    if len(pixels[0]) == 4:
+        names.insert(0, ('A', 3))
+    return names
+
+
+# ---- EXR PIZ compression, after OpenEXR's ImfPizCompressor and ImfHuf ----
+
+class BitWriter:
+    """Most significant bit first, as the PIZ Huffman coder writes."""
+
+    def __init__(self):
+        self.out = bytearray()
+        self.c = 0
+        self.lc = 0
+        self.nbits = 0
+
+    def put(self, nbits, bits):
+        self.c = (self.c << nbits) | bits
+        self.lc += nbits
+        self.nbits += nbits
+        while self.lc >= 8:
+            self.lc -= 8
+            self.out.append((self.c >> self.lc) & 0xff)
+        self.c &= (1 << self.lc) - 1
+
+    def getvalue(self):
+        if self.lc:
+            return bytes(self.out) + bytes([(self.c << (8 - self.lc)) & 0xff])
+        return bytes(self.out)
+
+
+def _huf_lengths(freq):
+    """Huffman code length of each symbol."""
+    import heapq
+
+    heap = [(f, i, [sym]) for i, (sym, f) in enumerate(sorted(freq.items()))]
+    heapq.heapify(heap)
+    lengths = dict.fromkeys(freq, 0)
+    while len(heap) > 1:
+        f1, i1, s1 = heapq.heappop(heap)
+        f2, _, s2 = heapq.heappop(heap)
+        for sym in s1 + s2:
+            lengths[sym] += 1
+        heapq.heappush(heap, (f1 + f2, i1, s1 + s2))
+    assert max(lengths.values()) <= 58
+    return lengths
+
+
+def _huf_canonical(lengths):
+    """Canonical codes for the lengths, as the decoder rebuilds them."""
+    n = [0] * 59
+    for l in lengths.values():
+        n[l] += 1
+    c = 0
+    for i in range(58, 0, -1):
+        n[i], c = c, (c + n[i]) >> 1
+    codes = {}
+    for sym in sorted(lengths):
+        l = lengths[sym]
+        codes[sym] = (n[l], l)
+        n[l] += 1
+    return codes
+
+
+def huf_compress(words):
+    """Huffman-code 16-bit words, with runs of up to 255 repeats."""
+    freq = {}
+    for w in words:
+        freq[w] = freq.get(w, 0) + 1
+    im = min(freq)
+    rlc = max(freq) + 1  # run-length pseudo-symbol
+    freq[rlc] = 1
+    lengths = _huf_lengths(freq)
+    codes = _huf_canonical(lengths)
+
+    # Code lengths of im..rlc, 6 bits each, runs of zeros shortened
+    table = BitWriter()
+    i = im
+    while i <= rlc:
+        l = lengths.get(i, 0)
+        if l == 0:
+            zerun = 1
+            while i < rlc and zerun < 255 + 6 and lengths.get(i + 1, 0) == 0:
+                i += 1
+                zerun += 1
+            if zerun >= 6:
+                table.put(6, 63)
+                table.put(8, zerun - 6)
+                i += 1
+                continue
+            if zerun >= 2:
+                table.put(6, 59 + zerun - 2)
+                i += 1
+                continue
+        table.put(6, l)
+        i += 1
+
+    data = BitWriter()
+
+    def send(sym, run):
+        code, length = codes[sym]
+        rl_code, rl_length = codes[rlc]
+        if length + rl_length + 8 < length * run:
+            data.put(length, code)
+            data.put(rl_length, rl_code)
+            data.put(8, run)
+        else:
+            for _ in range(run + 1):
+                data.put(length, code)
+
+    s, cs = words[0], 0
+    for w in words[1:]:
+        if w == s and cs < 255:
+            cs += 1
+        else:
+            send(s, cs)
+            cs = 0
+        s = w
+    send(s, cs)
+
+    table = table.getvalue()
+    return (struct.pack('<IIIII', im, rlc, len(table), data.nbits, 0) +
+            table + data.getvalue())
+
+
+def _wenc14(a, b):
+    a = a - 0x10000 if a >= 0x8000 else a
+    b = b - 0x10000 if b >= 0x8000 else b
+    return ((a + b) >> 1) & 0xffff, (a - b) & 0xffff
+
+
+def _wenc16(a, b):
+    ao = (a + 0x8000) & 0xffff
+    m = (ao + b) >> 1
+    d = ao - b
+    if d < 0:
+        m = (m + 0x8000) & 0xffff
+    return m, d & 0xffff
+
+
+def wav2_encode(buf, start, nx, ox, ny, oy, mx):
+    """2D Haar wavelet of an nx x ny plane of words, in place."""
+    enc = _wenc14 if mx < (1 << 14) else _wenc16
+    n = min(nx, ny)
+    p, p2 = 1, 2
+    while p2 <= n:
+        ox1, ox2, oy1, oy2 = ox * p, ox * p2, oy * p, oy * p2
+        py = start
+        while py <= start + oy * (ny - p2):
+            px = py
+            while px <= py + ox * (nx - p2):
+                p01, p10 = px + ox1, px + oy1
+                p11 = p10 + ox1
+                i00, i01 = enc(buf[px], buf[p01])
+                i10, i11 = enc(buf[p10], buf[p11])
+                buf[px], buf[p10] = enc(i00, i10)
+                buf[p01], buf[p11] = enc(i01, i11)
+                px += ox2
+            if nx & p:  # odd column
+                buf[px], buf[px + oy1] = enc(buf[px], buf[px + oy1])
+            py += oy2
+        if ny & p:  # odd line
+            px = py
+            while px <= py + ox * (nx - p2):
+                buf[px], buf[px + ox1] = enc(buf[px], buf[px + ox1])
+                px += ox2
+        p, p2 = p2, p2 << 1
+
+
+def piz_compress(raw, width, rows, sample_sizes):
+    """
+    PIZ-compress rows uncompressed lines of width pixels, each line
+    holding one run of samples per channel (sample_sizes bytes each).
+    """
+    # Lines to one plane of 16-bit words per channel
+    line_bytes = width * sum(sample_sizes)
+    words = []
+    for c, size in enumerate(sample_sizes):
+        offset = width * sum(sample_sizes[:c])
+        for y in range(rows):
+            start = y * line_bytes + offset
+            words += struct.unpack('<%dH' % (width * size // 2),
+                                   raw[start:start + width * size])
+
+    # Map the words that occur onto 0..max_value
+    bitmap = bytearray(8192)
+    for w in words:
+        bitmap[w >> 3] |= 1 << (w & 7)
+    bitmap[0] &= ~1  # zero is implied
+    used = [i for i, b in enumerate(bitmap) if b]
+    min_nz, max_nz = (used[0], used[-1]) if used else (8191, 0)
+
+    lut = {}
+    for i in range(65536):
+        if i == 0 or bitmap[i >> 3] & (1 << (i & 7)):
+            lut[i] = len(lut)
+    words = [lut[w] for w in words]
+    max_value = len(lut) - 1
+
+    start = 0
+    for size in sample_sizes:
+        n = size // 2
+        for j in range(n):
+            wav2_encode(words, start + j, width, n, rows, width * n, max_value)
+        start += width * rows * n
+
+    out = struct.pack('<HH', min_nz, max_nz)
+    if min_nz <= max_nz:
+        out += bytes(bitmap[min_nz:max_nz + 1])
+    huf = huf_compress(words)
+    return out + struct.pack('<i', len(huf)) + huf
+
+
+def write_exr(path, width, height, pixel_data_rgb, preview=None, layers=None,
+              compression=EXR_COMPRESSION_NONE, pixel_type=EXR_PIXEL_FLOAT):
     """
-    Write a minimal single-part scanline EXR file with FLOAT channels.
+    Write a minimal single-part scanline EXR file with FLOAT channels, or
+    HALF ones with pixel_type EXR_PIXEL_HALF.
+
+    pixel_data_rgb holds (r, g, b) or, for an A channel too, (r, g, b, a).
+    preview, if given, is (width, height, rgba_bytes) for an embedded
+    8-bit preview image.  layers, if given, replaces pixel_data_rgb with a
+    list of (prefix, pixels): each adds channels prefix + "R", "G", "B".
+    compression is EXR_COMPRESSION_NONE or EXR_COMPRESSION_PIZ.
 
     EXR format (simplified for uncompressed scanline):
     - Magic: 0x762f3101 (4 bytes)
@@ -42,13 +276,22 @@ def write_exr(path, width, height, pixel_data_rgb):
         buf.write(struct.pack('<I', len(data)))
         buf.write(data)
 
+    if layers is None:
+        layers = [('', pixel_data_rgb)]
+
+    # (name, pixels, index into each pixel), in alphabetical order
+    channels = sorted((prefix + name, pixels, idx)
+                      for prefix, pixels in layers
+                      for name, idx in exr_channel_names(pixels))
+    sample_format, sample_size = EXR_SAMPLE[pixel_type]
+
     # channels attribute (chlist)
     # Each channel: name (NUL-terminated), pixel_type (int32), pLinear (uint8),
     #               reserved (3 bytes), xSampling (int32), ySampling (int32)
     ch_data = b''
-    for ch_name in ['B', 'G', 'R']:  # EXR stores channels alphabetically
+    for ch_name, _, _ in channels:  # EXR stores channels alphabetically
         ch_data += ch_name.encode('ascii') + b'\x00'
-        ch_data += struct.pack('<I', 2)  # FLOAT = 2
+        ch_data += struct.pack('<I', pixel_type)  # HALF = 1, FLOAT = 2
         ch_data += struct.pack('<B', 0)  # pLinear
         ch_data += b'\x00' * 3  # reserved
         ch_data += struct.pack('<i', 1)  # xSampling
@@ -56,8 +299,8 @@ def write_exr(path, width, height, pixel_data_rgb):
     ch_data += b'\x00'  # end of channel list
     write_attr('channels', 'chlist', ch_data)
 
-    # compression: 0 = NO_COMPRESSION
-    write_attr('compression', 'compression', struct.pack('<B', 0))
+    # compression: 0 = NO_COMPRESSION, 4 = PIZ_COMPRESSION
+    write_attr('compression', 'compression', struct.pack('<B', compression))
 
     # dataWindow: box2i (4 x int32)
     write_attr('dataWindow', 'box2i',
@@ -79,36 +322,50 @@ def write_exr(path, width, height, pixel_data_rgb):
     # screenWindowWidth: float
     write_attr('screenWindowWidth', 'float', struct.pack('<f', 1.0))
 
+    # preview: width, height (uint32), then 8-bit RGBA pixels
+    if preview is not None:
+        pw, ph, rgba = preview
+        write_attr('preview', 'preview', struct.pack('<II', pw, ph) + rgba)
+
     # End of header
     buf.write(b'\x00')
 
-    # Offset table: one uint64 per scanline
-    # We need to compute where each scanline block starts.
-    header_end = buf.tell()
-    offset_table_size = height * 8  # 8 bytes per offset
-
-    # Each scanline block: y_coordinate (int32) + pixel_data_size (int32) + pixel_data
-    # For uncompressed: pixel_data_size = width * 3_channels * 4_bytes_per_float
-    scanline_pixel_bytes = width * 3 * 4
-    scanline_block_size = 4 + 4 + scanline_pixel_bytes  # y + size + data
-
-    # Compute offsets
-    data_start = header_end + offset_table_size
+    # Scanline data: each line holds all (A,) B, G, then R values
+    # (channels in alphabetical order), as little-endian samples
+    lines = []
     for y in range(height):
-        offset = data_start + y * scanline_block_size
+        line = b''
+        for _, pixels, ch_idx in channels:  # B=2, G=1, R=0 in the RGB input
+            for x in range(width):
+                pixel = pixels[y * width + x]
+                line += struct.pack(sample_format, pixel[ch_idx])
+        lines.append(line)
+
+    # One chunk per scanline uncompressed, or per 32 scanlines with PIZ
+    lines_per_chunk = 32 if compression == EXR_COMPRESSION_PIZ else 1
+    chunks = []
+    for y in range(0, height, lines_per_chunk):
+        raw = b''.join(lines[y:y + lines_per_chunk])
+        data = raw
+        if compression == EXR_COMPRESSION_PIZ:
+            rows = min(lines_per_chunk, height - y)
+            data = piz_compress(raw, width, rows,
+                                [sample_size] * len(channels))
+            if len(data) >= len(raw):
+                data = raw  # stored as is when it doesn't shrink
+        chunks.append((y, data))
+
+    # Offset table: one uint64 per chunk, each chunk being
+    # y_coordinate (int32) + pixel_data_size (int32) + pixel_data
+    offset = buf.tell() + len(chunks) * 8
+    for _, data in chunks:
         buf.write(struct.pack('<Q', offset))
+        offset += 8 + len(data)
 
-    # Scanline data blocks
-    # Channels are stored in alphabetical order: B, G, R
-    for y in range(height):
+    for y, data in chunks:
         buf.write(struct.pack('<i', y))  # y coordinate
-        buf.write(struct.pack('<I', scanline_pixel_bytes))  # data size
-
-        # Write channel data: all B values, then all G values, then all R values
-        for ch_idx in [2, 1, 0]:  # B=2, G=1, R=0 in the RGB input
-            for x in range(width):
-                pixel = pixel_data_rgb[y * width + x]
-                buf.write(struct.pack('<f', pixel[ch_idx]))
+        buf.write(struct.pack('<I', len(data)))  # data size
+        buf.write(data)
 
     data = buf.getvalue()
     os.makedirs(os.path.dirname(path), exist_ok=True)
@@ -116,6 +373,131 @@ def write_exr(path, width, height, pixel_data_rgb):
         f.write(data)
 
 
+def write_exr_tiled(path, width, height, levels, tile_size,
+                    compression=EXR_COMPRESSION_NONE,
+                    pixel_type=EXR_PIXEL_FLOAT):
+    """
+    Write a single-part tiled EXR file with FLOAT (or HALF) channels and
+    mipmap levels (rounding down), or one level if levels has one entry.
+
+    levels is a list of pixel lists, one per mip level, largest first;
+    level l is (width >> l) x (height >> l), at least 1 x 1.  Pixels are
+    as for write_exr(); compression is EXR_COMPRESSION_NONE or
+    EXR_COMPRESSION_PIZ, applied to each tile.
+    """
+    import io
+
+    buf = io.BytesIO()
+    buf.write(struct.pack('<I', 0x01312f76))
+    buf.write(struct.pack('<I', 2 | 0x200))  # bit 9: single-part tiled
+
+    def write_attr(name, type_name, data):
+        buf.write(name.encode('ascii') + b'\x00')
+        buf.write(type_name.encode('ascii') + b'\x00')
+        buf.write(struct.pack('<I', len(data)))
+        buf.write(data)
+
+    names = exr_channel_names(levels[0])
+    sample_format, sample_size = EXR_SAMPLE[pixel_type]
+
+    ch_data = b''
+    for ch_name, _ in names:
+        ch_data += ch_name.encode('ascii') + b'\x00'
+        ch_data += struct.pack('<IB3xii', pixel_type, 0, 1, 1)
+    ch_data += b'\x00'
+    write_attr('channels', 'chlist', ch_data)
+    write_attr('compression', 'compression', struct.pack('<B', compression))
+    write_attr('dataWindow', 'box2i',
+               struct.pack('<iiii', 0, 0, width - 1, height - 1))
+    write_attr('displayWindow', 'box2i',
+               struct.pack('<iiii', 0, 0, width - 1, height - 1))
+    write_attr('lineOrder', 'lineOrder', struct.pack('<B', 0))
+    write_attr('pixelAspectRatio', 'float', struct.pack('<f', 1.0))
+    write_attr('screenWindowCenter', 'v2f', struct.pack('<ff', 0.0, 0.0))
+    write_attr('screenWindowWidth', 'float', struct.pack('<f', 1.0))
+    # tiledesc: tile width, tile height, mode (ONE_LEVEL = 0, or
+    # MIPMAP_LEVELS = 1 | ROUND_DOWN = 0)
+    mode = 1 if len(levels) > 1 else 0
+    write_attr('tiles', 'tiledesc',
+               struct.pack('<IIB', tile_size, tile_size, mode))
+    buf.write(b'\x00')
+
+    # Tiles, level by level, row by row: tile x, tile y, level x, level y,
+    # data size, then each line of the tile holds (A,) B, G, R in turn.
+    tiles = []
+    for level, pixels in enumerate(levels):
+        lw, lh = max(width >> level, 1), max(height >> level, 1)
+        for ty in range(0, lh, tile_size):
+            for tx in range(0, lw, tile_size):
+                data = b''
+                for y in range(ty, min(ty + tile_size, lh)):
+                    for _, ch_idx in names:
+                        for x in range(tx, min(tx + tile_size, lw)):
+                            data += struct.pack(sample_format,
+                                                pixels[y * lw + x][ch_idx])
+                if compression == EXR_COMPRESSION_PIZ:
+                    tw = min(tile_size, lw - tx)
+                    rows = min(tile_size, lh - ty)
+                    packed = piz_compress(data, tw, rows,
+                                          [sample_size] * len(names))
+                    if len(packed) < len(data):
+                        data = packed
+                tiles.append(struct.pack('<iiiiI', tx // tile_size,
+                                         ty // tile_size, level, level,
+                                         len(data)) + data)
+
+    offset = buf.tell() + len(tiles) * 8
+    for tile in tiles:
+        buf.write(struct.pack('<Q', offset))
+        offset += len(tile)
+    for tile in tiles:
+        buf.write(tile)
+
+    os.makedirs(os.path.dirname(path), exist_ok=True)
+    with open(path, 'wb') as f:
+        f.write(buf.getvalue())
+
+
+def exr_rewrite_chunk(path, n_chunks, index, edit):
+    """
+    Replace the data of scanline chunk index of the file at path with
+    edit(data), moving later chunks and their offsets to suit.
+    """
+    with open(path, 'rb') as f:
+        data = f.read()
+
+    pos = 8
+    while data[pos] != 0:  # name, type, size, value
+        pos = data.index(b'\x00', data.index(b'\x00', pos) + 1) + 1
+        pos += 4 + struct.unpack_from('<I', data, pos)[0]
+    table = pos + 1
+    offsets = struct.unpack_from('<%dQ' % n_chunks, data, table)
+
+    chunks = []
+    for offset in offsets:
+        y, size = struct.unpack_from('<iI', data, offset)
+        chunks.append((y, data[offset + 8:offset + 8 + size]))
+    y, chunk = chunks[index]
+    chunks[index] = (y, edit(chunk))
+
+    out = data[:table]
+    offset = table + n_chunks * 8
+    for _, chunk in chunks:
+        out += struct.pack('<Q', offset)
+        offset += 8 + len(chunk)
+    for y, chunk in chunks:
+        out += struct.pack('<iI', y, len(chunk)) + chunk
+
+    with open(path, 'wb') as f:
+        f.write(out)
+
+
+def piz_huf_offset(chunk):
+    """Offset of the Huffman block header in a PIZ-compressed chunk."""
+    min_nz, max_nz = struct.unpack_from('<HH', chunk, 0)
+    return 4 + (max_nz - min_nz + 1 if min_nz <= max_nz else 0) + 4
+
+
 # ---- HDR helpers ----
 
 def float_to_rgbe(r, g, b):
@@ -226,6 +608,83 @@ def main():
     write_exr(os.path.join(DATA_DIR, "simple.exr"), width, height, pixels)
     print(f"Created simple.exr ({width}x{height})")
 
+    # layered.exr: the simple.exr image as layer "beauty", plus a flat grey
+    # "diffuse" layer, and no unprefixed R, G, B
+    grey = [(0.5, 0.5, 0.5)] * (width * height)
+    write_exr(os.path.join(DATA_DIR, "layered.exr"), width, height, None,
+              layers=[('beauty.', pixels), ('diffuse.', grey)])
+    print(f"Created layered.exr ({width}x{height}, two layers)")
+
+    # tiled.exr: the simple.exr image in 3x3 tiles, with flat grey mip levels
+    levels = [pixels]
+    for level in (1, 2, 3):
+        size = width >> level
+        levels.append([(0.5, 0.5, 0.5)] * (size * size))
+
+    write_exr_tiled(os.path.join(DATA_DIR, "tiled.exr"), width, height,
+                    levels, 3)
+    print(f"Created tiled.exr ({width}x{height}, 3x3 tiles, mipmapped)")
+
+    # preview.exr: 32x16 gradient carrying a 16x8 solid-colour preview
+    width, height = 32, 16
+    pixels = []
+    for y in range(height):
+        for x in range(width):
+            pixels.append(((x + 1) / width, (y + 1) / height, 0.25))
+
+    preview = (16, 8, bytes([200, 100, 50, 255]) * (16 * 8))
+    write_exr(os.path.join(DATA_DIR, "preview.exr"), width, height, pixels,
+              preview)
+    print(f"Created preview.exr ({width}x{height}, 16x8 preview)")
+
+    # piz.exr, piz-none.exr: a 40x37 gradient, two chunks with PIZ, and the
+    # same image uncompressed to compare it with
+    width, height = 40, 37
+    pixels = []
+    for y in range(height):
+        for x in range(width):
+            pixels.append(((x + 1) / width * 4.0, (y + 1) / height,
+                           0.1 + 0.05 * ((x * y) % 7)))
+
+    write_exr(os.path.join(DATA_DIR, "piz.exr"), width, height, pixels,
+              compression=EXR_COMPRESSION_PIZ)
+    write_exr(os.path.join(DATA_DIR, "piz-none.exr"), width, height, pixels)
+    print(f"Created piz.exr and piz-none.exr ({width}x{height})")
+
+    # piz-half.exr: a 53x75 HALF RGBA image with PIZ, so three chunks, the
+    # last of 11 lines, and an odd width; piz-tiled.exr: the same in 32x32
+    # tiles, some of them partial and the bottom row left uncompressed
+    width, height = 53, 75
+    pixels = []
+    for y in range(height):
+        for x in range(width):
+            r = 2.0 ** (x / width * 12.0 - 6.0)
+            g = 2.0 ** (y / height * 8.0 - 4.0) * (1.0 + 0.5 * math.sin(x))
+            b = 0.05 + 0.04 * ((x * 7 + y * 13) % 11)
+            a = (x + y) / (width + height - 2)
+            pixels.append((r, g, b, a))
+
+    write_exr(os.path.join(DATA_DIR, "piz-half.exr"), width, height, pixels,
+              compression=EXR_COMPRESSION_PIZ, pixel_type=EXR_PIXEL_HALF)
+    write_exr_tiled(os.path.join(DATA_DIR, "piz-tiled.exr"), width, height,
+                    [pixels], 32, compression=EXR_COMPRESSION_PIZ,
+                    pixel_type=EXR_PIXEL_HALF)
+    print(f"Created piz-half.exr and piz-tiled.exr ({width}x{height}, HALF)")
+
+    # piz-truncated.exr: piz-half.exr with the second chunk's PIZ data cut
+    # in half; piz-corrupt.exr: with its Huffman bit count past the data
+    for name, edit in (
+            ("piz-truncated.exr", lambda chunk: chunk[:len(chunk) // 2]),
+            ("piz-corrupt.exr", lambda chunk: (
+                chunk[:piz_huf_offset(chunk) + 12] +
+                struct.pack('<I', 0x7fffffff) +
+                chunk[piz_huf_offset(chunk) + 16:]))):
+        path = os.path.join(DATA_DIR, name)
+        write_exr(path, width, height, pixels,
+                  compression=EXR_COMPRESSION_PIZ, pixel_type=EXR_PIXEL_HALF)
+        exr_rewrite_chunk(path, 3, 1, edit)
+        print(f"Created {name}")
+
     # corrupt.exr: just some garbage bytes
     with open(os.path.join(DATA_DIR, "corrupt.exr"), 'wb') as f:
         f.write(b'\xde\xad\xbe\xef' * 16)
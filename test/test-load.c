@@ -1,6 +1,10 @@
 // SPDX-License-Identifier: LGPL-2.1-or-later
 #include <gdk-pixbuf/gdk-pixbuf.h>
+#include <stdlib.h>
 #include <string.h>
+#include <tinyexr.h>
+
+#include "tonemap.h"
 
 #ifndef TEST_DATA_DIR
 #error "TEST_DATA_DIR must be defined"
@@ -12,6 +16,100 @@ test_path(const char *name)
     return g_build_filename(TEST_DATA_DIR, name, NULL);
 }
 
+/*
+ * Feed a file to a loader in small odd-sized chunks, so that scanlines and
+ * chunks straddle writes, and check the result matches a whole-file load.
+ */
+static void
+assert_incremental_matches(const char *name, const char *type)
+{
+    GError *error = NULL;
+    char *path = test_path(name);
+    GdkPixbuf *ref = gdk_pixbuf_new_from_file(path, &error);
+    guchar *data = NULL;
+    gsize length = 0;
+
+    g_assert_no_error(error);
+    g_assert_nonnull(ref);
+    g_assert_true(g_file_get_contents(path, (gchar **)&data, &length, &error));
+    g_assert_no_error(error);
+
+    GdkPixbufLoader *loader = gdk_pixbuf_loader_new_with_type(type, &error);
+    g_assert_no_error(error);
+
+    for (gsize pos = 0; pos < length; pos += 7) {
+        gsize n = MIN(7, length - pos);
+        g_assert_true(gdk_pixbuf_loader_write(loader, data + pos, n, &error));
+        g_assert_no_error(error);
+    }
+    g_assert_true(gdk_pixbuf_loader_close(loader, &error));
+    g_assert_no_error(error);
+
+    GdkPixbuf *pb = gdk_pixbuf_loader_get_pixbuf(loader);
+    int w = gdk_pixbuf_get_width(ref);
+    int h = gdk_pixbuf_get_height(ref);
+
+    g_assert_nonnull(pb);
+    g_assert_cmpint(gdk_pixbuf_get_width(pb), ==, w);
+    g_assert_cmpint(gdk_pixbuf_get_height(pb), ==, h);
+
+    for (int y = 0; y < h; y++)
+        g_assert_cmpmem(gdk_pixbuf_get_pixels(pb) + y * gdk_pixbuf_get_rowstride(pb),
+                        w * 4,
+                        gdk_pixbuf_get_pixels(ref) + y * gdk_pixbuf_get_rowstride(ref),
+                        w * 4);
+
+    g_object_unref(loader);
+    g_object_unref(ref);
+    g_free(data);
+    g_free(path);
+}
+
+/*
+ * Check that the loader's own decoder gives the same image as TinyEXR's
+ * independent one, tonemapped the same way.  Only for files the loader
+ * doesn't itself hand to TinyEXR.
+ */
+static void
+assert_matches_tinyexr(const char *name, int width, int height)
+{
+    GError *error = NULL;
+    char *path = test_path(name);
+    GdkPixbuf *pb = gdk_pixbuf_new_from_file(path, &error);
+    guchar *data = NULL;
+    gsize length = 0;
+    float *rgba = NULL;
+    int w = 0, h = 0;
+    const char *err = NULL;
+
+    g_assert_no_error(error);
+    g_assert_nonnull(pb);
+    g_assert_cmpint(gdk_pixbuf_get_width(pb), ==, width);
+    g_assert_cmpint(gdk_pixbuf_get_height(pb), ==, height);
+
+    g_assert_true(g_file_get_contents(path, (gchar **)&data, &length, &error));
+    g_assert_no_error(error);
+    g_assert_cmpint(LoadEXRFromMemory(&rgba, &w, &h, data, length, &err), ==,
+                    TINYEXR_SUCCESS);
+    g_assert_cmpint(w, ==, width);
+    g_assert_cmpint(h, ==, height);
+
+    guchar *ref = g_malloc((gsize)width * (gsize)height * 4);
+    tonemap_reinhard(rgba, ref, width * 4, width, height, 4);
+
+    for (int y = 0; y < height; y++)
+        g_assert_cmpmem(gdk_pixbuf_get_pixels(pb) + y * gdk_pixbuf_get_rowstride(pb),
+                        width * 4,
+                        ref + (gsize)y * (gsize)width * 4,
+                        width * 4);
+
+    g_free(ref);
+    free(rgba);
+    g_object_unref(pb);
+    g_free(data);
+    g_free(path);
+}
+
 /* ---- EXR tests ---- */
 
 /* Basic load: valid EXR file loads successfully with correct dimensions */
@@ -107,6 +205,226 @@ test_exr_wrong_format(void)
     g_free(path);
 }
 
+/* Incremental load in small chunks matches a whole-file load */
+static void
+test_exr_incremental(void)
+{
+    assert_incremental_matches("simple.exr", "exr");
+    /* Two chunks, decompressed in parallel when loaded whole */
+    assert_incremental_matches("piz.exr", "exr");
+}
+
+/* Layers: with no plain R, G, B the first layer is shown, or the one
+ * named by GDK_PIXBUF_HDR_EXR_LAYER */
+static void
+test_exr_layers(void)
+{
+    GError *error = NULL;
+    char *path = test_path("layered.exr");
+    char *ref_path = test_path("simple.exr");
+    GdkPixbuf *ref = gdk_pixbuf_new_from_file(ref_path, &error);
+    g_assert_no_error(error);
+    GdkPixbuf *pb = gdk_pixbuf_new_from_file(path, &error);
+    g_assert_no_error(error);
+
+    /* "beauty" comes first and holds the simple.exr image. */
+    g_assert_nonnull(pb);
+    for (int y = 0; y < 8; y++)
+        g_assert_cmpmem(gdk_pixbuf_get_pixels(pb) + y * gdk_pixbuf_get_rowstride(pb),
+                        8 * 4,
+                        gdk_pixbuf_get_pixels(ref) + y * gdk_pixbuf_get_rowstride(ref),
+                        8 * 4);
+    g_object_unref(pb);
+
+    /* "diffuse" is flat grey. */
+    g_setenv("GDK_PIXBUF_HDR_EXR_LAYER", "diffuse", TRUE);
+    pb = gdk_pixbuf_new_from_file(path, &error);
+    g_unsetenv("GDK_PIXBUF_HDR_EXR_LAYER");
+    g_assert_no_error(error);
+    g_assert_nonnull(pb);
+
+    guchar *pixels = gdk_pixbuf_get_pixels(pb);
+    int rowstride = gdk_pixbuf_get_rowstride(pb);
+
+    for (int y = 0; y < 8; y++)
+        for (int x = 0; x < 8; x++)
+            g_assert_cmpmem(pixels + y * rowstride + x * 4, 4, pixels, 4);
+
+    g_object_unref(pb);
+    g_object_unref(ref);
+    g_free(ref_path);
+    g_free(path);
+}
+
+/* Tiled: tiles are assembled into the same image as a scanline file */
+static void
+test_exr_tiled(void)
+{
+    GError *error = NULL;
+    char *path = test_path("tiled.exr");
+    char *ref_path = test_path("simple.exr");
+    GdkPixbuf *pb = gdk_pixbuf_new_from_file(path, &error);
+    g_assert_no_error(error);
+    GdkPixbuf *ref = gdk_pixbuf_new_from_file(ref_path, &error);
+    g_assert_no_error(error);
+
+    g_assert_nonnull(pb);
+    g_assert_cmpint(gdk_pixbuf_get_width(pb), ==, 8);
+    g_assert_cmpint(gdk_pixbuf_get_height(pb), ==, 8);
+
+    for (int y = 0; y < 8; y++)
+        g_assert_cmpmem(gdk_pixbuf_get_pixels(pb) + y * gdk_pixbuf_get_rowstride(pb),
+                        8 * 4,
+                        gdk_pixbuf_get_pixels(ref) + y * gdk_pixbuf_get_rowstride(ref),
+                        8 * 4);
+
+    g_object_unref(ref);
+    g_object_unref(pb);
+    g_free(ref_path);
+    g_free(path);
+}
+
+/* PIZ: decodes to the same image as the uncompressed file */
+static void
+test_exr_piz(void)
+{
+    GError *error = NULL;
+    char *path = test_path("piz.exr");
+    char *ref_path = test_path("piz-none.exr");
+    GdkPixbuf *pb = gdk_pixbuf_new_from_file(path, &error);
+    g_assert_no_error(error);
+    GdkPixbuf *ref = gdk_pixbuf_new_from_file(ref_path, &error);
+    g_assert_no_error(error);
+
+    g_assert_nonnull(pb);
+    g_assert_cmpint(gdk_pixbuf_get_width(pb), ==, 40);
+    g_assert_cmpint(gdk_pixbuf_get_height(pb), ==, 37);
+
+    for (int y = 0; y < 37; y++)
+        g_assert_cmpmem(gdk_pixbuf_get_pixels(pb) + y * gdk_pixbuf_get_rowstride(pb),
+                        40 * 4,
+                        gdk_pixbuf_get_pixels(ref) + y * gdk_pixbuf_get_rowstride(ref),
+                        40 * 4);
+
+    g_object_unref(ref);
+    g_object_unref(pb);
+    g_free(ref_path);
+    g_free(path);
+}
+
+/* PIZ with HALF RGBA, an odd size and a short last chunk: as TinyEXR */
+static void
+test_exr_piz_half(void)
+{
+    assert_matches_tinyexr("piz-half.exr", 53, 75);
+    assert_incremental_matches("piz-half.exr", "exr");
+}
+
+/* Tiled PIZ, with partial and uncompressed tiles: as TinyEXR */
+static void
+test_exr_piz_tiled(void)
+{
+    assert_matches_tinyexr("piz-tiled.exr", 53, 75);
+}
+
+/* A PIZ chunk cut short, or with a bad Huffman bit count, is an error */
+static void
+test_exr_piz_corrupt(void)
+{
+    const char *names[] = { "piz-truncated.exr", "piz-corrupt.exr" };
+
+    for (gsize i = 0; i < G_N_ELEMENTS(names); i++) {
+        GError *error = NULL;
+        char *path = test_path(names[i]);
+        GdkPixbuf *pb = gdk_pixbuf_new_from_file(path, &error);
+
+        g_assert_null(pb);
+        g_assert_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_CORRUPT_IMAGE);
+        g_clear_error(&error);
+        g_free(path);
+    }
+}
+
+/* Mip levels: a small requested size decodes the matching level only */
+static void
+test_exr_mip_level(void)
+{
+    GError *error = NULL;
+    char *path = test_path("tiled.exr");
+    GdkPixbuf *pb = gdk_pixbuf_new_from_file_at_size(path, 4, 4, &error);
+
+    g_assert_no_error(error);
+    g_assert_nonnull(pb);
+    g_assert_cmpint(gdk_pixbuf_get_width(pb), ==, 4);
+    g_assert_cmpint(gdk_pixbuf_get_height(pb), ==, 4);
+
+    /* Level 1 is flat grey, unlike the full-size gradient. */
+    guchar *pixels = gdk_pixbuf_get_pixels(pb);
+    int rowstride = gdk_pixbuf_get_rowstride(pb);
+
+    for (int y = 0; y < 4; y++)
+        for (int x = 0; x < 4; x++)
+            g_assert_cmpmem(pixels + y * rowstride + x * 4, 4, pixels, 4);
+    g_assert_cmpint(pixels[0], ==, pixels[1]);
+    g_assert_cmpint(pixels[1], ==, pixels[2]);
+
+    g_object_unref(pb);
+    g_free(path);
+}
+
+/* Preview: a small requested size is served from the embedded preview */
+static void
+test_exr_preview(void)
+{
+    GError *error = NULL;
+    char *path = test_path("preview.exr");
+    GdkPixbuf *pb = gdk_pixbuf_new_from_file_at_size(path, 16, 8, &error);
+
+    g_assert_no_error(error);
+    g_assert_nonnull(pb);
+    g_assert_cmpint(gdk_pixbuf_get_width(pb), ==, 16);
+    g_assert_cmpint(gdk_pixbuf_get_height(pb), ==, 8);
+
+    guchar *pixels = gdk_pixbuf_get_pixels(pb);
+    int rowstride = gdk_pixbuf_get_rowstride(pb);
+    static const guchar color[4] = { 200, 100, 50, 255 };
+
+    for (int y = 0; y < 8; y++)
+        for (int x = 0; x < 16; x++)
+            g_assert_cmpmem(pixels + y * rowstride + x * 4, 4, color, 4);
+
+    g_object_unref(pb);
+
+    /* A full-size load still decodes the image itself. */
+    pb = gdk_pixbuf_new_from_file(path, &error);
+    g_assert_no_error(error);
+    g_assert_nonnull(pb);
+    g_assert_cmpint(gdk_pixbuf_get_width(pb), ==, 32);
+    g_assert_cmpint(gdk_pixbuf_get_height(pb), ==, 16);
+
+    g_object_unref(pb);
+    g_free(path);
+}
+
+/* File info: dimensions come from the header alone */
+static void
+test_exr_file_info(void)
+{
+    char *path = test_path("simple.exr");
+    gint width = 0, height = 0;
+    GdkPixbufFormat *format = gdk_pixbuf_get_file_info(path, &width, &height);
+    gchar *name;
+
+    g_assert_nonnull(format);
+    name = gdk_pixbuf_format_get_name(format);
+    g_assert_cmpstr(name, ==, "exr");
+    g_assert_cmpint(width, ==, 8);
+    g_assert_cmpint(height, ==, 8);
+
+    g_free(name);
+    g_free(path);
+}
+
 /* ---- HDR tests ---- */
 
 /* Basic load: valid HDR file loads successfully with correct dimensions */
@@ -219,6 +537,63 @@ test_hdr_empty_file(void)
     g_free(path);
 }
 
+/* Incremental load in small chunks matches a whole-file load */
+static void
+test_hdr_incremental(void)
+{
+    assert_incremental_matches("simple-rle.hdr", "hdr");
+}
+
+/* Load at size: a smaller requested size is decoded directly */
+static void
+test_hdr_load_at_size(void)
+{
+    GError *error = NULL;
+    char *path = test_path("simple-rle.hdr");
+    GdkPixbuf *pb = gdk_pixbuf_new_from_file_at_size(path, 16, 4, &error);
+
+    g_assert_no_error(error);
+    g_assert_nonnull(pb);
+    g_assert_cmpint(gdk_pixbuf_get_width(pb), ==, 16);
+    g_assert_cmpint(gdk_pixbuf_get_height(pb), ==, 4);
+
+    guchar *pixels = gdk_pixbuf_get_pixels(pb);
+    int rowstride = gdk_pixbuf_get_rowstride(pb);
+    gboolean found_nonzero = FALSE;
+
+    for (int y = 0; y < 4; y++) {
+        for (int x = 0; x < 16; x++) {
+            guchar *p = pixels + y * rowstride + x * 4;
+            g_assert_cmpint(p[3], ==, 255);
+            if (p[0] > 0 || p[1] > 0 || p[2] > 0)
+                found_nonzero = TRUE;
+        }
+    }
+    g_assert_true(found_nonzero);
+
+    g_object_unref(pb);
+    g_free(path);
+}
+
+/* File info: dimensions come from the header alone */
+static void
+test_hdr_file_info(void)
+{
+    char *path = test_path("simple-rle.hdr");
+    gint width = 0, height = 0;
+    GdkPixbufFormat *format = gdk_pixbuf_get_file_info(path, &width, &height);
+    gchar *name;
+
+    g_assert_nonnull(format);
+    name = gdk_pixbuf_format_get_name(format);
+    g_assert_cmpstr(name, ==, "hdr");
+    g_assert_cmpint(width, ==, 32);
+    g_assert_cmpint(height, ==, 8);
+
+    g_free(name);
+    g_free(path);
+}
+
 int
 main(int argc, char **argv)
 {
@@ -229,12 +604,25 @@ main(int argc, char **argv)
     g_test_add_func("/exr/corrupt-file", test_exr_corrupt_file);
     g_test_add_func("/exr/empty-file", test_exr_empty_file);
     g_test_add_func("/exr/wrong-format", test_exr_wrong_format);
+    g_test_add_func("/exr/incremental", test_exr_incremental);
+    g_test_add_func("/exr/layers", test_exr_layers);
+    g_test_add_func("/exr/tiled", test_exr_tiled);
+    g_test_add_func("/exr/piz", test_exr_piz);
+    g_test_add_func("/exr/piz-half", test_exr_piz_half);
+    g_test_add_func("/exr/piz-tiled", test_exr_piz_tiled);
+    g_test_add_func("/exr/piz-corrupt", test_exr_piz_corrupt);
+    g_test_add_func("/exr/mip-level", test_exr_mip_level);
+    g_test_add_func("/exr/preview", test_exr_preview);
+    g_test_add_func("/exr/file-info", test_exr_file_info);
 
     g_test_add_func("/hdr/load-basic", test_hdr_load_basic);
     g_test_add_func("/hdr/load-rle", test_hdr_load_rle);
     g_test_add_func("/hdr/pixel-values", test_hdr_pixel_values);
     g_test_add_func("/hdr/corrupt-file", test_hdr_corrupt_file);
     g_test_add_func("/hdr/empty-file", test_hdr_empty_file);
+    g_test_add_func("/hdr/incremental", test_hdr_incremental);
+    g_test_add_func("/hdr/load-at-size", test_hdr_load_at_size);
+    g_test_add_func("/hdr/file-info", test_hdr_file_info);
 
     return g_test_run();
 }
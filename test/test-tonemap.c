@@ -0,0 +1,649 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "tonemap.h"
+
+static const TonemapIsa all_isas[] = {
+    TONEMAP_ISA_SCALAR,
+    TONEMAP_ISA_SSE2,
+    TONEMAP_ISA_AVX2,
+};
+
+/* Small deterministic PRNG so failures reproduce across runs. */
+static guint32 rng_state = 0x12345678u;
+
+static float
+rand_unit(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return (float)(rng_state >> 8) / 16777216.0f;
+}
+
+/* Fill an image with log-uniform HDR values plus the odd invalid pixel. */
+static float *
+make_hdr_image(int width, int height, int num_channels)
+{
+    size_t n = (size_t)width * (size_t)height * (size_t)num_channels;
+    float *img = g_new(float, n);
+
+    for (size_t i = 0; i < n; i++) {
+        float u = rand_unit();
+
+        if (num_channels == 4 && i % 4 == 3)
+            img[i] = rand_unit() * 1.4f - 0.2f;
+        else if (u < 0.01f)
+            img[i] = NAN;
+        else if (u < 0.02f)
+            img[i] = INFINITY;
+        else if (u < 0.04f)
+            img[i] = -rand_unit();
+        else if (u < 0.06f)
+            img[i] = 0.0f;
+        else
+            img[i] = expf(rand_unit() * 16.0f - 9.0f);
+    }
+
+    return img;
+}
+
+static void
+assert_close_to_reference(const float *img, int width, int height,
+                          int num_channels)
+{
+    size_t   n = (size_t)width * (size_t)height * 4;
+    uint8_t *ref = g_malloc(n);
+    uint8_t *out = g_malloc(n);
+
+    tonemap_reinhard_scalar(img, ref, width, height, num_channels);
+
+    for (size_t k = 0; k < G_N_ELEMENTS(all_isas); k++) {
+        if (!tonemap_isa_supported(all_isas[k]))
+            continue;
+
+        tonemap_reinhard_isa(img, out, width * 4, width, height,
+                             num_channels, all_isas[k], 1);
+
+        for (size_t i = 0; i < n; i++) {
+            int diff = abs((int)out[i] - (int)ref[i]);
+            if (i % 4 == 3)
+                g_assert_cmpint(diff, ==, 0);
+            else
+                g_assert_cmpint(diff, <=, 1);
+        }
+    }
+
+    g_free(ref);
+    g_free(out);
+}
+
+/* Every kernel set must match the scalar reference within ±1 LSB. */
+static void
+test_kernels_match_reference(void)
+{
+    for (int num_channels = 3; num_channels <= 4; num_channels++) {
+        float *img = make_hdr_image(67, 29, num_channels);
+        assert_close_to_reference(img, 67, 29, num_channels);
+        g_free(img);
+    }
+}
+
+/* FAST stays within 1 LSB of EXACT and PREVIEW within 2, alpha exact,
+ * with every kernel set. */
+static void
+test_quality_tiers(void)
+{
+    const int width = 211, height = 53;
+    size_t    n     = (size_t)width * (size_t)height * 4;
+    float    *img   = make_hdr_image(width, height, 4);
+    uint8_t  *ref   = g_malloc(n);
+    uint8_t  *out   = g_malloc(n);
+
+    for (size_t k = 0; k < G_N_ELEMENTS(all_isas); k++) {
+        if (!tonemap_isa_supported(all_isas[k]))
+            continue;
+
+        tonemap_reinhard_quality(img, ref, width * 4, width, height, 4,
+                                 all_isas[k], TONEMAP_QUALITY_EXACT, 1);
+
+        for (int q = TONEMAP_QUALITY_FAST; q <= TONEMAP_QUALITY_PREVIEW; q++) {
+            tonemap_reinhard_quality(img, out, width * 4, width, height, 4,
+                                     all_isas[k], (TonemapQuality)q, 1);
+
+            for (size_t i = 0; i < n; i++) {
+                int diff = abs((int)out[i] - (int)ref[i]);
+                if (i % 4 == 3)
+                    g_assert_cmpint(diff, ==, 0);
+                else
+                    g_assert_cmpint(diff, <=, q == TONEMAP_QUALITY_FAST ? 1 : 2);
+            }
+        }
+    }
+
+    g_free(img);
+    g_free(ref);
+    g_free(out);
+}
+
+/* PREVIEW on an image above TONEMAP_SAMPLE_BUDGET, so that its exposure
+ * comes from a sample, is still within 2 of EXACT. */
+static void
+test_quality_preview_sampled(void)
+{
+    const int width = 1536, height = 512;
+    size_t    n     = (size_t)width * (size_t)height * 4;
+    float    *img   = make_hdr_image(width, height, 3);
+    uint8_t  *ref   = g_malloc(n);
+    uint8_t  *out   = g_malloc(n);
+    TonemapJob job;
+
+    tonemap_job_init(&job, img, tonemap_load_float, out, width * 4,
+                     width, height, 3, tonemap_best_isa(),
+                     TONEMAP_QUALITY_PREVIEW);
+    g_assert_cmpuint(job.sample_step, >, 1);
+
+    tonemap_reinhard_quality(img, ref, width * 4, width, height, 3,
+                             tonemap_best_isa(), TONEMAP_QUALITY_EXACT, 1);
+    tonemap_reinhard_quality(img, out, width * 4, width, height, 3,
+                             tonemap_best_isa(), TONEMAP_QUALITY_PREVIEW, 1);
+
+    for (size_t i = 0; i < n; i++) {
+        int diff = abs((int)out[i] - (int)ref[i]);
+        g_assert_cmpint(diff, <=, i % 4 == 3 ? 0 : 2);
+    }
+
+    g_free(img);
+    g_free(ref);
+    g_free(out);
+}
+
+/* Images with no valid pixel come out black with their alpha intact. */
+static void
+test_all_invalid(void)
+{
+    float img[5 * 4];
+
+    for (int i = 0; i < 5; i++) {
+        img[i * 4 + 0] = (i & 1) ? NAN : 0.0f;
+        img[i * 4 + 1] = (i & 2) ? -1.0f : 0.0f;
+        img[i * 4 + 2] = (i == 4) ? INFINITY : 0.0f;
+        img[i * 4 + 3] = (float)i / 4.0f;
+    }
+
+    assert_close_to_reference(img, 5, 1, 4);
+}
+
+/* The output doesn't depend on how many threads ran. */
+static void
+test_thread_count_invariant(void)
+{
+    const int width = 700, height = 300;
+    size_t    n     = (size_t)width * (size_t)height * 4;
+    float    *img   = make_hdr_image(width, height, 3);
+    uint8_t  *ref   = g_malloc(n);
+    uint8_t  *out   = g_malloc(n);
+
+    tonemap_reinhard_isa(img, ref, width * 4, width, height, 3,
+                         tonemap_best_isa(), 1);
+
+    for (unsigned n_threads = 2; n_threads <= 8; n_threads *= 2) {
+        memset(out, 0, n);
+        tonemap_reinhard_isa(img, out, width * 4, width, height, 3,
+                             tonemap_best_isa(), n_threads);
+        g_assert_true(memcmp(ref, out, n) == 0);
+    }
+
+    g_free(img);
+    g_free(ref);
+    g_free(out);
+}
+
+/* Statistics gathered row by row match the whole-image pass. */
+static void
+test_row_stats_match(void)
+{
+    const int width = 131, height = 37;
+    size_t    n     = (size_t)width * (size_t)height * 4;
+    float    *img   = make_hdr_image(width, height, 3);
+    uint8_t  *ref   = g_malloc(n);
+    uint8_t  *out   = g_malloc(n);
+    TonemapStats stats;
+
+    tonemap_stats_init(&stats);
+    for (int y = 0; y < height; y++)
+        tonemap_stats_add(&stats, img + (size_t)y * (size_t)width * 3,
+                          (size_t)width, 3);
+
+    tonemap_reinhard(img, ref, width * 4, width, height, 3);
+    tonemap_reinhard_apply(img, out, width * 4, width, height, 3, &stats,
+                           TONEMAP_QUALITY_EXACT);
+
+    for (size_t i = 0; i < n; i++)
+        g_assert_cmpint(abs((int)out[i] - (int)ref[i]), <=, 1);
+
+    g_free(img);
+    g_free(ref);
+    g_free(out);
+}
+
+static int
+cmp_float(const void *a, const void *b)
+{
+    float x = *(const float *)a, y = *(const float *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Histogram queries agree with exact values to within a bucket. */
+static void
+test_stats_queries(void)
+{
+    const int n       = 1000;
+    float    *img     = g_new(float, (gsize)n * 3);
+    float    *L       = g_new(float, (gsize)n);
+    double    sum_log = 0.0;
+    TonemapStats stats;
+
+    for (int i = 0; i < n; i++) {
+        /* Grey pixels spanning 1e-3 to 1e3, then two invalid ones. */
+        float v = powf(10.0f, -3.0f + 6.0f * (float)i / (float)(n - 1));
+
+        img[i * 3 + 0] = img[i * 3 + 1] = img[i * 3 + 2] = v;
+        L[i] = v;
+        sum_log += log((double)v + TONEMAP_DELTA);
+    }
+
+    tonemap_stats_init(&stats);
+    tonemap_stats_add(&stats, img, (size_t)n, 3);
+    img[0] = img[1] = img[2] = -1.0f;
+    img[3] = img[4] = img[5] = NAN;
+    tonemap_stats_add(&stats, img, 2, 3);
+
+    qsort(L, (size_t)n, sizeof(float), cmp_float);
+
+    g_assert_cmpuint(tonemap_stats_valid_count(&stats), ==, (guint)n);
+    g_assert_cmpfloat_with_epsilon(tonemap_stats_log_average(&stats) /
+                                   (float)exp(sum_log / n), 1.0, 0.02);
+    g_assert_cmpfloat_with_epsilon(tonemap_stats_percentile(&stats, 0.0) / L[0],
+                                   1.0, 0.02);
+    g_assert_cmpfloat_with_epsilon(tonemap_stats_percentile(&stats, 0.5) /
+                                   L[n / 2 - 1], 1.0, 0.02);
+    g_assert_cmpfloat_with_epsilon(tonemap_stats_percentile(&stats, 0.99) /
+                                   L[n * 99 / 100 - 1], 1.0, 0.02);
+    g_assert_cmpfloat_with_epsilon(tonemap_stats_max(&stats) / L[n - 1],
+                                   1.0, 0.02);
+
+    g_free(img);
+    g_free(L);
+}
+
+/* A sampled pass 1 stays close to the exact one, and is exact unless it
+ * actually skips pixels. */
+static void
+test_stats_sample(void)
+{
+    const int width = 1024, height = 1024;
+    float    *img   = make_hdr_image(width, height, 3);
+    TonemapStats *exact   = g_new(TonemapStats, 1);
+    TonemapStats *sampled = g_new(TonemapStats, 1);
+    size_t        pixels  = (size_t)width * (size_t)height;
+    float         ratio;
+
+    tonemap_stats_init(exact);
+    tonemap_stats_add(exact, img, pixels, 3);
+
+    tonemap_stats_sample(sampled, img, tonemap_load_float, width, height, 3,
+                         0);
+    g_assert_cmpmem(sampled, sizeof *sampled, exact, sizeof *exact);
+    tonemap_stats_sample(sampled, img, tonemap_load_float, width, height, 3,
+                         pixels);
+    g_assert_cmpmem(sampled, sizeof *sampled, exact, sizeof *exact);
+
+    tonemap_stats_sample(sampled, img, tonemap_load_float, width, height, 3,
+                         64 * 1024);
+    ratio = tonemap_stats_log_average(sampled) /
+            tonemap_stats_log_average(exact);
+    g_assert_cmpfloat_with_epsilon(ratio, 1.0, 0.05);
+    g_assert_cmpfloat_with_epsilon((double)tonemap_stats_valid_count(sampled) /
+                                   (double)tonemap_stats_valid_count(exact),
+                                   1.0, 0.05);
+
+    g_free(img);
+    g_free(exact);
+    g_free(sampled);
+}
+
+/* Padded output rows get the same pixels, and the padding is untouched. */
+static void
+test_rowstride(void)
+{
+    const int width = 75, height = 41, rowstride = 75 * 4 + 12;
+    size_t    n    = (size_t)width * (size_t)height * 4;
+    float    *img  = make_hdr_image(width, height, 4);
+    uint8_t  *ref  = g_malloc(n);
+    uint8_t  *out  = g_malloc((size_t)rowstride * (size_t)height);
+
+    memset(out, 0xa5, (size_t)rowstride * (size_t)height);
+
+    tonemap_reinhard(img, ref, width * 4, width, height, 4);
+    tonemap_reinhard(img, out, rowstride, width, height, 4);
+
+    for (int y = 0; y < height; y++) {
+        const uint8_t *row = out + (size_t)y * (size_t)rowstride;
+
+        g_assert_true(memcmp(row, ref + (size_t)y * (size_t)width * 4,
+                             (size_t)width * 4) == 0);
+        for (int i = width * 4; i < rowstride; i++)
+            g_assert_cmpint(row[i], ==, 0xa5);
+    }
+
+    g_free(img);
+    g_free(ref);
+    g_free(out);
+}
+
+/* Tonemapping RGBE directly gives the same bytes as decoding to float. */
+static void
+test_rgbe_matches_float(void)
+{
+    const int width = 97, height = 23;
+    size_t    pixel_count = (size_t)width * (size_t)height;
+    uint8_t  *rgbe = g_malloc(pixel_count * 4);
+    float    *rgb  = g_new(float, pixel_count * 3);
+    uint8_t  *ref  = g_malloc(pixel_count * 4);
+    uint8_t  *out  = g_malloc(pixel_count * 4);
+
+    for (size_t i = 0; i < pixel_count; i++) {
+        uint8_t *px = rgbe + i * 4;
+        px[0] = (uint8_t)(rand_unit() * 256.0f);
+        px[1] = (uint8_t)(rand_unit() * 256.0f);
+        px[2] = (uint8_t)(rand_unit() * 256.0f);
+        px[3] = (i % 17 == 0) ? 0 : (uint8_t)(110.0f + rand_unit() * 40.0f);
+
+        float f = px[3] ? ldexpf(1.0f, px[3] - 136) : 0.0f;
+        rgb[i * 3 + 0] = (float)px[0] * f;
+        rgb[i * 3 + 1] = (float)px[1] * f;
+        rgb[i * 3 + 2] = (float)px[2] * f;
+    }
+
+    tonemap_reinhard(rgb, ref, width * 4, width, height, 3);
+    tonemap_reinhard_rgbe(rgbe, out, width * 4, width, height);
+    g_assert_true(memcmp(ref, out, pixel_count * 4) == 0);
+
+    g_free(rgbe);
+    g_free(rgb);
+    g_free(ref);
+    g_free(out);
+}
+
+/* Long runs of identical RGBE pixels, tonemapped once and replicated,
+ * give the same bytes; their statistics are counted within rounding. */
+static void
+test_rgbe_runs(void)
+{
+    const int width = 97, height = 23;
+    size_t    pixel_count = (size_t)width * (size_t)height;
+    uint8_t  *rgbe = g_malloc(pixel_count * 4);
+    float    *rgb  = g_new(float, pixel_count * 3);
+    uint8_t  *ref  = g_malloc(pixel_count * 4);
+    uint8_t  *out  = g_malloc(pixel_count * 4);
+    TonemapStats stats;
+
+    /* Runs of 1 to 40 pixels, some crossing rows, some black. */
+    for (size_t i = 0; i < pixel_count; ) {
+        size_t  len = 1 + (size_t)(rand_unit() * 40.0f);
+        uint8_t px[4];
+
+        px[0] = (uint8_t)(rand_unit() * 256.0f);
+        px[1] = (uint8_t)(rand_unit() * 256.0f);
+        px[2] = (uint8_t)(rand_unit() * 256.0f);
+        px[3] = (rand_unit() < 0.1f) ? 0 : (uint8_t)(110.0f + rand_unit() * 40.0f);
+
+        for (; len > 0 && i < pixel_count; len--, i++)
+            memcpy(rgbe + i * 4, px, 4);
+    }
+
+    for (size_t i = 0; i < pixel_count; i++) {
+        const uint8_t *px = rgbe + i * 4;
+        float f = px[3] ? ldexpf(1.0f, px[3] - 136) : 0.0f;
+
+        rgb[i * 3 + 0] = (float)px[0] * f;
+        rgb[i * 3 + 1] = (float)px[1] * f;
+        rgb[i * 3 + 2] = (float)px[2] * f;
+    }
+
+    tonemap_reinhard(rgb, ref, width * 4, width, height, 3);
+    tonemap_reinhard_rgbe(rgbe, out, width * 4, width, height);
+    g_assert_true(memcmp(ref, out, pixel_count * 4) == 0);
+
+    tonemap_stats_init(&stats);
+    for (int y = 0; y < height; y++)
+        tonemap_stats_add_rgbe(&stats, rgbe + (size_t)y * (size_t)width * 4,
+                               (size_t)width);
+    tonemap_reinhard_rgbe_apply(rgbe, out, width * 4, width, height, &stats,
+                                TONEMAP_QUALITY_EXACT);
+
+    for (size_t i = 0; i < pixel_count * 4; i++)
+        g_assert_cmpint(abs((int)out[i] - (int)ref[i]), <=, 1);
+
+    g_free(rgbe);
+    g_free(rgb);
+    g_free(ref);
+    g_free(out);
+}
+
+/* Tonemapping half directly gives the same bytes as widening to float. */
+static void
+test_half_matches_float(void)
+{
+    const int width = 97, height = 23;
+    size_t    pixel_count = (size_t)width * (size_t)height;
+
+    for (int num_channels = 3; num_channels <= 4; num_channels++) {
+        size_t    n    = pixel_count * (size_t)num_channels;
+        uint16_t *half = g_new(uint16_t, n);
+        float    *rgb  = g_new(float, n);
+        uint8_t  *ref  = g_malloc(pixel_count * 4);
+        uint8_t  *out  = g_malloc(pixel_count * 4);
+
+        /* Mostly positive finite values, with every bit pattern possible. */
+        for (size_t i = 0; i < n; i++) {
+            half[i] = (i % 13 == 0) ? (uint16_t)(rand_unit() * 65536.0f)
+                                    : (uint16_t)(rand_unit() * 0x7c00);
+            rgb[i] = tonemap_half_to_float(half[i]);
+        }
+
+        tonemap_reinhard(rgb, ref, width * 4, width, height, num_channels);
+        tonemap_reinhard_half(half, out, width * 4, width, height,
+                              num_channels);
+        g_assert_true(memcmp(ref, out, pixel_count * 4) == 0);
+
+        g_free(half);
+        g_free(rgb);
+        g_free(ref);
+        g_free(out);
+    }
+}
+
+/* The F16C loaders, where used, agree with the table for every value. */
+static void
+test_half_loaders_agree(void)
+{
+    uint16_t     half[TONEMAP_BLOCK_SIZE * 4];
+    TonemapBlock a, b;
+
+    for (int planar = 0; planar <= 1; planar++) {
+        for (uint32_t base = 0; base < 65536; base += TONEMAP_BLOCK_SIZE * 4) {
+            for (uint32_t i = 0; i < TONEMAP_BLOCK_SIZE * 4; i++)
+                half[i] = (uint16_t)(base + i);
+
+            if (planar) {
+                TonemapPlanes planes;
+
+                for (int c = 0; c < 4; c++)
+                    planes.channel[c] = half + c * TONEMAP_BLOCK_SIZE;
+                tonemap_load_planar_half(&planes, 4, 0,
+                                         TONEMAP_BLOCK_SIZE, &a);
+                tonemap_planar_half_loader()(&planes, 4, 0,
+                                             TONEMAP_BLOCK_SIZE, &b);
+            } else {
+                tonemap_load_half(half, 4, 0, TONEMAP_BLOCK_SIZE, &a);
+                tonemap_half_loader()(half, 4, 0, TONEMAP_BLOCK_SIZE, &b);
+            }
+
+            for (int i = 0; i < TONEMAP_BLOCK_SIZE; i++) {
+                const float *fa[4] = { a.r, a.g, a.b, a.a };
+                const float *fb[4] = { b.r, b.g, b.b, b.a };
+
+                for (int c = 0; c < 4; c++) {
+                    if (isnan(fa[c][i]))
+                        g_assert_true(isnan(fb[c][i]));
+                    else
+                        g_assert_true(memcmp(&fa[c][i], &fb[c][i],
+                                             sizeof(float)) == 0);
+                }
+            }
+        }
+    }
+}
+
+/* The vector RGBE loader, where used, agrees with the table for every
+ * mantissa and exponent, including a short final block. */
+static void
+test_rgbe_loaders_agree(void)
+{
+    uint8_t      rgbe[TONEMAP_BLOCK_SIZE * 4];
+    TonemapBlock a, b;
+
+    for (int e = 0; e < 256; e++) {
+        for (int base = 0; base < 256; base += TONEMAP_BLOCK_SIZE) {
+            for (int i = 0; i < TONEMAP_BLOCK_SIZE; i++) {
+                rgbe[i * 4 + 0] = (uint8_t)(base + i);
+                rgbe[i * 4 + 1] = (uint8_t)(255 - base - i);
+                rgbe[i * 4 + 2] = (uint8_t)(base + i * 3);
+                rgbe[i * 4 + 3] = (uint8_t)e;
+            }
+
+            for (size_t n = TONEMAP_BLOCK_SIZE - 3; n <= TONEMAP_BLOCK_SIZE;
+                 n += 3) {
+                tonemap_load_rgbe(rgbe, 4, 0, n, &a);
+                tonemap_rgbe_loader()(rgbe, 4, 0, n, &b);
+
+                g_assert_true(memcmp(a.r, b.r, sizeof a.r) == 0);
+                g_assert_true(memcmp(a.g, b.g, sizeof a.g) == 0);
+                g_assert_true(memcmp(a.b, b.b, sizeof a.b) == 0);
+                g_assert_true(memcmp(a.a, b.a, sizeof a.a) == 0);
+            }
+        }
+    }
+}
+
+/* Planar input, float or half, gives the same bytes as interleaved. */
+static void
+test_planar_matches_interleaved(void)
+{
+    const int width = 97, height = 23;
+    size_t    pixel_count = (size_t)width * (size_t)height;
+
+    for (int num_channels = 3; num_channels <= 4; num_channels++) {
+        float        *img   = make_hdr_image(width, height, num_channels);
+        float        *plane = g_new(float, pixel_count * 4);
+        uint16_t     *half  = g_new(uint16_t, pixel_count * 4);
+        uint16_t     *halfi = g_new(uint16_t, pixel_count * 4);
+        uint8_t      *ref   = g_malloc(pixel_count * 4);
+        uint8_t      *out   = g_malloc(pixel_count * 4);
+        TonemapPlanes planes, half_planes;
+
+        memset(&planes, 0, sizeof planes);
+        memset(&half_planes, 0, sizeof half_planes);
+
+        for (int c = 0; c < num_channels; c++) {
+            for (size_t i = 0; i < pixel_count; i++) {
+                size_t   j = i * (size_t)num_channels + (size_t)c;
+                uint16_t h = (uint16_t)(rand_unit() * 0x7c00);
+
+                plane[(size_t)c * pixel_count + i] = img[j];
+                half[(size_t)c * pixel_count + i]  = h;
+                halfi[j] = h;
+            }
+            planes.channel[c]      = plane + (size_t)c * pixel_count;
+            half_planes.channel[c] = half + (size_t)c * pixel_count;
+        }
+
+        tonemap_reinhard(img, ref, width * 4, width, height, num_channels);
+        tonemap_reinhard_planar(&planes, out, width * 4, width, height);
+        g_assert_true(memcmp(ref, out, pixel_count * 4) == 0);
+
+        tonemap_reinhard_half(halfi, ref, width * 4, width, height,
+                              num_channels);
+        tonemap_reinhard_planar_half(&half_planes, out, width * 4,
+                                     width, height);
+        g_assert_true(memcmp(ref, out, pixel_count * 4) == 0);
+
+        g_free(img);
+        g_free(plane);
+        g_free(half);
+        g_free(halfi);
+        g_free(ref);
+        g_free(out);
+    }
+}
+
+/* The table quantizer reproduces the powf() reference bit for bit. */
+static void
+test_srgb_table_exact(void)
+{
+    const TonemapSrgbTable *t = tonemap_srgb_table();
+
+    for (uint32_t bits = 0; bits <= 0x41800000u; bits += 4099) {
+        float c = tonemap_float_from_bits(bits);
+        g_assert_cmpint(tonemap_srgb_quantize(t, c), ==, linear_to_srgb8(c));
+    }
+
+    /* Both sides of every decision threshold. */
+    for (int k = 1; k <= 255; k++) {
+        uint32_t bits;
+        memcpy(&bits, &t->threshold[k], sizeof bits);
+
+        for (uint32_t b = bits - 2; b <= bits + 2; b++) {
+            float c = tonemap_float_from_bits(b);
+            g_assert_cmpint(tonemap_srgb_quantize(t, c), ==, linear_to_srgb8(c));
+        }
+    }
+
+    g_assert_cmpint(tonemap_srgb_quantize(t, -1.0f), ==, 0);
+    g_assert_cmpint(tonemap_srgb_quantize(t, 1e30f), ==, 255);
+}
+
+int
+main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/tonemap/kernels-match-reference",
+                    test_kernels_match_reference);
+    g_test_add_func("/tonemap/quality-tiers", test_quality_tiers);
+    g_test_add_func("/tonemap/quality-preview-sampled",
+                    test_quality_preview_sampled);
+    g_test_add_func("/tonemap/all-invalid", test_all_invalid);
+    g_test_add_func("/tonemap/thread-count-invariant",
+                    test_thread_count_invariant);
+    g_test_add_func("/tonemap/row-stats-match", test_row_stats_match);
+    g_test_add_func("/tonemap/stats-queries", test_stats_queries);
+    g_test_add_func("/tonemap/stats-sample", test_stats_sample);
+    g_test_add_func("/tonemap/rowstride", test_rowstride);
+    g_test_add_func("/tonemap/rgbe-matches-float", test_rgbe_matches_float);
+    g_test_add_func("/tonemap/half-matches-float", test_half_matches_float);
+    g_test_add_func("/tonemap/half-loaders-agree", test_half_loaders_agree);
+    g_test_add_func("/tonemap/rgbe-loaders-agree", test_rgbe_loaders_agree);
+    g_test_add_func("/tonemap/rgbe-runs", test_rgbe_runs);
+    g_test_add_func("/tonemap/planar-matches-interleaved",
+                    test_planar_matches_interleaved);
+    g_test_add_func("/tonemap/srgb-table-exact", test_srgb_table_exact);
+
+    return g_test_run();
+}
@@ -4,6 +4,14 @@
  *
  * All functions are static inline so this header can be included directly
  * without creating a separate compilation unit.
+ *
+ * The per-pixel work runs on small planar blocks through a set of kernels
+ * (scalar, SSE2 or AVX2) picked at run time from the CPU features, and the
+ * sRGB curve is applied by an exact threshold table instead of powf().
+ * Exposure comes from a histogram of log luminance built with integer
+ * bucketing instead of logf(); see TonemapStats.
+ * tonemap_reinhard_scalar() is kept as the reference implementation the
+ * kernels are checked against: they agree to within ±1 LSB.
  */
 
 #ifndef TONEMAP_H
@@ -11,12 +19,31 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+#include <float.h>
 #include <math.h>
 
+#include <glib.h>
+
+#include "parallel.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TONEMAP_HAVE_X86 1
+#include <immintrin.h>
+#define TONEMAP_TARGET_SSE2 __attribute__((target("sse2")))
+#define TONEMAP_TARGET_AVX2 __attribute__((target("avx2")))
+#define TONEMAP_TARGET_F16C __attribute__((target("avx,f16c")))
+#endif
+
 /* Tonemapping parameters */
 #define TONEMAP_KEY   0.18f
 #define TONEMAP_DELTA 1e-6f
 
+/* Rec. 709 luminance weights */
+#define TONEMAP_LUMA_R 0.2126f
+#define TONEMAP_LUMA_G 0.7152f
+#define TONEMAP_LUMA_B 0.0722f
+
 /*
  * linear_to_srgb — Convert a linear-light value to sRGB gamma.
  *
@@ -31,34 +58,26 @@ linear_to_srgb(float c)
         return 1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
 }
 
+/* ------------------------------------------------------------------ */
+/*  Reference implementation                                           */
+/* ------------------------------------------------------------------ */
+
 /*
- * tonemap_reinhard — Tonemap HDR float pixels to 8-bit sRGB using the
- *                    Reinhard global operator with auto-exposure.
- *
- * @rgb_in:        Input float pixel data, num_channels floats per pixel.
- * @srgb_out:      Output buffer, always 4 bytes (RGBA) per pixel.
- *                 Caller must allocate width * height * 4 bytes.
- * @width:         Image width in pixels.
- * @height:        Image height in pixels.
- * @num_channels:  Channels per input pixel (3 = RGB, 4 = RGBA).
- *
- * The algorithm runs in two passes:
- *   1. Compute log-average luminance across all valid pixels.
- *   2. Apply the Reinhard operator per-pixel, convert to sRGB, and write out.
+ * tonemap_reinhard_scalar — Reference version of tonemap_reinhard().
  *
- * NaN/Inf values are treated as invalid and mapped to black.  This is
- * important for robustness when loading untrusted EXR files.
+ * One pixel at a time with libm logf()/powf().  Not used by the loaders;
+ * it defines the output the block kernels below must reproduce.
  */
 static inline void
-tonemap_reinhard(const float *rgb_in, uint8_t *srgb_out,
-                 int width, int height, int num_channels)
+tonemap_reinhard_scalar(const float *rgb_in, uint8_t *srgb_out,
+                        int width, int height, int num_channels)
 {
     const size_t stride = (unsigned)num_channels;
     const size_t pixel_count = (size_t)width * (size_t)height;
 
     /* ---- Pass 1: Compute log-average luminance ---- */
 
-    float  sum_log     = 0.0f;
+    double sum_log     = 0.0;
     size_t valid_count = 0;
 
     for (size_t i = 0; i < pixel_count; i++) {
@@ -68,7 +87,7 @@ tonemap_reinhard(const float *rgb_in, uint8_t *srgb_out,
         float g = fmaxf(0.0f, px[1]);
         float b = fmaxf(0.0f, px[2]);
 
-        float L = 0.2126f * r + 0.7152f * g + 0.0722f * b;
+        float L = TONEMAP_LUMA_R * r + TONEMAP_LUMA_G * g + TONEMAP_LUMA_B * b;
 
         if (!isfinite(L) || L <= 0.0f)
             continue;
@@ -95,7 +114,7 @@ tonemap_reinhard(const float *rgb_in, uint8_t *srgb_out,
         return;
     }
 
-    float Lavg  = expf(sum_log / (float)valid_count);
+    float Lavg  = (float)exp(sum_log / (double)valid_count);
     float scale = TONEMAP_KEY / fmaxf(Lavg, TONEMAP_DELTA);
 
     /* ---- Pass 2: Tonemap and convert each pixel ---- */
@@ -108,7 +127,7 @@ tonemap_reinhard(const float *rgb_in, uint8_t *srgb_out,
         float g = fmaxf(0.0f, px[1]);
         float b = fmaxf(0.0f, px[2]);
 
-        float L = 0.2126f * r + 0.7152f * g + 0.0722f * b;
+        float L = TONEMAP_LUMA_R * r + TONEMAP_LUMA_G * g + TONEMAP_LUMA_B * b;
 
         if (L <= 0.0f || !isfinite(L)) {
             out[0] = 0;
@@ -151,4 +170,2014 @@ tonemap_reinhard(const float *rgb_in, uint8_t *srgb_out,
     }
 }
 
+/* ------------------------------------------------------------------ */
+/*  Exact 8-bit sRGB quantizer                                         */
+/* ------------------------------------------------------------------ */
+
+/*
+ * linear_to_srgb8 — Clamp linear_to_srgb(c) to [0, 1] and quantize it to
+ *                   8 bits, exactly as the reference pass 2 does.
+ */
+static inline uint8_t
+linear_to_srgb8(float c)
+{
+    float s = linear_to_srgb(c);
+    return (uint8_t)(fminf(1.0f, fmaxf(0.0f, s)) * 255.0f + 0.5f);
+}
+
+/* The lookup covers linear values in [2^-13, 1): below that everything
+ * quantizes to 0, above it to 255.  Buckets are indexed by the float's
+ * exponent and top 7 mantissa bits. */
+#define TONEMAP_SRGB_LUT_FIRST (0x39000000 >> 16)   /* 2^-13 */
+#define TONEMAP_SRGB_LUT_END   (0x3f800000 >> 16)   /* 1.0 */
+#define TONEMAP_SRGB_LUT_SIZE  (TONEMAP_SRGB_LUT_END - TONEMAP_SRGB_LUT_FIRST)
+
+/*
+ * TonemapSrgbTable — Decision thresholds for linear_to_srgb8().
+ *
+ * threshold[k] is the smallest float c with linear_to_srgb8(c) >= k, so
+ * the code for c is the number of thresholds at or below it.  start[i]
+ * is the code at the lower edge of bucket i; no bucket spans more than
+ * `steps` thresholds, so that many compares finish the search.
+ */
+typedef struct {
+    float   threshold[257];
+    int32_t start[TONEMAP_SRGB_LUT_SIZE];
+    int     steps;
+} TonemapSrgbTable;
+
+static inline float
+tonemap_float_from_bits(uint32_t bits)
+{
+    float f;
+    memcpy(&f, &bits, sizeof f);
+    return f;
+}
+
+static inline void
+tonemap_srgb_table_init(TonemapSrgbTable *t)
+{
+    t->threshold[0]   = -INFINITY;
+    t->threshold[256] = INFINITY;
+
+    /* Bisect over the bit patterns of [0, 1]; they sort like the floats.
+     * linear_to_srgb8(0) == 0 and linear_to_srgb8(1) == 255. */
+    for (int k = 1; k <= 255; k++) {
+        uint32_t lo = 0, hi = 0x3f800000u;
+
+        while (hi - lo > 1) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (linear_to_srgb8(tonemap_float_from_bits(mid)) >= k)
+                hi = mid;
+            else
+                lo = mid;
+        }
+        t->threshold[k] = tonemap_float_from_bits(hi);
+    }
+
+    int q = 0;
+    t->steps = 0;
+
+    for (int i = 0; i < TONEMAP_SRGB_LUT_SIZE; i++) {
+        uint32_t lower = (uint32_t)(TONEMAP_SRGB_LUT_FIRST + i) << 16;
+        float    upper = tonemap_float_from_bits(lower + 0xffffu);
+
+        while (tonemap_float_from_bits(lower) >= t->threshold[q + 1])
+            q++;
+        t->start[i] = q;
+
+        int top = q;
+        while (upper >= t->threshold[top + 1])
+            top++;
+        if (top - q > t->steps)
+            t->steps = top - q;
+    }
+}
+
+/*
+ * tonemap_srgb_table — The shared quantizer table, built on first use.
+ *
+ * Both loaders are flagged GDK_PIXBUF_FORMAT_THREADSAFE, so the first
+ * use may race with itself; g_once_init_enter() serializes it.
+ */
+static inline const TonemapSrgbTable *
+tonemap_srgb_table(void)
+{
+    static TonemapSrgbTable table;
+    static gsize            initialized = 0;
+
+    if (g_once_init_enter(&initialized)) {
+        tonemap_srgb_table_init(&table);
+        g_once_init_leave(&initialized, 1);
+    }
+
+    return &table;
+}
+
+/*
+ * tonemap_srgb_quantize — Table-driven linear_to_srgb8().
+ *
+ * Bit-identical to linear_to_srgb8() for every non-NaN input, with no
+ * transcendental calls.
+ */
+static inline uint8_t
+tonemap_srgb_quantize(const TonemapSrgbTable *t, float c)
+{
+    int32_t bits;
+    memcpy(&bits, &c, sizeof bits);
+
+    /* Negative inputs have negative bit patterns and clamp to bucket 0. */
+    int32_t idx = (bits >> 16) - TONEMAP_SRGB_LUT_FIRST;
+    idx = idx < 0 ? 0 : idx;
+    idx = idx >= TONEMAP_SRGB_LUT_SIZE ? TONEMAP_SRGB_LUT_SIZE - 1 : idx;
+
+    int32_t q = t->start[idx];
+    while (q < 255 && c >= t->threshold[q + 1])
+        q++;
+
+    return (uint8_t)q;
+}
+
+/* Steps of the fixed-point linear values the preview quantizer takes. */
+#define TONEMAP_SRGB_FIXED_MAX 4095
+
+/*
+ * TonemapSrgbLut — Single-load sRGB quantizers for the fast and preview
+ *                  qualities.
+ *
+ * bucket[i] is the code at the middle of threshold-table bucket i; no
+ * bucket holds more than one threshold, so it is within 1 of the exact
+ * code anywhere in the bucket.  fixed[v] is the exact code for
+ * v / TONEMAP_SRGB_FIXED_MAX.  Three bytes of padding let a 32-bit
+ * gather read any entry.
+ */
+typedef struct {
+    uint8_t bucket[TONEMAP_SRGB_LUT_SIZE + 3];
+    uint8_t fixed[TONEMAP_SRGB_FIXED_MAX + 1 + 3];
+} TonemapSrgbLut;
+
+static inline const TonemapSrgbLut *
+tonemap_srgb_lut(void)
+{
+    static TonemapSrgbLut lut;
+    static gsize          initialized = 0;
+
+    if (g_once_init_enter(&initialized)) {
+        const TonemapSrgbTable *t = tonemap_srgb_table();
+
+        for (int i = 0; i < TONEMAP_SRGB_LUT_SIZE; i++) {
+            uint32_t mid = ((uint32_t)(TONEMAP_SRGB_LUT_FIRST + i) << 16) |
+                           0x8000u;
+            lut.bucket[i] = tonemap_srgb_quantize(t, tonemap_float_from_bits(mid));
+        }
+        for (int v = 0; v <= TONEMAP_SRGB_FIXED_MAX; v++)
+            lut.fixed[v] = linear_to_srgb8((float)v /
+                                           (float)TONEMAP_SRGB_FIXED_MAX);
+        g_once_init_leave(&initialized, 1);
+    }
+
+    return &lut;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Block kernels                                                      */
+/* ------------------------------------------------------------------ */
+
+/* Pixels per block.  A multiple of the widest vector (8 floats). */
+#define TONEMAP_BLOCK_SIZE 64
+
+/*
+ * Pass 1 buckets pixels by log luminance: the bucket of L + delta is its
+ * float exponent and top TONEMAP_HIST_SUB_BITS mantissa bits, 32 buckets
+ * an octave, from delta (1e-6f is 0x358637bd) up to FLT_MAX.  One more
+ * bucket past the end counts invalid pixels.
+ */
+#define TONEMAP_HIST_SUB_BITS 5
+#define TONEMAP_HIST_SHIFT    (23 - TONEMAP_HIST_SUB_BITS)
+#define TONEMAP_HIST_FIRST    (0x358637bdu >> TONEMAP_HIST_SHIFT)
+#define TONEMAP_HIST_BUCKETS  ((0x7f7fffffu >> TONEMAP_HIST_SHIFT) - \
+                               TONEMAP_HIST_FIRST + 1)
+
+/*
+ * TonemapBlock — A run of up to TONEMAP_BLOCK_SIZE pixels in planar form.
+ *
+ * Lanes past the pixel count, up to the next multiple of 8, must hold
+ * r = g = b = 0 so that the vector kernels see them as invalid pixels.
+ */
+typedef struct {
+    _Alignas(32) float r[TONEMAP_BLOCK_SIZE];
+    _Alignas(32) float g[TONEMAP_BLOCK_SIZE];
+    _Alignas(32) float b[TONEMAP_BLOCK_SIZE];
+    _Alignas(32) float a[TONEMAP_BLOCK_SIZE];
+} TonemapBlock;
+
+/*
+ * Pass 1 kernel: adds @weight to the histogram bucket of each pixel of
+ * the block.  @hist has TONEMAP_HIST_BUCKETS + 1 entries.
+ */
+typedef void (*TonemapStatsFunc)(const TonemapBlock *blk, size_t n,
+                                 uint32_t weight, uint32_t *hist);
+
+/*
+ * Pass 2 kernel: tonemaps n pixels with the given exposure scale and
+ * writes them as RGBA8 to out (4 * n bytes, no alignment requirement).
+ */
+typedef void (*TonemapApplyFunc)(const TonemapBlock *blk, size_t n,
+                                 float scale, uint8_t *out);
+
+typedef enum {
+    TONEMAP_ISA_SCALAR,
+    TONEMAP_ISA_SSE2,
+    TONEMAP_ISA_AVX2,
+} TonemapIsa;
+
+/*
+ * TonemapQuality — How much accuracy pass 2 and pass 1 trade for speed.
+ *
+ * EXACT quantizes through the sRGB threshold table and is bit-identical
+ * to linear_to_srgb8() on the tonemapped value.  FAST uses one table load
+ * and a refined reciprocal per pixel and stays within 1 of EXACT.
+ * PREVIEW samples pass 1 (see tonemap_stats_sample()) and quantizes from
+ * 12-bit fixed point with an unrefined reciprocal, for thumbnails.
+ */
+typedef enum {
+    TONEMAP_QUALITY_EXACT,
+    TONEMAP_QUALITY_FAST,
+    TONEMAP_QUALITY_PREVIEW,
+} TonemapQuality;
+
+typedef struct {
+    TonemapStatsFunc stats;
+    TonemapApplyFunc apply;
+} TonemapKernels;
+
+static inline uint8_t
+tonemap_quantize_alpha(float a)
+{
+    a = fmaxf(0.0f, fminf(1.0f, a));
+    return (uint8_t)(a * 255.0f + 0.5f);
+}
+
+/* tonemap_hist_bucket — Histogram bucket of a valid luminance L. */
+static inline uint32_t
+tonemap_hist_bucket(float L)
+{
+    float    x = L + TONEMAP_DELTA;
+    uint32_t bits;
+
+    memcpy(&bits, &x, sizeof bits);
+    return (bits >> TONEMAP_HIST_SHIFT) - TONEMAP_HIST_FIRST;
+}
+
+static inline void
+tonemap_stats_block_scalar(const TonemapBlock *blk, size_t n,
+                           uint32_t weight, uint32_t *hist)
+{
+    for (size_t i = 0; i < n; i++) {
+        float r = fmaxf(0.0f, blk->r[i]);
+        float g = fmaxf(0.0f, blk->g[i]);
+        float b = fmaxf(0.0f, blk->b[i]);
+
+        float L = TONEMAP_LUMA_R * r + TONEMAP_LUMA_G * g + TONEMAP_LUMA_B * b;
+
+        if (!isfinite(L) || L <= 0.0f)
+            hist[TONEMAP_HIST_BUCKETS] += weight;
+        else
+            hist[tonemap_hist_bucket(L)] += weight;
+    }
+}
+
+static inline void
+tonemap_apply_block_scalar(const TonemapBlock *blk, size_t n,
+                           float scale, uint8_t *out)
+{
+    const TonemapSrgbTable *srgb = tonemap_srgb_table();
+
+    for (size_t i = 0; i < n; i++, out += 4) {
+        float r = fmaxf(0.0f, blk->r[i]);
+        float g = fmaxf(0.0f, blk->g[i]);
+        float b = fmaxf(0.0f, blk->b[i]);
+
+        float L = TONEMAP_LUMA_R * r + TONEMAP_LUMA_G * g + TONEMAP_LUMA_B * b;
+
+        out[3] = tonemap_quantize_alpha(blk->a[i]);
+
+        if (L <= 0.0f || !isfinite(L)) {
+            out[0] = 0;
+            out[1] = 0;
+            out[2] = 0;
+            continue;
+        }
+
+        float L_scaled = scale * L;
+        float ratio    = L_scaled / (1.0f + L_scaled) / L;
+
+        out[0] = tonemap_srgb_quantize(srgb, r * ratio);
+        out[1] = tonemap_srgb_quantize(srgb, g * ratio);
+        out[2] = tonemap_srgb_quantize(srgb, b * ratio);
+    }
+}
+
+/* tonemap_srgb_lookup — TonemapSrgbLut quantizer; @fixed picks preview's. */
+static inline uint8_t
+tonemap_srgb_lookup(const TonemapSrgbLut *lut, float c, int fixed)
+{
+    if (fixed) {
+        float v = fminf(fmaxf(c, 0.0f), 1.0f) * TONEMAP_SRGB_FIXED_MAX + 0.5f;
+        return lut->fixed[(int32_t)v];
+    }
+
+    int32_t bits;
+    memcpy(&bits, &c, sizeof bits);
+
+    int32_t idx = (bits >> 16) - TONEMAP_SRGB_LUT_FIRST;
+    idx = idx < 0 ? 0 : idx;
+    idx = idx >= TONEMAP_SRGB_LUT_SIZE ? TONEMAP_SRGB_LUT_SIZE - 1 : idx;
+
+    return lut->bucket[idx];
+}
+
+/*
+ * Pass 2 for the FAST (@fixed = 0) and PREVIEW (@fixed = 1) qualities:
+ * Ls / (1 + Ls) / L is folded into scale / (1 + Ls), one division.
+ */
+static inline void
+tonemap_apply_lut_scalar(const TonemapBlock *blk, size_t n,
+                         float scale, uint8_t *out, int fixed)
+{
+    const TonemapSrgbLut *lut = tonemap_srgb_lut();
+
+    for (size_t i = 0; i < n; i++, out += 4) {
+        float r = fmaxf(0.0f, blk->r[i]);
+        float g = fmaxf(0.0f, blk->g[i]);
+        float b = fmaxf(0.0f, blk->b[i]);
+
+        float L = TONEMAP_LUMA_R * r + TONEMAP_LUMA_G * g + TONEMAP_LUMA_B * b;
+
+        out[3] = tonemap_quantize_alpha(blk->a[i]);
+
+        if (L <= 0.0f || !isfinite(L)) {
+            out[0] = 0;
+            out[1] = 0;
+            out[2] = 0;
+            continue;
+        }
+
+        float ratio = scale / (1.0f + scale * L);
+
+        out[0] = tonemap_srgb_lookup(lut, r * ratio, fixed);
+        out[1] = tonemap_srgb_lookup(lut, g * ratio, fixed);
+        out[2] = tonemap_srgb_lookup(lut, b * ratio, fixed);
+    }
+}
+
+static inline void
+tonemap_apply_block_fast_scalar(const TonemapBlock *blk, size_t n,
+                                float scale, uint8_t *out)
+{
+    tonemap_apply_lut_scalar(blk, n, scale, out, 0);
+}
+
+static inline void
+tonemap_apply_block_preview_scalar(const TonemapBlock *blk, size_t n,
+                                   float scale, uint8_t *out)
+{
+    tonemap_apply_lut_scalar(blk, n, scale, out, 1);
+}
+
+#ifdef TONEMAP_HAVE_X86
+
+/* tonemap_srgb_quantize() on each lane; SSE2 has no gather. */
+TONEMAP_TARGET_SSE2 static inline __m128i
+tonemap_srgb_quantize_sse2(const TonemapSrgbTable *t, __m128 c)
+{
+    float   lanes[4];
+    int32_t q[4];
+
+    _mm_storeu_ps(lanes, c);
+    for (int l = 0; l < 4; l++)
+        q[l] = tonemap_srgb_quantize(t, lanes[l]);
+
+    return _mm_loadu_si128((const __m128i *)q);
+}
+
+TONEMAP_TARGET_SSE2 static inline void
+tonemap_stats_block_sse2(const TonemapBlock *blk, size_t n,
+                         uint32_t weight, uint32_t *hist)
+{
+    const __m128 zero = _mm_setzero_ps();
+    int32_t bucket[TONEMAP_BLOCK_SIZE];
+
+    for (size_t i = 0; i < n; i += 4) {
+        __m128 r = _mm_max_ps(_mm_load_ps(blk->r + i), zero);
+        __m128 g = _mm_max_ps(_mm_load_ps(blk->g + i), zero);
+        __m128 b = _mm_max_ps(_mm_load_ps(blk->b + i), zero);
+
+        __m128 L = _mm_add_ps(_mm_add_ps(
+                       _mm_mul_ps(r, _mm_set1_ps(TONEMAP_LUMA_R)),
+                       _mm_mul_ps(g, _mm_set1_ps(TONEMAP_LUMA_G))),
+                       _mm_mul_ps(b, _mm_set1_ps(TONEMAP_LUMA_B)));
+
+        /* Fails for L <= 0, NaN and +Inf alike. */
+        __m128i valid = _mm_castps_si128(_mm_and_ps(
+                            _mm_cmpgt_ps(L, zero),
+                            _mm_cmple_ps(L, _mm_set1_ps(FLT_MAX))));
+
+        __m128i k = _mm_sub_epi32(
+                        _mm_srli_epi32(_mm_castps_si128(_mm_add_ps(
+                            L, _mm_set1_ps(TONEMAP_DELTA))),
+                            TONEMAP_HIST_SHIFT),
+                        _mm_set1_epi32((int)TONEMAP_HIST_FIRST));
+        k = _mm_or_si128(_mm_and_si128(valid, k),
+                         _mm_andnot_si128(valid, _mm_set1_epi32(
+                             (int)TONEMAP_HIST_BUCKETS)));
+
+        _mm_storeu_si128((__m128i *)(bucket + i), k);
+    }
+
+    for (size_t i = 0; i < n; i++)
+        hist[bucket[i]] += weight;
+}
+
+TONEMAP_TARGET_SSE2 static inline void
+tonemap_apply_block_sse2(const TonemapBlock *blk, size_t n,
+                         float scale, uint8_t *out)
+{
+    const TonemapSrgbTable *srgb = tonemap_srgb_table();
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one  = _mm_set1_ps(1.0f);
+    uint32_t packed[TONEMAP_BLOCK_SIZE];
+
+    for (size_t i = 0; i < n; i += 4) {
+        __m128 r = _mm_max_ps(_mm_load_ps(blk->r + i), zero);
+        __m128 g = _mm_max_ps(_mm_load_ps(blk->g + i), zero);
+        __m128 b = _mm_max_ps(_mm_load_ps(blk->b + i), zero);
+        __m128 a = _mm_load_ps(blk->a + i);
+
+        __m128 L = _mm_add_ps(_mm_add_ps(
+                       _mm_mul_ps(r, _mm_set1_ps(TONEMAP_LUMA_R)),
+                       _mm_mul_ps(g, _mm_set1_ps(TONEMAP_LUMA_G))),
+                       _mm_mul_ps(b, _mm_set1_ps(TONEMAP_LUMA_B)));
+
+        __m128 valid = _mm_and_ps(_mm_cmpgt_ps(L, zero),
+                                  _mm_cmple_ps(L, _mm_set1_ps(FLT_MAX)));
+        L = _mm_or_ps(_mm_and_ps(valid, L), _mm_andnot_ps(valid, one));
+
+        __m128 Ls    = _mm_mul_ps(L, _mm_set1_ps(scale));
+        __m128 ratio = _mm_div_ps(_mm_div_ps(Ls, _mm_add_ps(one, Ls)), L);
+
+        __m128i ri = tonemap_srgb_quantize_sse2(srgb, _mm_mul_ps(r, ratio));
+        __m128i gi = tonemap_srgb_quantize_sse2(srgb, _mm_mul_ps(g, ratio));
+        __m128i bi = tonemap_srgb_quantize_sse2(srgb, _mm_mul_ps(b, ratio));
+
+        /* Alpha: NaN clamps to 1 through minps' operand order. */
+        a = _mm_max_ps(_mm_min_ps(a, one), zero);
+        __m128i ai = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(a, _mm_set1_ps(255.0f)),
+                                                 _mm_set1_ps(0.5f)));
+
+        __m128i rgb = _mm_or_si128(_mm_or_si128(ri, _mm_slli_epi32(gi, 8)),
+                                   _mm_slli_epi32(bi, 16));
+        rgb = _mm_and_si128(rgb, _mm_castps_si128(valid));
+
+        _mm_storeu_si128((__m128i *)(packed + i),
+                         _mm_or_si128(rgb, _mm_slli_epi32(ai, 24)));
+    }
+
+    memcpy(out, packed, n * 4);
+}
+
+/* tonemap_srgb_lookup() on each lane; SSE2 has no gather. */
+TONEMAP_TARGET_SSE2 static inline __m128i
+tonemap_srgb_lookup_sse2(const TonemapSrgbLut *lut, __m128 c, int fixed)
+{
+    int32_t idx[4];
+
+    if (fixed) {
+        /* maxps returns its second operand for NaN, so NaN maps to 0. */
+        c = _mm_min_ps(_mm_max_ps(c, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+        _mm_storeu_si128((__m128i *)idx, _mm_cvttps_epi32(_mm_add_ps(
+            _mm_mul_ps(c, _mm_set1_ps(TONEMAP_SRGB_FIXED_MAX)),
+            _mm_set1_ps(0.5f))));
+        for (int l = 0; l < 4; l++)
+            idx[l] = lut->fixed[idx[l]];
+    } else {
+        __m128i k = _mm_sub_epi32(_mm_srai_epi32(_mm_castps_si128(c), 16),
+                                  _mm_set1_epi32(TONEMAP_SRGB_LUT_FIRST));
+        __m128i top = _mm_set1_epi32(TONEMAP_SRGB_LUT_SIZE - 1);
+
+        k = _mm_andnot_si128(_mm_srai_epi32(k, 31), k);
+        k = _mm_or_si128(_mm_andnot_si128(_mm_cmpgt_epi32(k, top), k),
+                         _mm_and_si128(_mm_cmpgt_epi32(k, top), top));
+        _mm_storeu_si128((__m128i *)idx, k);
+        for (int l = 0; l < 4; l++)
+            idx[l] = lut->bucket[idx[l]];
+    }
+
+    return _mm_loadu_si128((const __m128i *)idx);
+}
+
+TONEMAP_TARGET_SSE2 static inline void
+tonemap_apply_lut_sse2(const TonemapBlock *blk, size_t n,
+                       float scale, uint8_t *out, int fixed)
+{
+    const TonemapSrgbLut *lut = tonemap_srgb_lut();
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one  = _mm_set1_ps(1.0f);
+    uint32_t packed[TONEMAP_BLOCK_SIZE];
+
+    for (size_t i = 0; i < n; i += 4) {
+        __m128 r = _mm_max_ps(_mm_load_ps(blk->r + i), zero);
+        __m128 g = _mm_max_ps(_mm_load_ps(blk->g + i), zero);
+        __m128 b = _mm_max_ps(_mm_load_ps(blk->b + i), zero);
+        __m128 a = _mm_load_ps(blk->a + i);
+
+        __m128 L = _mm_add_ps(_mm_add_ps(
+                       _mm_mul_ps(r, _mm_set1_ps(TONEMAP_LUMA_R)),
+                       _mm_mul_ps(g, _mm_set1_ps(TONEMAP_LUMA_G))),
+                       _mm_mul_ps(b, _mm_set1_ps(TONEMAP_LUMA_B)));
+
+        __m128 valid = _mm_and_ps(_mm_cmpgt_ps(L, zero),
+                                  _mm_cmple_ps(L, _mm_set1_ps(FLT_MAX)));
+        L = _mm_or_ps(_mm_and_ps(valid, L), _mm_andnot_ps(valid, one));
+
+        /* 1 / (1 + Ls), with one Newton step unless previewing. */
+        __m128 d   = _mm_add_ps(one, _mm_mul_ps(L, _mm_set1_ps(scale)));
+        __m128 inv = _mm_rcp_ps(d);
+        if (!fixed)
+            inv = _mm_mul_ps(inv, _mm_sub_ps(_mm_set1_ps(2.0f),
+                                             _mm_mul_ps(d, inv)));
+        __m128 ratio = _mm_mul_ps(inv, _mm_set1_ps(scale));
+
+        __m128i ri = tonemap_srgb_lookup_sse2(lut, _mm_mul_ps(r, ratio), fixed);
+        __m128i gi = tonemap_srgb_lookup_sse2(lut, _mm_mul_ps(g, ratio), fixed);
+        __m128i bi = tonemap_srgb_lookup_sse2(lut, _mm_mul_ps(b, ratio), fixed);
+
+        a = _mm_max_ps(_mm_min_ps(a, one), zero);
+        __m128i ai = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(a, _mm_set1_ps(255.0f)),
+                                                 _mm_set1_ps(0.5f)));
+
+        __m128i rgb = _mm_or_si128(_mm_or_si128(ri, _mm_slli_epi32(gi, 8)),
+                                   _mm_slli_epi32(bi, 16));
+        rgb = _mm_and_si128(rgb, _mm_castps_si128(valid));
+
+        _mm_storeu_si128((__m128i *)(packed + i),
+                         _mm_or_si128(rgb, _mm_slli_epi32(ai, 24)));
+    }
+
+    memcpy(out, packed, n * 4);
+}
+
+TONEMAP_TARGET_SSE2 static inline void
+tonemap_apply_block_fast_sse2(const TonemapBlock *blk, size_t n,
+                              float scale, uint8_t *out)
+{
+    tonemap_apply_lut_sse2(blk, n, scale, out, 0);
+}
+
+TONEMAP_TARGET_SSE2 static inline void
+tonemap_apply_block_preview_sse2(const TonemapBlock *blk, size_t n,
+                                 float scale, uint8_t *out)
+{
+    tonemap_apply_lut_sse2(blk, n, scale, out, 1);
+}
+
+TONEMAP_TARGET_AVX2 static inline __m256i
+tonemap_srgb_quantize_avx2(const TonemapSrgbTable *t, __m256 c)
+{
+    __m256i idx = _mm256_sub_epi32(_mm256_srai_epi32(_mm256_castps_si256(c), 16),
+                                   _mm256_set1_epi32(TONEMAP_SRGB_LUT_FIRST));
+    idx = _mm256_max_epi32(idx, _mm256_setzero_si256());
+    idx = _mm256_min_epi32(idx, _mm256_set1_epi32(TONEMAP_SRGB_LUT_SIZE - 1));
+
+    __m256i q = _mm256_i32gather_epi32((const int *)t->start, idx, 4);
+
+    for (int s = 0; s < t->steps; s++) {
+        __m256 th = _mm256_i32gather_ps(t->threshold + 1, q, 4);
+        q = _mm256_sub_epi32(q, _mm256_castps_si256(
+                                    _mm256_cmp_ps(c, th, _CMP_GE_OQ)));
+    }
+
+    return _mm256_min_epi32(q, _mm256_set1_epi32(255));
+}
+
+TONEMAP_TARGET_AVX2 static inline void
+tonemap_stats_block_avx2(const TonemapBlock *blk, size_t n,
+                         uint32_t weight, uint32_t *hist)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    int32_t bucket[TONEMAP_BLOCK_SIZE];
+
+    for (size_t i = 0; i < n; i += 8) {
+        __m256 r = _mm256_max_ps(_mm256_load_ps(blk->r + i), zero);
+        __m256 g = _mm256_max_ps(_mm256_load_ps(blk->g + i), zero);
+        __m256 b = _mm256_max_ps(_mm256_load_ps(blk->b + i), zero);
+
+        __m256 L = _mm256_add_ps(_mm256_add_ps(
+                       _mm256_mul_ps(r, _mm256_set1_ps(TONEMAP_LUMA_R)),
+                       _mm256_mul_ps(g, _mm256_set1_ps(TONEMAP_LUMA_G))),
+                       _mm256_mul_ps(b, _mm256_set1_ps(TONEMAP_LUMA_B)));
+
+        __m256 valid = _mm256_and_ps(
+                           _mm256_cmp_ps(L, zero, _CMP_GT_OQ),
+                           _mm256_cmp_ps(L, _mm256_set1_ps(FLT_MAX), _CMP_LE_OQ));
+
+        __m256i k = _mm256_sub_epi32(
+                        _mm256_srli_epi32(_mm256_castps_si256(_mm256_add_ps(
+                            L, _mm256_set1_ps(TONEMAP_DELTA))),
+                            TONEMAP_HIST_SHIFT),
+                        _mm256_set1_epi32((int)TONEMAP_HIST_FIRST));
+        k = _mm256_castps_si256(_mm256_blendv_ps(
+                _mm256_castsi256_ps(_mm256_set1_epi32(
+                    (int)TONEMAP_HIST_BUCKETS)),
+                _mm256_castsi256_ps(k), valid));
+
+        _mm256_storeu_si256((__m256i *)(bucket + i), k);
+    }
+
+    for (size_t i = 0; i < n; i++)
+        hist[bucket[i]] += weight;
+}
+
+TONEMAP_TARGET_AVX2 static inline void
+tonemap_apply_block_avx2(const TonemapBlock *blk, size_t n,
+                         float scale, uint8_t *out)
+{
+    const TonemapSrgbTable *srgb = tonemap_srgb_table();
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one  = _mm256_set1_ps(1.0f);
+    uint32_t packed[TONEMAP_BLOCK_SIZE];
+
+    for (size_t i = 0; i < n; i += 8) {
+        __m256 r = _mm256_max_ps(_mm256_load_ps(blk->r + i), zero);
+        __m256 g = _mm256_max_ps(_mm256_load_ps(blk->g + i), zero);
+        __m256 b = _mm256_max_ps(_mm256_load_ps(blk->b + i), zero);
+        __m256 a = _mm256_load_ps(blk->a + i);
+
+        __m256 L = _mm256_add_ps(_mm256_add_ps(
+                       _mm256_mul_ps(r, _mm256_set1_ps(TONEMAP_LUMA_R)),
+                       _mm256_mul_ps(g, _mm256_set1_ps(TONEMAP_LUMA_G))),
+                       _mm256_mul_ps(b, _mm256_set1_ps(TONEMAP_LUMA_B)));
+
+        __m256 valid = _mm256_and_ps(
+                           _mm256_cmp_ps(L, zero, _CMP_GT_OQ),
+                           _mm256_cmp_ps(L, _mm256_set1_ps(FLT_MAX), _CMP_LE_OQ));
+        L = _mm256_blendv_ps(one, L, valid);
+
+        __m256 Ls    = _mm256_mul_ps(L, _mm256_set1_ps(scale));
+        __m256 ratio = _mm256_div_ps(_mm256_div_ps(Ls, _mm256_add_ps(one, Ls)), L);
+
+        __m256i ri = tonemap_srgb_quantize_avx2(srgb, _mm256_mul_ps(r, ratio));
+        __m256i gi = tonemap_srgb_quantize_avx2(srgb, _mm256_mul_ps(g, ratio));
+        __m256i bi = tonemap_srgb_quantize_avx2(srgb, _mm256_mul_ps(b, ratio));
+
+        a = _mm256_max_ps(_mm256_min_ps(a, one), zero);
+        __m256i ai = _mm256_cvttps_epi32(_mm256_add_ps(
+                         _mm256_mul_ps(a, _mm256_set1_ps(255.0f)),
+                         _mm256_set1_ps(0.5f)));
+
+        __m256i rgb = _mm256_or_si256(_mm256_or_si256(ri, _mm256_slli_epi32(gi, 8)),
+                                      _mm256_slli_epi32(bi, 16));
+        rgb = _mm256_and_si256(rgb, _mm256_castps_si256(valid));
+
+        _mm256_storeu_si256((__m256i *)(packed + i),
+                            _mm256_or_si256(rgb, _mm256_slli_epi32(ai, 24)));
+    }
+
+    memcpy(out, packed, n * 4);
+}
+
+/* tonemap_srgb_lookup() with one byte gather per lane. */
+TONEMAP_TARGET_AVX2 static inline __m256i
+tonemap_srgb_lookup_avx2(const TonemapSrgbLut *lut, __m256 c, int fixed)
+{
+    const uint8_t *table;
+    __m256i        idx;
+
+    if (fixed) {
+        c = _mm256_min_ps(_mm256_max_ps(c, _mm256_setzero_ps()),
+                          _mm256_set1_ps(1.0f));
+        idx = _mm256_cvttps_epi32(_mm256_add_ps(
+                  _mm256_mul_ps(c, _mm256_set1_ps(TONEMAP_SRGB_FIXED_MAX)),
+                  _mm256_set1_ps(0.5f)));
+        table = lut->fixed;
+    } else {
+        idx = _mm256_sub_epi32(_mm256_srai_epi32(_mm256_castps_si256(c), 16),
+                               _mm256_set1_epi32(TONEMAP_SRGB_LUT_FIRST));
+        idx = _mm256_max_epi32(idx, _mm256_setzero_si256());
+        idx = _mm256_min_epi32(idx, _mm256_set1_epi32(TONEMAP_SRGB_LUT_SIZE - 1));
+        table = lut->bucket;
+    }
+
+    return _mm256_and_si256(_mm256_i32gather_epi32((const int *)table, idx, 1),
+                            _mm256_set1_epi32(0xff));
+}
+
+TONEMAP_TARGET_AVX2 static inline void
+tonemap_apply_lut_avx2(const TonemapBlock *blk, size_t n,
+                       float scale, uint8_t *out, int fixed)
+{
+    const TonemapSrgbLut *lut = tonemap_srgb_lut();
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one  = _mm256_set1_ps(1.0f);
+    uint32_t packed[TONEMAP_BLOCK_SIZE];
+
+    for (size_t i = 0; i < n; i += 8) {
+        __m256 r = _mm256_max_ps(_mm256_load_ps(blk->r + i), zero);
+        __m256 g = _mm256_max_ps(_mm256_load_ps(blk->g + i), zero);
+        __m256 b = _mm256_max_ps(_mm256_load_ps(blk->b + i), zero);
+        __m256 a = _mm256_load_ps(blk->a + i);
+
+        __m256 L = _mm256_add_ps(_mm256_add_ps(
+                       _mm256_mul_ps(r, _mm256_set1_ps(TONEMAP_LUMA_R)),
+                       _mm256_mul_ps(g, _mm256_set1_ps(TONEMAP_LUMA_G))),
+                       _mm256_mul_ps(b, _mm256_set1_ps(TONEMAP_LUMA_B)));
+
+        __m256 valid = _mm256_and_ps(
+                           _mm256_cmp_ps(L, zero, _CMP_GT_OQ),
+                           _mm256_cmp_ps(L, _mm256_set1_ps(FLT_MAX), _CMP_LE_OQ));
+        L = _mm256_blendv_ps(one, L, valid);
+
+        __m256 d   = _mm256_add_ps(one, _mm256_mul_ps(L, _mm256_set1_ps(scale)));
+        __m256 inv = _mm256_rcp_ps(d);
+        if (!fixed)
+            inv = _mm256_mul_ps(inv, _mm256_sub_ps(_mm256_set1_ps(2.0f),
+                                                   _mm256_mul_ps(d, inv)));
+        __m256 ratio = _mm256_mul_ps(inv, _mm256_set1_ps(scale));
+
+        __m256i ri = tonemap_srgb_lookup_avx2(lut, _mm256_mul_ps(r, ratio), fixed);
+        __m256i gi = tonemap_srgb_lookup_avx2(lut, _mm256_mul_ps(g, ratio), fixed);
+        __m256i bi = tonemap_srgb_lookup_avx2(lut, _mm256_mul_ps(b, ratio), fixed);
+
+        a = _mm256_max_ps(_mm256_min_ps(a, one), zero);
+        __m256i ai = _mm256_cvttps_epi32(_mm256_add_ps(
+                         _mm256_mul_ps(a, _mm256_set1_ps(255.0f)),
+                         _mm256_set1_ps(0.5f)));
+
+        __m256i rgb = _mm256_or_si256(_mm256_or_si256(ri, _mm256_slli_epi32(gi, 8)),
+                                      _mm256_slli_epi32(bi, 16));
+        rgb = _mm256_and_si256(rgb, _mm256_castps_si256(valid));
+
+        _mm256_storeu_si256((__m256i *)(packed + i),
+                            _mm256_or_si256(rgb, _mm256_slli_epi32(ai, 24)));
+    }
+
+    memcpy(out, packed, n * 4);
+}
+
+TONEMAP_TARGET_AVX2 static inline void
+tonemap_apply_block_fast_avx2(const TonemapBlock *blk, size_t n,
+                              float scale, uint8_t *out)
+{
+    tonemap_apply_lut_avx2(blk, n, scale, out, 0);
+}
+
+TONEMAP_TARGET_AVX2 static inline void
+tonemap_apply_block_preview_avx2(const TonemapBlock *blk, size_t n,
+                                 float scale, uint8_t *out)
+{
+    tonemap_apply_lut_avx2(blk, n, scale, out, 1);
+}
+
+#endif /* TONEMAP_HAVE_X86 */
+
+/*
+ * tonemap_isa_supported — Whether the running CPU can execute the kernels
+ *                         for the given instruction set.
+ */
+static inline int
+tonemap_isa_supported(TonemapIsa isa)
+{
+    switch (isa) {
+    case TONEMAP_ISA_SCALAR:
+        return 1;
+#ifdef TONEMAP_HAVE_X86
+    case TONEMAP_ISA_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case TONEMAP_ISA_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return 0;
+    }
+}
+
+/*
+ * tonemap_kernels_init — Fill in the kernels for an instruction set and
+ *                        quality.
+ *
+ * The caller must have checked tonemap_isa_supported().
+ */
+static inline void
+tonemap_kernels_init(TonemapKernels *k, TonemapIsa isa, TonemapQuality quality)
+{
+    static const TonemapApplyFunc scalar[] = {
+        tonemap_apply_block_scalar,
+        tonemap_apply_block_fast_scalar,
+        tonemap_apply_block_preview_scalar,
+    };
+#ifdef TONEMAP_HAVE_X86
+    static const TonemapApplyFunc sse2[] = {
+        tonemap_apply_block_sse2,
+        tonemap_apply_block_fast_sse2,
+        tonemap_apply_block_preview_sse2,
+    };
+    static const TonemapApplyFunc avx2[] = {
+        tonemap_apply_block_avx2,
+        tonemap_apply_block_fast_avx2,
+        tonemap_apply_block_preview_avx2,
+    };
+#endif
+
+    switch (isa) {
+#ifdef TONEMAP_HAVE_X86
+    case TONEMAP_ISA_AVX2:
+        k->stats = tonemap_stats_block_avx2;
+        k->apply = avx2[quality];
+        break;
+    case TONEMAP_ISA_SSE2:
+        k->stats = tonemap_stats_block_sse2;
+        k->apply = sse2[quality];
+        break;
+#endif
+    default:
+        k->stats = tonemap_stats_block_scalar;
+        k->apply = scalar[quality];
+        break;
+    }
+}
+
+/* tonemap_best_isa — The widest instruction set the CPU supports. */
+static inline TonemapIsa
+tonemap_best_isa(void)
+{
+    if (tonemap_isa_supported(TONEMAP_ISA_AVX2))
+        return TONEMAP_ISA_AVX2;
+    if (tonemap_isa_supported(TONEMAP_ISA_SSE2))
+        return TONEMAP_ISA_SSE2;
+    return TONEMAP_ISA_SCALAR;
+}
+
+/*
+ * tonemap_load_block — Deinterleave n float pixels into a block, padding
+ *                      the last vector with invalid (black) pixels.
+ */
+static inline void
+tonemap_load_block(const float *rgb_in, int num_channels, size_t n,
+                   TonemapBlock *blk)
+{
+    const size_t stride = (unsigned)num_channels;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        const float *px = rgb_in + i * stride;
+        blk->r[i] = px[0];
+        blk->g[i] = px[1];
+        blk->b[i] = px[2];
+        blk->a[i] = (num_channels == 4) ? px[3] : 1.0f;
+    }
+
+    for (; i < TONEMAP_BLOCK_SIZE && (i & 7) != 0; i++) {
+        blk->r[i] = 0.0f;
+        blk->g[i] = 0.0f;
+        blk->b[i] = 0.0f;
+        blk->a[i] = 1.0f;
+    }
+}
+
+/*
+ * tonemap_rgbe_table — 2^(e - 136) for each Radiance exponent byte e, and
+ *                      0 for e == 0, so that m * table[e] decodes a
+ *                      mantissa byte m exactly as ldexpf() would.
+ */
+static inline const float *
+tonemap_rgbe_table(void)
+{
+    static float table[256];
+    static gsize initialized = 0;
+
+    if (g_once_init_enter(&initialized)) {
+        table[0] = 0.0f;
+        for (int e = 1; e < 256; e++)
+            table[e] = ldexpf(1.0f, e - 128 - 8);
+        g_once_init_leave(&initialized, 1);
+    }
+
+    return table;
+}
+
+/*
+ * tonemap_load_block_rgbe — Decode n Radiance RGBE pixels into a block,
+ *                           padding like tonemap_load_block().
+ */
+static inline void
+tonemap_load_block_rgbe(const uint8_t *rgbe_in, size_t n, TonemapBlock *blk)
+{
+    const float *exp_table = tonemap_rgbe_table();
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        const uint8_t *px = rgbe_in + i * 4;
+        float f = exp_table[px[3]];
+
+        blk->r[i] = (float)px[0] * f;
+        blk->g[i] = (float)px[1] * f;
+        blk->b[i] = (float)px[2] * f;
+        blk->a[i] = 1.0f;
+    }
+
+    for (; i < TONEMAP_BLOCK_SIZE && (i & 7) != 0; i++) {
+        blk->r[i] = 0.0f;
+        blk->g[i] = 0.0f;
+        blk->b[i] = 0.0f;
+        blk->a[i] = 1.0f;
+    }
+}
+
+/*
+ * TonemapLoadFunc — Fill a block with pixels [first, first + n) of an
+ * image in some source format.
+ */
+typedef void (*TonemapLoadFunc)(const void *in, int num_channels,
+                                size_t first, size_t n, TonemapBlock *blk);
+
+static inline void
+tonemap_load_float(const void *in, int num_channels,
+                   size_t first, size_t n, TonemapBlock *blk)
+{
+    const float *rgb_in = (const float *)in;
+
+    tonemap_load_block(rgb_in + first * (unsigned)num_channels,
+                       num_channels, n, blk);
+}
+
+static inline void
+tonemap_load_rgbe(const void *in, int num_channels,
+                  size_t first, size_t n, TonemapBlock *blk)
+{
+    (void)num_channels;
+
+    tonemap_load_block_rgbe((const uint8_t *)in + first * 4, n, blk);
+}
+
+#ifdef TONEMAP_HAVE_X86
+/*
+ * tonemap_load_rgbe_avx2 — tonemap_load_rgbe() eight pixels at a time:
+ *                          the mantissas are widened in registers and the
+ *                          exponent scales gathered from the table.
+ *
+ * The products are the same ones the scalar loader computes.
+ */
+TONEMAP_TARGET_AVX2 static inline void
+tonemap_load_rgbe_avx2(const void *in, int num_channels,
+                       size_t first, size_t n, TonemapBlock *blk)
+{
+    const float   *exp_table = tonemap_rgbe_table();
+    const uint8_t *src       = (const uint8_t *)in + first * 4;
+    const __m256i  byte      = _mm256_set1_epi32(0xff);
+    size_t i;
+
+    (void)num_channels;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256i px = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+        __m256  f  = _mm256_i32gather_ps(exp_table,
+                                         _mm256_srli_epi32(px, 24), 4);
+        __m256  r  = _mm256_cvtepi32_ps(_mm256_and_si256(px, byte));
+        __m256  g  = _mm256_cvtepi32_ps(
+                         _mm256_and_si256(_mm256_srli_epi32(px, 8), byte));
+        __m256  b  = _mm256_cvtepi32_ps(
+                         _mm256_and_si256(_mm256_srli_epi32(px, 16), byte));
+
+        _mm256_store_ps(blk->r + i, _mm256_mul_ps(r, f));
+        _mm256_store_ps(blk->g + i, _mm256_mul_ps(g, f));
+        _mm256_store_ps(blk->b + i, _mm256_mul_ps(b, f));
+        _mm256_store_ps(blk->a + i, _mm256_set1_ps(1.0f));
+    }
+
+    for (; i < n; i++) {
+        const uint8_t *px = src + i * 4;
+        float f = exp_table[px[3]];
+
+        blk->r[i] = (float)px[0] * f;
+        blk->g[i] = (float)px[1] * f;
+        blk->b[i] = (float)px[2] * f;
+        blk->a[i] = 1.0f;
+    }
+
+    for (; i < TONEMAP_BLOCK_SIZE && (i & 7) != 0; i++) {
+        blk->r[i] = 0.0f;
+        blk->g[i] = 0.0f;
+        blk->b[i] = 0.0f;
+        blk->a[i] = 1.0f;
+    }
+}
+#endif
+
+/* tonemap_rgbe_loader — The fastest RGBE loader the CPU supports. */
+static inline TonemapLoadFunc
+tonemap_rgbe_loader(void)
+{
+#ifdef TONEMAP_HAVE_X86
+    if (tonemap_isa_supported(TONEMAP_ISA_AVX2))
+        return tonemap_load_rgbe_avx2;
+#endif
+    return tonemap_load_rgbe;
+}
+
+/* Identical RGBE pixels in a row worth converting once and replicating. */
+#define TONEMAP_RUN_MIN 16
+
+/*
+ * tonemap_rgbe_next_run — Find the first run of at least TONEMAP_RUN_MIN
+ * identical pixels in rgbe_in[0, n).  Returns where it starts and sets
+ * *len to its length, or returns n with *len = 0 if there is none.
+ *
+ * In a decoded RLE scanline these are the spans where the runs of all
+ * four channels line up: black borders, clipped skies, flat backdrops.
+ */
+static inline size_t
+tonemap_rgbe_next_run(const uint8_t *rgbe_in, size_t n, size_t *len)
+{
+    size_t i = 0;
+
+    while (i + TONEMAP_RUN_MIN <= n) {
+        uint32_t px, next;
+        size_t   j = i + 1;
+
+        memcpy(&px, rgbe_in + i * 4, 4);
+        for (; j < n; j++) {
+            memcpy(&next, rgbe_in + j * 4, 4);
+            if (next != px)
+                break;
+        }
+
+        if (j - i >= TONEMAP_RUN_MIN) {
+            *len = j - i;
+            return i;
+        }
+        i = j;
+    }
+
+    *len = 0;
+    return n;
+}
+
+/*
+ * tonemap_half_to_float — IEEE 754 binary16 to binary32, exactly.
+ */
+static inline float
+tonemap_half_to_float(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000u) << 16;
+    uint32_t exp  = (h >> 10) & 0x1fu;
+    uint32_t mant = h & 0x3ffu;
+    uint32_t bits;
+    float    f;
+
+    if (exp == 0x1f) {
+        bits = sign | 0x7f800000u | (mant << 13);        /* Inf / NaN */
+    } else if (exp != 0) {
+        bits = sign | ((exp + 112) << 23) | (mant << 13); /* normal */
+    } else if (mant != 0) {
+        /* Subnormal: renormalise into a float exponent. */
+        exp = 113;
+        while (!(mant & 0x400u)) {
+            mant <<= 1;
+            exp--;
+        }
+        bits = sign | (exp << 23) | ((mant & 0x3ffu) << 13);
+    } else {
+        bits = sign;                                      /* ±0 */
+    }
+
+    memcpy(&f, &bits, sizeof f);
+    return f;
+}
+
+/*
+ * tonemap_half_table — tonemap_half_to_float() of every binary16 value,
+ *                      for CPUs without F16C.
+ */
+static inline const float *
+tonemap_half_table(void)
+{
+    static float table[65536];
+    static gsize initialized = 0;
+
+    if (g_once_init_enter(&initialized)) {
+        for (uint32_t h = 0; h < 65536; h++)
+            table[h] = tonemap_half_to_float((uint16_t)h);
+        g_once_init_leave(&initialized, 1);
+    }
+
+    return table;
+}
+
+/*
+ * tonemap_load_half — Convert n interleaved binary16 pixels into a block,
+ *                     padding like tonemap_load_block().
+ */
+static inline void
+tonemap_load_half(const void *in, int num_channels,
+                  size_t first, size_t n, TonemapBlock *blk)
+{
+    const float    *table  = tonemap_half_table();
+    const size_t    stride = (unsigned)num_channels;
+    const uint16_t *src    = (const uint16_t *)in + first * stride;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        const uint16_t *px = src + i * stride;
+        blk->r[i] = table[px[0]];
+        blk->g[i] = table[px[1]];
+        blk->b[i] = table[px[2]];
+        blk->a[i] = (num_channels == 4) ? table[px[3]] : 1.0f;
+    }
+
+    for (; i < TONEMAP_BLOCK_SIZE && (i & 7) != 0; i++) {
+        blk->r[i] = 0.0f;
+        blk->g[i] = 0.0f;
+        blk->b[i] = 0.0f;
+        blk->a[i] = 1.0f;
+    }
+}
+
+#ifdef TONEMAP_HAVE_X86
+/*
+ * tonemap_load_half_f16c — tonemap_load_half() with the F16C conversion
+ *                          instructions, eight samples at a time.
+ *
+ * VCVTPH2PS is exact, so the block matches the table version.
+ */
+TONEMAP_TARGET_F16C static inline void
+tonemap_load_half_f16c(const void *in, int num_channels,
+                       size_t first, size_t n, TonemapBlock *blk)
+{
+    const size_t    stride = (unsigned)num_channels;
+    const uint16_t *src    = (const uint16_t *)in + first * stride;
+    const size_t    count  = n * stride;
+    float           tmp[TONEMAP_BLOCK_SIZE * 4];
+    size_t i;
+
+    for (i = 0; i + 8 <= count; i += 8)
+        _mm256_storeu_ps(tmp + i, _mm256_cvtph_ps(
+            _mm_loadu_si128((const __m128i *)(src + i))));
+    for (; i < count; i++)
+        tmp[i] = _cvtsh_ss(src[i]);
+
+    tonemap_load_block(tmp, num_channels, n, blk);
+}
+#endif
+
+/* tonemap_half_loader — The fastest half loader the CPU supports. */
+static inline TonemapLoadFunc
+tonemap_half_loader(void)
+{
+#ifdef TONEMAP_HAVE_X86
+    if (__builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c"))
+        return tonemap_load_half_f16c;
+#endif
+    return tonemap_load_half;
+}
+
+/*
+ * TonemapPlanes — An image stored one plane per channel, as TinyEXR
+ * returns it.  With a NULL alpha plane every pixel is opaque.
+ */
+typedef struct {
+    const void *channel[4];   /* R, G, B, A: width * height samples each */
+} TonemapPlanes;
+
+/*
+ * tonemap_load_planar — Copy n pixels of float planes into a block,
+ *                       padding like tonemap_load_block().  @in is a
+ *                       TonemapPlanes; @num_channels is unused.
+ */
+static inline void
+tonemap_load_planar(const void *in, int num_channels,
+                    size_t first, size_t n, TonemapBlock *blk)
+{
+    const TonemapPlanes *planes = (const TonemapPlanes *)in;
+    float               *dst[4] = { blk->r, blk->g, blk->b, blk->a };
+    size_t i;
+
+    (void)num_channels;
+
+    for (int c = 0; c < 4; c++) {
+        if (planes->channel[c]) {
+            memcpy(dst[c], (const float *)planes->channel[c] + first,
+                   n * sizeof(float));
+        } else {
+            for (i = 0; i < n; i++)
+                dst[c][i] = 1.0f;
+        }
+    }
+
+    for (i = n; i < TONEMAP_BLOCK_SIZE && (i & 7) != 0; i++) {
+        blk->r[i] = 0.0f;
+        blk->g[i] = 0.0f;
+        blk->b[i] = 0.0f;
+        blk->a[i] = 1.0f;
+    }
+}
+
+/* tonemap_load_planar_half — tonemap_load_planar() for binary16 planes. */
+static inline void
+tonemap_load_planar_half(const void *in, int num_channels,
+                         size_t first, size_t n, TonemapBlock *blk)
+{
+    const TonemapPlanes *planes = (const TonemapPlanes *)in;
+    const float         *table  = tonemap_half_table();
+    float               *dst[4] = { blk->r, blk->g, blk->b, blk->a };
+    size_t i;
+
+    (void)num_channels;
+
+    for (int c = 0; c < 4; c++) {
+        const uint16_t *src = (const uint16_t *)planes->channel[c];
+
+        for (i = 0; i < n; i++)
+            dst[c][i] = src ? table[src[first + i]] : 1.0f;
+    }
+
+    for (i = n; i < TONEMAP_BLOCK_SIZE && (i & 7) != 0; i++) {
+        blk->r[i] = 0.0f;
+        blk->g[i] = 0.0f;
+        blk->b[i] = 0.0f;
+        blk->a[i] = 1.0f;
+    }
+}
+
+#ifdef TONEMAP_HAVE_X86
+/*
+ * tonemap_load_planar_half_f16c — tonemap_load_planar_half() with F16C.
+ * Each plane converts straight into its row of the block.
+ */
+TONEMAP_TARGET_F16C static inline void
+tonemap_load_planar_half_f16c(const void *in, int num_channels,
+                              size_t first, size_t n, TonemapBlock *blk)
+{
+    const TonemapPlanes *planes = (const TonemapPlanes *)in;
+    float               *dst[4] = { blk->r, blk->g, blk->b, blk->a };
+    size_t i;
+
+    (void)num_channels;
+
+    for (int c = 0; c < 4; c++) {
+        const uint16_t *src = (const uint16_t *)planes->channel[c];
+
+        if (!src) {
+            for (i = 0; i < n; i++)
+                dst[c][i] = 1.0f;
+            continue;
+        }
+
+        src += first;
+        for (i = 0; i + 8 <= n; i += 8)
+            _mm256_storeu_ps(dst[c] + i, _mm256_cvtph_ps(
+                _mm_loadu_si128((const __m128i *)(src + i))));
+        for (; i < n; i++)
+            dst[c][i] = _cvtsh_ss(src[i]);
+    }
+
+    for (i = n; i < TONEMAP_BLOCK_SIZE && (i & 7) != 0; i++) {
+        blk->r[i] = 0.0f;
+        blk->g[i] = 0.0f;
+        blk->b[i] = 0.0f;
+        blk->a[i] = 1.0f;
+    }
+}
+#endif
+
+/* tonemap_planar_half_loader — Planar counterpart of tonemap_half_loader(). */
+static inline TonemapLoadFunc
+tonemap_planar_half_loader(void)
+{
+#ifdef TONEMAP_HAVE_X86
+    if (__builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c"))
+        return tonemap_load_planar_half_f16c;
+#endif
+    return tonemap_load_planar_half;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Exposure statistics                                                */
+/* ------------------------------------------------------------------ */
+
+/*
+ * TonemapStats — Log-luminance histogram gathered by pass 1.
+ *
+ * count[k] is the number of valid pixels (finite, positive luminance)
+ * whose L + delta falls in bucket k; the last entry counts the others.
+ * Buckets are about 2% wide, which bounds the error of the quantities
+ * read back below.  Merging adds counts, so the result is the same in
+ * whatever order, and however finely, the work was split up.  Images
+ * are limited far below 2^32 pixels, so the counts cannot overflow.
+ */
+typedef struct {
+    uint32_t count[TONEMAP_HIST_BUCKETS + 1];
+} TonemapStats;
+
+static inline void
+tonemap_stats_init(TonemapStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+static inline void
+tonemap_stats_merge(TonemapStats *stats, const TonemapStats *other)
+{
+    for (size_t k = 0; k <= TONEMAP_HIST_BUCKETS; k++)
+        stats->count[k] += other->count[k];
+}
+
+/* tonemap_hist_value — L + delta at the middle of bucket k. */
+static inline float
+tonemap_hist_value(size_t k)
+{
+    uint32_t bits = (uint32_t)((k + TONEMAP_HIST_FIRST) << TONEMAP_HIST_SHIFT) |
+                    (1u << (TONEMAP_HIST_SHIFT - 1));
+    float    x;
+
+    memcpy(&x, &bits, sizeof x);
+    return x;
+}
+
+/* tonemap_hist_log — log(L + delta) at the middle of each bucket. */
+static inline const double *
+tonemap_hist_log(void)
+{
+    static double table[TONEMAP_HIST_BUCKETS];
+    static gsize initialized = 0;
+
+    if (g_once_init_enter(&initialized)) {
+        for (size_t k = 0; k < TONEMAP_HIST_BUCKETS; k++)
+            table[k] = log((double)tonemap_hist_value(k));
+        g_once_init_leave(&initialized, 1);
+    }
+
+    return table;
+}
+
+/* tonemap_stats_valid_count — Number of pixels with finite, positive L. */
+static inline size_t
+tonemap_stats_valid_count(const TonemapStats *stats)
+{
+    size_t n = 0;
+
+    for (size_t k = 0; k < TONEMAP_HIST_BUCKETS; k++)
+        n += stats->count[k];
+    return n;
+}
+
+/*
+ * tonemap_stats_log_average — exp(mean of log(L + delta)) over the valid
+ * pixels, or 0 if there are none.
+ */
+static inline float
+tonemap_stats_log_average(const TonemapStats *stats)
+{
+    const double *log_table = tonemap_hist_log();
+    double sum_log = 0.0;
+    size_t n       = 0;
+
+    for (size_t k = 0; k < TONEMAP_HIST_BUCKETS; k++) {
+        if (stats->count[k] == 0)
+            continue;
+        sum_log += (double)stats->count[k] * log_table[k];
+        n       += stats->count[k];
+    }
+
+    if (n == 0)
+        return 0.0f;
+    return (float)exp(sum_log / (double)n);
+}
+
+/*
+ * tonemap_stats_percentile — Luminance below which @fraction (0 to 1) of
+ * the valid pixels lie, or 0 if there are none.  0 gives the minimum,
+ * 1 the maximum.
+ */
+static inline float
+tonemap_stats_percentile(const TonemapStats *stats, double fraction)
+{
+    size_t n = tonemap_stats_valid_count(stats);
+    size_t rank;
+    size_t seen = 0;
+
+    if (n == 0)
+        return 0.0f;
+
+    fraction = CLAMP(fraction, 0.0, 1.0);
+    rank = (size_t)ceil(fraction * (double)n);
+    if (rank == 0)
+        rank = 1;
+
+    for (size_t k = 0; k < TONEMAP_HIST_BUCKETS; k++) {
+        seen += stats->count[k];
+        if (seen >= rank)
+            return fmaxf(tonemap_hist_value(k) - TONEMAP_DELTA, 0.0f);
+    }
+    return 0.0f;
+}
+
+/* tonemap_stats_max — Largest valid luminance, or 0 if there is none. */
+static inline float
+tonemap_stats_max(const TonemapStats *stats)
+{
+    return tonemap_stats_percentile(stats, 1.0);
+}
+
+/*
+ * tonemap_stats_scale — Exposure scale for pass 2: key / log-average L.
+ *
+ * With no valid pixel, pass 2 writes black and keeps alpha whatever the
+ * scale, so any value will do.
+ */
+static inline float
+tonemap_stats_scale(const TonemapStats *stats)
+{
+    float Lavg = tonemap_stats_log_average(stats);
+
+    if (Lavg == 0.0f)
+        return 1.0f;
+    return TONEMAP_KEY / fmaxf(Lavg, TONEMAP_DELTA);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Multi-threaded driver                                              */
+/* ------------------------------------------------------------------ */
+
+/* Pixels per task. */
+#define TONEMAP_BAND_PIXELS (64 * 1024)
+
+/* Below this many pixels tonemap_reinhard() stays on the calling thread. */
+#define TONEMAP_PARALLEL_MIN_PIXELS (256 * 1024)
+
+/* Pixels pass 1 looks at for a preview; see tonemap_stats_sample(). */
+#define TONEMAP_SAMPLE_BUDGET (256 * 1024)
+
+typedef struct {
+    const void     *in;
+    TonemapLoadFunc load;
+    uint8_t        *srgb_out;
+    size_t          rowstride;
+    size_t          width;
+    size_t          pixel_count;
+    int             num_channels;
+    TonemapKernels  k;
+    float           scale;
+    gboolean        rgbe_runs;     /* RGBE input: replicate long runs */
+    size_t          sample_step;   /* pass 1: blocks per stratum */
+    TonemapStats   *worker_stats;  /* pass 1: one histogram per thread */
+} TonemapJob;
+
+/* tonemap_sample_hash — Fixed pseudo-random number for stratum s. */
+static inline uint32_t
+tonemap_sample_hash(size_t s)
+{
+    uint32_t h = (uint32_t)s * 0x9e3779b1u;
+
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h;
+}
+
+/*
+ * Pass 1 over one band of strata: runs of job->sample_step blocks, each
+ * counted as one block picked from it.  A step of 1 reads every pixel.
+ */
+static inline void
+tonemap_stats_task(size_t task, unsigned worker, void *user_data)
+{
+    const TonemapJob *job   = (const TonemapJob *)user_data;
+    TonemapStats     *stats = &job->worker_stats[worker];
+    TonemapBlock      blk;
+
+    size_t n_blocks = (job->pixel_count + TONEMAP_BLOCK_SIZE - 1) /
+                      TONEMAP_BLOCK_SIZE;
+    size_t first    = task * (TONEMAP_BAND_PIXELS / TONEMAP_BLOCK_SIZE);
+    size_t last     = first + TONEMAP_BAND_PIXELS / TONEMAP_BLOCK_SIZE;
+
+    for (size_t s = first; s < last && s * job->sample_step < n_blocks; s++) {
+        size_t b0    = s * job->sample_step;
+        size_t count = MIN(job->sample_step, n_blocks - b0);
+        size_t b     = b0 + (count > 1 ? tonemap_sample_hash(s) % count : 0);
+        size_t i     = b * TONEMAP_BLOCK_SIZE;
+        size_t n     = MIN((size_t)TONEMAP_BLOCK_SIZE, job->pixel_count - i);
+
+        job->load(job->in, job->num_channels, i, n, &blk);
+        job->k.stats(&blk, n, (uint32_t)count, stats->count);
+    }
+}
+
+/* tonemap_apply_pixels — Pass 2 over pixels [first, first + n) of a row. */
+static inline void
+tonemap_apply_pixels(const TonemapJob *job, size_t first, size_t n,
+                     uint8_t *out)
+{
+    TonemapBlock blk;
+
+    for (size_t i = 0; i < n; i += TONEMAP_BLOCK_SIZE) {
+        size_t count = n - i;
+        if (count > TONEMAP_BLOCK_SIZE)
+            count = TONEMAP_BLOCK_SIZE;
+
+        job->load(job->in, job->num_channels, first + i, count, &blk);
+        job->k.apply(&blk, count, job->scale, out + i * 4);
+    }
+}
+
+/*
+ * tonemap_apply_rgbe_runs — tonemap_apply_pixels() for RGBE input that
+ * tonemaps each long run of identical pixels once and copies the result.
+ * The kernels treat every lane alike, so the output is the same.
+ */
+static inline void
+tonemap_apply_rgbe_runs(const TonemapJob *job, size_t first, size_t n,
+                        uint8_t *out)
+{
+    const uint8_t *rgbe_in = (const uint8_t *)job->in + first * 4;
+    size_t i = 0;
+
+    while (i < n) {
+        size_t len;
+        size_t run = i + tonemap_rgbe_next_run(rgbe_in + i * 4, n - i, &len);
+
+        tonemap_apply_pixels(job, first + i, run - i, out + i * 4);
+        if (len > 0) {
+            tonemap_apply_pixels(job, first + run, 1, out + run * 4);
+            for (size_t j = 1; j < len; j++)
+                memcpy(out + (run + j) * 4, out + run * 4, 4);
+        }
+        i = run + len;
+    }
+}
+
+static inline void
+tonemap_apply_task(size_t task, unsigned worker, void *user_data)
+{
+    const TonemapJob *job = (const TonemapJob *)user_data;
+
+    (void)worker;
+
+    size_t first = task * TONEMAP_BAND_PIXELS;
+    size_t last  = first + TONEMAP_BAND_PIXELS;
+    if (last > job->pixel_count)
+        last = job->pixel_count;
+
+    /* Spans stop at row ends, since output rows may be padded. */
+    for (size_t i = first; i < last; ) {
+        size_t   y   = i / job->width;
+        size_t   x   = i - y * job->width;
+        size_t   n   = MIN(last - i, job->width - x);
+        uint8_t *out = job->srgb_out + y * job->rowstride + x * 4;
+
+        if (job->rgbe_runs)
+            tonemap_apply_rgbe_runs(job, i, n, out);
+        else
+            tonemap_apply_pixels(job, i, n, out);
+        i += n;
+    }
+}
+
+/* tonemap_default_threads — Thread count for an image of this size. */
+static inline unsigned
+tonemap_default_threads(size_t pixel_count)
+{
+    if (pixel_count < TONEMAP_PARALLEL_MIN_PIXELS)
+        return 1;
+    return parallel_get_max_threads();
+}
+
+/* Environment variable naming the quality: exact, fast or preview. */
+#define TONEMAP_QUALITY_ENV "GDK_PIXBUF_HDR_QUALITY"
+
+/*
+ * tonemap_default_quality — The quality GDK_PIXBUF_HDR_QUALITY names, or
+ * TONEMAP_QUALITY_EXACT.  Read on each call; a loader reads it once per
+ * load and passes it to every pass, so one image never mixes qualities.
+ */
+static inline TonemapQuality
+tonemap_default_quality(void)
+{
+    const char *env = g_getenv(TONEMAP_QUALITY_ENV);
+
+    if (env && g_ascii_strcasecmp(env, "fast") == 0)
+        return TONEMAP_QUALITY_FAST;
+    if (env && g_ascii_strcasecmp(env, "preview") == 0)
+        return TONEMAP_QUALITY_PREVIEW;
+    return TONEMAP_QUALITY_EXACT;
+}
+
+/*
+ * tonemap_job_sample — Make pass 1 read about @budget pixels, spread
+ * evenly over the image; 0 reads them all.
+ */
+static inline void
+tonemap_job_sample(TonemapJob *job, size_t budget)
+{
+    size_t n_blocks  = (job->pixel_count + TONEMAP_BLOCK_SIZE - 1) /
+                       TONEMAP_BLOCK_SIZE;
+    size_t n_samples = MAX(budget / TONEMAP_BLOCK_SIZE, 1);
+
+    if (budget == 0 || n_blocks <= n_samples)
+        job->sample_step = 1;
+    else
+        job->sample_step = (n_blocks + n_samples - 1) / n_samples;
+}
+
+/*
+ * tonemap_job_init — Set up both passes over an image.  PREVIEW @quality
+ * also makes pass 1 sample TONEMAP_SAMPLE_BUDGET pixels.
+ */
+static inline void
+tonemap_job_init(TonemapJob *job, const void *in, TonemapLoadFunc load,
+                 uint8_t *srgb_out, int rowstride,
+                 int width, int height, int num_channels, TonemapIsa isa,
+                 TonemapQuality quality)
+{
+    job->in           = in;
+    job->load         = load;
+    job->srgb_out     = srgb_out;
+    job->rowstride    = (size_t)rowstride;
+    job->width        = (size_t)width;
+    job->pixel_count  = (size_t)width * (size_t)height;
+    job->num_channels = num_channels;
+    job->scale        = 1.0f;
+    job->rgbe_runs    = FALSE;
+    job->sample_step  = 1;
+    job->worker_stats = NULL;
+    tonemap_kernels_init(&job->k, isa, quality);
+    if (quality == TONEMAP_QUALITY_PREVIEW)
+        tonemap_job_sample(job, TONEMAP_SAMPLE_BUDGET);
+}
+
+static inline size_t
+tonemap_job_bands(const TonemapJob *job)
+{
+    return (job->pixel_count + TONEMAP_BAND_PIXELS - 1) / TONEMAP_BAND_PIXELS;
+}
+
+/* Pass 1: statistics over the whole job. */
+static inline void
+tonemap_job_stats(TonemapJob *job, unsigned n_threads, TonemapStats *stats)
+{
+    unsigned n_workers = CLAMP(n_threads, 1, PARALLEL_MAX_THREADS);
+    size_t   n_blocks  = (job->pixel_count + TONEMAP_BLOCK_SIZE - 1) /
+                         TONEMAP_BLOCK_SIZE;
+    size_t   n_strata  = (n_blocks + job->sample_step - 1) / job->sample_step;
+    size_t   per_task  = TONEMAP_BAND_PIXELS / TONEMAP_BLOCK_SIZE;
+
+    tonemap_stats_init(stats);
+
+    job->worker_stats = g_new0(TonemapStats, n_workers);
+    parallel_for((n_strata + per_task - 1) / per_task, n_threads,
+                 tonemap_stats_task, job);
+    for (unsigned i = 0; i < n_workers; i++)
+        tonemap_stats_merge(stats, &job->worker_stats[i]);
+    g_free(job->worker_stats);
+    job->worker_stats = NULL;
+}
+
+/* Pass 2: tonemap and convert each pixel. */
+static inline void
+tonemap_job_apply(TonemapJob *job, unsigned n_threads,
+                  const TonemapStats *stats)
+{
+    job->scale = tonemap_stats_scale(stats);
+    parallel_for(tonemap_job_bands(job), n_threads, tonemap_apply_task, job);
+}
+
+/*
+ * tonemap_reinhard_quality — tonemap_reinhard() with an explicit kernel
+ *                            set, quality and thread count.
+ *
+ * The output is the same for any n_threads.
+ */
+static inline void
+tonemap_reinhard_quality(const float *rgb_in, uint8_t *srgb_out,
+                         int rowstride, int width, int height,
+                         int num_channels, TonemapIsa isa,
+                         TonemapQuality quality, unsigned n_threads)
+{
+    TonemapJob   job;
+    TonemapStats stats;
+
+    tonemap_job_init(&job, rgb_in, tonemap_load_float, srgb_out, rowstride,
+                     width, height, num_channels, isa, quality);
+    tonemap_job_stats(&job, n_threads, &stats);
+    tonemap_job_apply(&job, n_threads, &stats);
+}
+
+/* tonemap_reinhard_isa — tonemap_reinhard_quality() at EXACT quality. */
+static inline void
+tonemap_reinhard_isa(const float *rgb_in, uint8_t *srgb_out, int rowstride,
+                     int width, int height, int num_channels,
+                     TonemapIsa isa, unsigned n_threads)
+{
+    tonemap_reinhard_quality(rgb_in, srgb_out, rowstride, width, height,
+                             num_channels, isa, TONEMAP_QUALITY_EXACT,
+                             n_threads);
+}
+
+/* tonemap_stats_add_format — Add n pixels of @num_channels read by @load. */
+static inline void
+tonemap_stats_add_format(TonemapStats *stats, const void *in,
+                         TonemapLoadFunc load, size_t n, int num_channels)
+{
+    TonemapKernels k;
+    TonemapBlock   blk;
+
+    tonemap_kernels_init(&k, tonemap_best_isa(), TONEMAP_QUALITY_EXACT);
+
+    for (size_t i = 0; i < n; i += TONEMAP_BLOCK_SIZE) {
+        size_t count = n - i;
+        if (count > TONEMAP_BLOCK_SIZE)
+            count = TONEMAP_BLOCK_SIZE;
+
+        load(in, num_channels, i, count, &blk);
+        k.stats(&blk, count, 1, stats->count);
+    }
+}
+
+/*
+ * tonemap_stats_add — Add n interleaved float pixels to pass-1 statistics.
+ *
+ * For decoders that produce pixels a row at a time: feeding each row here
+ * while it is still in cache lets tonemap_reinhard_apply() skip the
+ * separate read of the whole image that pass 1 would otherwise need.
+ */
+static inline void
+tonemap_stats_add(TonemapStats *stats, const float *rgb_in, size_t n,
+                  int num_channels)
+{
+    tonemap_stats_add_format(stats, rgb_in, tonemap_load_float,
+                             n, num_channels);
+}
+
+/*
+ * tonemap_stats_sample — Pass-1 statistics of a whole image of pixels read
+ *                        by @load, from a sample of about @budget pixels.
+ *
+ * The image is cut into equal runs of blocks, and one block from each run,
+ * at a fixed pseudo-random place, is counted for the whole run.  Meant for
+ * previews: with TONEMAP_SAMPLE_BUDGET pixels the log-average typically
+ * lands within about 1% of the exact one.  A @budget of 0, or one at least
+ * the pixel count, reads every pixel and gives exactly tonemap_stats_add().
+ */
+static inline void
+tonemap_stats_sample(TonemapStats *stats, const void *in,
+                     TonemapLoadFunc load, int width, int height,
+                     int num_channels, size_t budget)
+{
+    TonemapJob job;
+
+    tonemap_job_init(&job, in, load, NULL, 0, width, height, num_channels,
+                     tonemap_best_isa(), TONEMAP_QUALITY_EXACT);
+    tonemap_job_sample(&job, budget);
+    tonemap_job_stats(&job, tonemap_default_threads(job.pixel_count /
+                                                    job.sample_step),
+                      stats);
+}
+
+/*
+ * tonemap_reinhard_apply — Pass 2 of tonemap_reinhard() only, with the
+ *                          statistics supplied by the caller.
+ *
+ * Parameters are as for tonemap_reinhard(); @stats would typically come
+ * from tonemap_stats_add() calls made while decoding.  @quality is passed
+ * in, so that a loader can read it once and use it for both passes.
+ */
+static inline void
+tonemap_reinhard_apply(const float *rgb_in, uint8_t *srgb_out, int rowstride,
+                       int width, int height, int num_channels,
+                       const TonemapStats *stats, TonemapQuality quality)
+{
+    TonemapJob job;
+
+    tonemap_job_init(&job, rgb_in, tonemap_load_float, srgb_out, rowstride,
+                     width, height, num_channels, tonemap_best_isa(),
+                     quality);
+    tonemap_job_apply(&job, tonemap_default_threads(job.pixel_count), stats);
+}
+
+/*
+ * tonemap_stats_add_rgbe — tonemap_stats_add() for n Radiance RGBE pixels.
+ *
+ * A long run of identical pixels is converted once and counted len times.
+ */
+static inline void
+tonemap_stats_add_rgbe(TonemapStats *stats, const uint8_t *rgbe_in, size_t n)
+{
+    TonemapLoadFunc load = tonemap_rgbe_loader();
+    TonemapKernels  k;
+    size_t i = 0;
+
+    tonemap_kernels_init(&k, tonemap_best_isa(), TONEMAP_QUALITY_EXACT);
+
+    while (i < n) {
+        size_t len;
+        size_t run = i + tonemap_rgbe_next_run(rgbe_in + i * 4, n - i, &len);
+
+        tonemap_stats_add_format(stats, rgbe_in + i * 4, load, run - i, 4);
+        if (len > 0) {
+            TonemapBlock blk;
+
+            load(rgbe_in + run * 4, 4, 0, 1, &blk);
+            k.stats(&blk, 1, (uint32_t)len, stats->count);
+        }
+        i = run + len;
+    }
+}
+
+/*
+ * tonemap_reinhard_rgbe_apply — tonemap_reinhard_apply() for Radiance RGBE
+ *                               input, 4 bytes per pixel.
+ */
+static inline void
+tonemap_reinhard_rgbe_apply(const uint8_t *rgbe_in, uint8_t *srgb_out,
+                            int rowstride, int width, int height,
+                            const TonemapStats *stats, TonemapQuality quality)
+{
+    TonemapJob job;
+
+    tonemap_job_init(&job, rgbe_in, tonemap_rgbe_loader(), srgb_out, rowstride,
+                     width, height, 4, tonemap_best_isa(), quality);
+    job.rgbe_runs = TRUE;
+    tonemap_job_apply(&job, tonemap_default_threads(job.pixel_count), stats);
+}
+
+/*
+ * tonemap_reinhard_rgbe — tonemap_reinhard() for Radiance RGBE input.
+ *
+ * Pixels are decoded a block at a time, so the image never exists as
+ * floats: 4 bytes per pixel in, 4 bytes per pixel out.  Output matches
+ * tonemap_reinhard() on the same pixels decoded to float RGB.
+ */
+static inline void
+tonemap_reinhard_rgbe(const uint8_t *rgbe_in, uint8_t *srgb_out, int rowstride,
+                      int width, int height)
+{
+    TonemapJob   job;
+    TonemapStats stats;
+    unsigned     n_threads;
+
+    tonemap_job_init(&job, rgbe_in, tonemap_rgbe_loader(), srgb_out, rowstride,
+                     width, height, 4, tonemap_best_isa(),
+                     tonemap_default_quality());
+    job.rgbe_runs = TRUE;
+    n_threads = tonemap_default_threads(job.pixel_count);
+    tonemap_job_stats(&job, n_threads, &stats);
+    tonemap_job_apply(&job, n_threads, &stats);
+}
+
+/*
+ * tonemap_stats_add_half — tonemap_stats_add() for n interleaved IEEE
+ *                          binary16 pixels.
+ */
+static inline void
+tonemap_stats_add_half(TonemapStats *stats, const uint16_t *half_in,
+                       size_t n, int num_channels)
+{
+    tonemap_stats_add_format(stats, half_in, tonemap_half_loader(),
+                             n, num_channels);
+}
+
+/*
+ * tonemap_reinhard_half_apply — tonemap_reinhard_apply() for binary16
+ *                               input.
+ */
+static inline void
+tonemap_reinhard_half_apply(const uint16_t *half_in,
+                            uint8_t *srgb_out, int rowstride,
+                            int width, int height, int num_channels,
+                            const TonemapStats *stats, TonemapQuality quality)
+{
+    TonemapJob job;
+
+    tonemap_job_init(&job, half_in, tonemap_half_loader(), srgb_out,
+                     rowstride, width, height, num_channels,
+                     tonemap_best_isa(), quality);
+    tonemap_job_apply(&job, tonemap_default_threads(job.pixel_count), stats);
+}
+
+/*
+ * tonemap_reinhard_half — tonemap_reinhard() for IEEE binary16 input, as
+ *                         stored in HALF EXR channels.
+ *
+ * Samples are widened a block at a time, so a half image is never held
+ * as floats.  Output matches tonemap_reinhard() on the same pixels
+ * converted to float.
+ */
+static inline void
+tonemap_reinhard_half(const uint16_t *half_in, uint8_t *srgb_out,
+                      int rowstride, int width, int height, int num_channels)
+{
+    TonemapJob   job;
+    TonemapStats stats;
+    unsigned     n_threads;
+
+    tonemap_job_init(&job, half_in, tonemap_half_loader(), srgb_out,
+                     rowstride, width, height, num_channels,
+                     tonemap_best_isa(), tonemap_default_quality());
+    n_threads = tonemap_default_threads(job.pixel_count);
+    tonemap_job_stats(&job, n_threads, &stats);
+    tonemap_job_apply(&job, n_threads, &stats);
+}
+
+/*
+ * tonemap_reinhard_planes — Both passes of tonemap_reinhard() over planes
+ *                           read by @load at @quality, with pass 1
+ *                           sampling about @sample_budget pixels (0: all
+ *                           of them).
+ */
+static inline void
+tonemap_reinhard_planes(const TonemapPlanes *planes, TonemapLoadFunc load,
+                        uint8_t *srgb_out, int rowstride,
+                        int width, int height, size_t sample_budget,
+                        TonemapQuality quality)
+{
+    TonemapJob   job;
+    TonemapStats stats;
+    unsigned     n_threads;
+
+    tonemap_job_init(&job, planes, load, srgb_out, rowstride,
+                     width, height, planes->channel[3] ? 4 : 3,
+                     tonemap_best_isa(), quality);
+    if (sample_budget > 0)
+        tonemap_job_sample(&job, sample_budget);
+    n_threads = tonemap_default_threads(job.pixel_count);
+    tonemap_job_stats(&job, n_threads, &stats);
+    tonemap_job_apply(&job, n_threads, &stats);
+}
+
+/*
+ * tonemap_reinhard_planar — tonemap_reinhard() for an image held as one
+ *                           float plane per channel.
+ *
+ * Blocks are filled by straight copies from each plane, so a planar image
+ * (such as TinyEXR's) needn't be interleaved first.  Output matches
+ * tonemap_reinhard() on the same pixels interleaved.
+ */
+static inline void
+tonemap_reinhard_planar(const TonemapPlanes *planes, uint8_t *srgb_out,
+                        int rowstride, int width, int height)
+{
+    tonemap_reinhard_planes(planes, tonemap_load_planar, srgb_out,
+                            rowstride, width, height, 0,
+                            tonemap_default_quality());
+}
+
+/*
+ * tonemap_reinhard_planar_half — tonemap_reinhard_planar() for binary16
+ *                                planes.
+ */
+static inline void
+tonemap_reinhard_planar_half(const TonemapPlanes *planes, uint8_t *srgb_out,
+                             int rowstride, int width, int height)
+{
+    tonemap_reinhard_planes(planes, tonemap_planar_half_loader(), srgb_out,
+                            rowstride, width, height, 0,
+                            tonemap_default_quality());
+}
+
+/*
+ * tonemap_reinhard — Tonemap HDR float pixels to 8-bit sRGB using the
+ *                    Reinhard global operator with auto-exposure.
+ *
+ * @rgb_in:        Input float pixel data, num_channels floats per pixel.
+ * @srgb_out:      Output buffer, always 4 bytes (RGBA) per pixel, such
+ *                 as the pixels of an 8-bit RGBA GdkPixbuf.
+ * @rowstride:     Bytes between the starts of output rows, at least
+ *                 width * 4.
+ * @width:         Image width in pixels.
+ * @height:        Image height in pixels.
+ * @num_channels:  Channels per input pixel (3 = RGB, 4 = RGBA).
+ *
+ * The algorithm runs in two passes:
+ *   1. Histogram log luminance and take the log-average of valid pixels.
+ *   2. Apply the Reinhard operator per-pixel, convert to sRGB, and write out.
+ *
+ * Both passes use the widest kernels the CPU supports and, for images of
+ * TONEMAP_PARALLEL_MIN_PIXELS or more, the shared thread pool.  Pass 1
+ * only counts, so its result doesn't depend on how the work was split.
+ * GDK_PIXBUF_HDR_QUALITY picks the TonemapQuality; the default is EXACT.
+ *
+ * NaN/Inf values are treated as invalid and mapped to black.  This is
+ * important for robustness when loading untrusted EXR files.
+ */
+static inline void
+tonemap_reinhard(const float *rgb_in, uint8_t *srgb_out, int rowstride,
+                 int width, int height, int num_channels)
+{
+    size_t pixel_count = (size_t)width * (size_t)height;
+
+    tonemap_reinhard_quality(rgb_in, srgb_out, rowstride, width, height,
+                             num_channels, tonemap_best_isa(),
+                             tonemap_default_quality(),
+                             tonemap_default_threads(pixel_count));
+}
+
 #endif /* TONEMAP_H */